@@ -1,123 +1,2077 @@
+#include <unistd.h>
+#include <time.h>
 
 #include <cephfs/libcephfs.h>
 
+#include "libcephfsd.h"
+
 #include "proxy_log.h"
 #include "proxy_helpers.h"
+#include "proxy_list.h"
+#include "proxy_buffer.h"
 #include "proxy_requests.h"
 
-struct ceph_mount_info {
-    proxy_link_t link;
-    uint64_t cmount;
-    bool good;
-};
+/* Reconnection attempts and the initial delay between them (in microseconds).
+ * The delay is doubled on each attempt up to PROXY_RECONNECT_MAX_DELAY. */
+#define PROXY_RECONNECT_ATTEMPTS 12
+#define PROXY_RECONNECT_DELAY 10000
+#define PROXY_RECONNECT_MAX_DELAY 1000000
+
+/* Requests sent through a mount don't have a deadline unless this environment
+ * variable contains the number of milliseconds the daemon can wait before
+ * starting them. It can be changed for each mount with ceph_set_timeout(), up
+ * to PROXY_TIMEOUT_MAX. */
+#define PROXY_TIMEOUT_ENV "LIBCEPHFSD_TIMEOUT"
+#define PROXY_TIMEOUT_MAX UINT16_MAX
+
+/* The xattr cache is disabled unless this environment variable contains the
+ * number of milliseconds that cached xattrs remain valid. */
+#define PROXY_XATTR_CACHE_ENV "LIBCEPHFSD_XATTR_CACHE"
+
+/* Maximum number of inodes whose xattrs are cached on each mount. */
+#define PROXY_XATTR_CACHE_ENTRIES 256
+
+/* Maximum size of all the xattrs of an inode that can be cached. It matches
+ * the biggest answer that libcephfsd can build. */
+#define PROXY_XATTR_CACHE_SIZE PROXY_ANSWER_BUFFER
+
+/* Size probes of xattrs (a call with a size of 0) also fetch the data if it's
+ * not bigger than this. The data is kept for the call that normally follows,
+ * but only for PROXY_XATTR_STASH_TTL milliseconds. */
+#define PROXY_XATTR_FETCH (256 * 1024)
+#define PROXY_XATTR_STASH_TTL 100
+
+/* Inode references released by ceph_ll_put() are queued and sent in batches,
+ * as one-way requests, once the queue is full or the oldest entry
+ * has waited for PROXY_PUT_DELAY milliseconds. The queue is always sent before
+ * unmounting or releasing the mount. */
+#define PROXY_PUT_BATCH 64
+#define PROXY_PUT_DELAY 10
+
+/* Write-behind is disabled unless this environment variable contains the size
+ * (in KiB) of the buffer where small contiguous writes to a file handle are
+ * coalesced. It can't be bigger than PROXY_WRITE_MAX_SIZE. */
+#define PROXY_WRITE_BEHIND_ENV "LIBCEPHFSD_WRITE_BEHIND"
+#define PROXY_WRITE_MAX_SIZE (4 * 1024 * 1024)
+
+/* Maximum number of file handles with pending writes on each mount. Buffered
+ * data is sent once it has waited for PROXY_WRITE_DELAY milliseconds, even if
+ * no other sync point has been reached. */
+#define PROXY_WRITE_FILES 64
+#define PROXY_WRITE_DELAY 50
+
+/* A mount with deferred work that is busy when it should be flushed is checked
+ * again after PROXY_FLUSH_RETRY milliseconds. */
+#define PROXY_FLUSH_RETRY 10
+
+/* Read-ahead is disabled unless this environment variable contains the size
+ * (in KiB) of the window prefetched for sequential readers. It can't be bigger
+ * than PROXY_READ_AHEAD_MAX. */
+#define PROXY_READ_AHEAD_ENV "LIBCEPHFSD_READ_AHEAD"
+#define PROXY_READ_AHEAD_MAX (4 * 1024 * 1024)
+
+/* Maximum number of file handles whose reads are tracked on each mount, and
+ * number of consecutive sequential reads that start the read-ahead. */
+#define PROXY_READ_FILES 64
+#define PROXY_READ_SEQUENTIAL 2
+
+/* Maximum number of unused UserPerm handles kept in the cache. */
+#define PROXY_USERPERM_IDLE 64
+
+/* Maximum number of idle connections kept for global operations. */
+#define PROXY_GLOBAL_IDLE 8
+
+/* Calls that modify the state of a mount are recorded so that they can be
+ * replayed on a new session if the connection to libcephfsd is lost and the
+ * previous session can't be resumed (for example after a restart). */
+typedef struct _proxy_setup {
+    list_t list;
+    const char *args[2];
+    uint32_t op;
+    uint32_t size;
+    char data[];
+} proxy_setup_t;
+
+/* All the xattrs of an inode, as returned by LIBCEPHFSD_OP_LL_GETXATTRS. */
+typedef struct _proxy_xattr_cache {
+    list_t list;
+    uint64_t inode;
+    uint64_t userperm;
+    uint64_t expires;
+    uint32_t count;
+    uint32_t size;
+    uint8_t data[];
+} proxy_xattr_cache_t;
+
+/* A UserPerm handle created by libcephfsd for some credentials. Stale handles
+ * belong to a previous run of the daemon and are only kept until the caller
+ * releases them. */
+typedef struct _proxy_userperm {
+    list_t list;
+    uint64_t handle;
+    uint32_t refs;
+    bool stale;
+    uid_t uid;
+    gid_t gid;
+    int32_t groups;
+    gid_t gids[];
+} proxy_userperm_t;
+
+/* Data returned by the last xattr size probe. The name is NULL for the list of
+ * xattrs. */
+typedef struct _proxy_xattr_stash {
+    uint64_t inode;
+    uint64_t userperm;
+    uint64_t expires;
+    char *name;
+    void *data;
+    uint32_t size;
+} proxy_xattr_stash_t;
+
+/* Writes to a file handle that have not been sent yet. The entry is kept after
+ * the data has been sent only if the write failed, until the error can be
+ * reported. */
+typedef struct _proxy_file {
+    list_t list;
+    uint64_t fh;
+    int64_t offset;
+    uint32_t size;
+    int32_t error;
+    uint8_t data[];
+} proxy_file_t;
+
+/* Read pattern of a file handle, and the data prefetched for it. */
+typedef struct _proxy_stream {
+    list_t list;
+    uint64_t fh;
+    uint64_t session;
+    int64_t next;
+    uint32_t sequential;
+    int64_t offset;
+    uint32_t size;
+    proxy_ceph_ll_read_ans_t ans;
+    uint8_t *data;
+} proxy_stream_t;
+
+struct ceph_mount_info {
+    pthread_mutex_t mutex;
+    proxy_link_t link;
+    proxy_buffer_t buffer;
+    list_t setup;
+    list_t xattrs;
+    uint32_t xattr_count;
+    proxy_xattr_stash_t *stash;
+    proxy_put_entry_t puts[PROXY_PUT_BATCH];
+    uint32_t put_count;
+    uint64_t put_time;
+    list_t files;
+    uint32_t file_count;
+    uint32_t dirty;
+    uint64_t dirty_time;
+    list_t streams;
+    uint32_t stream_count;
+    proxy_stream_t *pending;
+    uint64_t cmount;
+    uint64_t session;
+    uint64_t seq;
+    uint64_t wait_seq;
+    list_t list;
+    list_t flush;
+    uint64_t flush_time;
+    int32_t deferred;
+    uint32_t timeout;
+    bool global;
+    bool good;
+};
+
+/* Global operations
+ *
+ * Operations not related to a mount (credentials and version) use a pool of
+ * connections. Each caller takes an idle connection, or creates a new one if
+ * all of them are in use, so concurrent threads never share a socket and are
+ * not serialized. */
+
+static pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list_t global_pool = LIST_INIT(&global_pool);
+static uint32_t global_idle = 0;
+
+static bool spin_configured = false;
+
+static bool
+client_stop(proxy_link_t *link)
+{
+    return false;
+}
+
+static int32_t
+proxy_connect(proxy_link_t *link)
+{
+    CEPH_REQ(hello, req, 0, ans, 0);
+    const char *path, *env;
+    int32_t sd, err;
+
+    path = getenv(PROXY_SOCKET_ENV);
+    if ((path == NULL) || (*path == 0)) {
+        path = PROXY_SOCKET;
+    }
+
+    if (!spin_configured) {
+        env = getenv(PROXY_SPIN_ENV);
+        if (env != NULL) {
+            proxy_link_spin_set(strtoul(env, NULL, 10));
+        }
+        spin_configured = true;
+    }
+
+    sd = proxy_link_client(link, path, client_stop);
+    if (sd < 0) {
+        return sd;
+    }
+
+    req.id = LIBCEPHFS_LIB_CLIENT;
+    err = proxy_link_send(sd, req_iov, 1);
+    if (err < 0) {
+        goto failed;
+    }
+    err = proxy_link_recv(sd, ans_iov, 1);
+    if (err < 0) {
+        goto failed;
+    }
+
+    if (ans.major < 0) {
+        err = proxy_log(LOG_ERR, -ans.major,
+                        "Connection refused by libcephfsd");
+        goto failed;
+    }
+
+    proxy_log(LOG_INFO, 0, "Connected to libcephfsd version %d.%d", ans.major,
+              ans.minor);
+
+    if ((ans.major != LIBCEPHFSD_MAJOR) || (ans.minor < LIBCEPHFSD_MINOR)) {
+        err = proxy_log(LOG_ERR, ENOTSUP, "Version not supported");
+        goto failed;
+    }
+
+    return sd;
+
+failed:
+    proxy_link_close(link);
+
+    return err;
+}
+
+static void
+proxy_disconnect(proxy_link_t *link)
+{
+    proxy_link_close(link);
+}
+
+static int32_t
+proxy_setup_add(struct ceph_mount_info *cmount, uint32_t op, const char *arg1,
+                const char *arg2, uint32_t size)
+{
+    proxy_setup_t *setup;
+    uint32_t len1, len2;
+
+    len1 = (arg1 != NULL) ? strlen(arg1) + 1 : 0;
+    len2 = (arg2 != NULL) ? strlen(arg2) + 1 : 0;
+
+    setup = proxy_malloc(sizeof(proxy_setup_t) + len1 + len2);
+    if (setup == NULL) {
+        return -ENOMEM;
+    }
+
+    setup->op = op;
+    setup->size = size;
+    setup->args[0] = NULL;
+    setup->args[1] = NULL;
+    if (arg1 != NULL) {
+        setup->args[0] = memcpy(setup->data, arg1, len1);
+    }
+    if (arg2 != NULL) {
+        setup->args[1] = memcpy(setup->data + len1, arg2, len2);
+    }
+
+    list_add_tail(&setup->list, &cmount->setup);
+
+    return 0;
+}
+
+/* Forget the last recorded call of type 'op'. */
+static void
+proxy_setup_del(struct ceph_mount_info *cmount, uint32_t op)
+{
+    proxy_setup_t *setup;
+
+    for (setup = list_last_entry(&cmount->setup, proxy_setup_t, list);
+         &setup->list != &cmount->setup;
+         setup = list_last_entry(&setup->list, proxy_setup_t, list)) {
+        if (setup->op == op) {
+            list_del(&setup->list);
+            proxy_free(setup);
+            break;
+        }
+    }
+}
+
+static void
+proxy_setup_destroy(struct ceph_mount_info *cmount)
+{
+    proxy_setup_t *setup;
+
+    while (!list_empty(&cmount->setup)) {
+        setup = list_first_entry(&cmount->setup, proxy_setup_t, list);
+        list_del(&setup->list);
+        proxy_free(setup);
+    }
+}
+
+/* Current time in milliseconds. */
+static uint64_t
+proxy_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/* Background flush
+ *
+ * Deferred work (inode releases and buffered writes) must not wait for the
+ * next request of the mount, which may never come if the application goes
+ * idle. A thread checks the mounts with deferred work once it has waited long
+ * enough, and flushes the ones that are idle. Every public function holds the
+ * mutex of its mount while it runs, so the thread only takes mounts whose
+ * mutex is free, and retries later the ones that are busy. */
+
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_condition;
+static list_t flush_list = LIST_INIT(&flush_list);
+static bool flush_started = false;
+
+/* Ask the flush thread to check the mount at 'time' (in milliseconds). Must be
+ * called with the mutex of the mount held. If the thread is not running, the
+ * work is only flushed by the next request of the mount. */
+static void
+proxy_flush_queue(struct ceph_mount_info *cmount, uint64_t time)
+{
+    proxy_mutex_lock(&flush_mutex);
+
+    if (flush_started) {
+        if (list_empty(&cmount->flush)) {
+            list_add_tail(&cmount->flush, &flush_list);
+            cmount->flush_time = time;
+            proxy_condition_signal(&flush_condition);
+        } else if (time < cmount->flush_time) {
+            cmount->flush_time = time;
+            proxy_condition_signal(&flush_condition);
+        }
+    }
+
+    proxy_mutex_unlock(&flush_mutex);
+}
+
+/* Stop checking the mount. Must be called with the mutex of the mount held. */
+static void
+proxy_flush_cancel(struct ceph_mount_info *cmount)
+{
+    proxy_mutex_lock(&flush_mutex);
+    list_del_init(&cmount->flush);
+    proxy_mutex_unlock(&flush_mutex);
+}
+
+/* Xattr cache
+ *
+ * Samba reads several xattrs (ACLs, DOS attributes) on almost every open. To
+ * avoid a round trip for each of them, the first request for an inode fetches
+ * all its xattrs at once and keeps them for a short time. Changes made through
+ * the same mount invalidate the cached data. Changes made by other clients may
+ * not be seen until the cached data expires, so the cache is only enabled when
+ * explicitly requested.
+ *
+ * Names are only answered from the cache if they belong to one of the regular
+ * namespaces, since virtual xattrs (like "ceph.*") are not returned when all
+ * xattrs are listed. */
+
+static int64_t xattr_cache_ttl = -1;
+
+static bool
+proxy_xattr_enabled(const char *name)
+{
+    static const char *namespaces[] = {
+        "user.", "security.", "system.", "trusted.", NULL
+    };
+    const char *env;
+    int32_t i;
+
+    if (xattr_cache_ttl < 0) {
+        env = getenv(PROXY_XATTR_CACHE_ENV);
+        xattr_cache_ttl = (env != NULL) ? strtoul(env, NULL, 10) : 0;
+    }
+    if (xattr_cache_ttl == 0) {
+        return false;
+    }
+
+    for (i = 0; namespaces[i] != NULL; i++) {
+        if (strncmp(name, namespaces[i], strlen(namespaces[i])) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+proxy_xattr_drop(struct ceph_mount_info *cmount, proxy_xattr_cache_t *cache)
+{
+    list_del(&cache->list);
+    cmount->xattr_count--;
+
+    proxy_free(cache);
+}
+
+static void
+proxy_xattr_unstash(struct ceph_mount_info *cmount)
+{
+    proxy_xattr_stash_t *stash;
+
+    stash = cmount->stash;
+    if (stash != NULL) {
+        cmount->stash = NULL;
+        proxy_free(stash->data);
+        proxy_free(stash);
+    }
+}
+
+/* Keep the data returned by a size probe. Ownership of 'data' is transferred
+ * to the stash. */
+static void
+proxy_xattr_stash(struct ceph_mount_info *cmount, uint64_t inode,
+                  uint64_t userperm, const char *name, void *data,
+                  uint32_t size)
+{
+    proxy_xattr_stash_t *stash;
+    uint32_t len;
+
+    proxy_xattr_unstash(cmount);
+
+    len = (name != NULL) ? strlen(name) + 1 : 0;
+    stash = proxy_malloc(sizeof(proxy_xattr_stash_t) + len);
+    if (stash == NULL) {
+        proxy_free(data);
+        return;
+    }
+
+    stash->inode = inode;
+    stash->userperm = userperm;
+    stash->expires = proxy_now() + PROXY_XATTR_STASH_TTL;
+    stash->name = NULL;
+    if (name != NULL) {
+        stash->name = (char *)(stash + 1);
+        memcpy(stash->name, name, len);
+    }
+    stash->data = data;
+    stash->size = size;
+
+    cmount->stash = stash;
+}
+
+/* Answer a call from the data of the previous size probe. Returns -EAGAIN if
+ * the data is not available and the daemon needs to be asked. */
+static int32_t
+proxy_xattr_stashed(struct ceph_mount_info *cmount, uint64_t inode,
+                    uint64_t userperm, const char *name, void *data,
+                    size_t size)
+{
+    proxy_xattr_stash_t *stash;
+    uint32_t len;
+
+    stash = cmount->stash;
+    if (stash == NULL) {
+        return -EAGAIN;
+    }
+
+    if ((stash->inode != inode) || (stash->userperm != userperm) ||
+        ((stash->name == NULL) != (name == NULL)) ||
+        ((name != NULL) && (strcmp(stash->name, name) != 0)) ||
+        (stash->expires < proxy_now())) {
+        proxy_xattr_unstash(cmount);
+        return -EAGAIN;
+    }
+
+    /* Another probe or a too small buffer. Let the daemon answer it. */
+    len = stash->size;
+    if ((size == 0) || (size < len)) {
+        proxy_xattr_unstash(cmount);
+        return -EAGAIN;
+    }
+
+    memcpy(data, stash->data, len);
+    proxy_xattr_unstash(cmount);
+
+    return len;
+}
+
+/* Remove the cached xattrs of an inode, or all of them if inode is 0. */
+static void
+proxy_xattr_invalidate(struct ceph_mount_info *cmount, uint64_t inode)
+{
+    proxy_xattr_cache_t *cache;
+    list_t *item, *next;
+
+    if ((cmount->stash != NULL) &&
+        ((inode == 0) || (cmount->stash->inode == inode))) {
+        proxy_xattr_unstash(cmount);
+    }
+
+    for (item = cmount->xattrs.next; item != &cmount->xattrs; item = next) {
+        next = item->next;
+        cache = list_entry(item, proxy_xattr_cache_t, list);
+        if ((inode == 0) || (cache->inode == inode)) {
+            proxy_xattr_drop(cmount, cache);
+        }
+    }
+}
+
+static proxy_xattr_cache_t *
+proxy_xattr_find(struct ceph_mount_info *cmount, uint64_t inode,
+                 uint64_t userperm)
+{
+    proxy_xattr_cache_t *cache;
+
+    list_for_each_entry(cache, &cmount->xattrs, list) {
+        if ((cache->inode == inode) && (cache->userperm == userperm)) {
+            if (cache->expires < proxy_now()) {
+                proxy_xattr_drop(cmount, cache);
+                return NULL;
+            }
+            list_move(&cache->list, &cmount->xattrs);
+            return cache;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+proxy_xattr_insert(struct ceph_mount_info *cmount, proxy_xattr_cache_t *cache)
+{
+    if (cmount->xattr_count >= PROXY_XATTR_CACHE_ENTRIES) {
+        proxy_xattr_drop(cmount, list_last_entry(&cmount->xattrs,
+                                                 proxy_xattr_cache_t, list));
+    }
+
+    cache->expires = proxy_now() + xattr_cache_ttl;
+    list_add(&cache->list, &cmount->xattrs);
+    cmount->xattr_count++;
+}
+
+/* Returns -EAGAIN if the xattr needs to be requested to the daemon. Entries
+ * are not aligned in the answer, so they are copied before being used. */
+static int32_t
+proxy_xattr_lookup(proxy_xattr_cache_t *cache, const char *name, void *value,
+                   size_t size)
+{
+    proxy_xattr_entry_t entry;
+    const char *entry_name;
+    uint32_t i, pos;
+
+    pos = 0;
+    for (i = 0; i < cache->count; i++) {
+        if (cache->size - pos < sizeof(entry)) {
+            return -EAGAIN;
+        }
+        memcpy(&entry, cache->data + pos, sizeof(entry));
+        pos += sizeof(entry);
+        entry_name = (const char *)cache->data + pos;
+        if (cache->size - pos < entry.name_len) {
+            return -EAGAIN;
+        }
+        pos += entry.name_len;
+        if ((entry.size > 0) && (cache->size - pos < (uint32_t)entry.size)) {
+            return -EAGAIN;
+        }
+        if (strcmp(entry_name, name) == 0) {
+            if (entry.size < 0) {
+                return -EAGAIN;
+            }
+            if (size == 0) {
+                return entry.size;
+            }
+            if (size < entry.size) {
+                return -ERANGE;
+            }
+            memcpy(value, cache->data + pos, entry.size);
+
+            return entry.size;
+        }
+        if (entry.size > 0) {
+            pos += entry.size;
+        }
+    }
+
+    return -ENODATA;
+}
+
+/* UserPerm cache
+ *
+ * Callers usually create a new UserPerm for each operation, but with only a
+ * few different credentials. Handles are reused for identical credentials,
+ * and the unused ones are kept for a while instead of destroying them, so
+ * most calls to ceph_userperm_new() don't need a request to libcephfsd. */
+
+static pthread_mutex_t userperm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list_t userperm_list = LIST_INIT(&userperm_list);
+static uint32_t userperm_idle = 0;
+static uint64_t userperm_instance = 0;
+
+static uint64_t
+proxy_userperm_find(uid_t uid, gid_t gid, int32_t groups, const gid_t *gids)
+{
+    proxy_userperm_t *userperm;
+    uint64_t handle;
+
+    handle = 0;
+
+    proxy_mutex_lock(&userperm_mutex);
+
+    list_for_each_entry(userperm, &userperm_list, list) {
+        if (!userperm->stale && (userperm->uid == uid) &&
+            (userperm->gid == gid) && (userperm->groups == groups) &&
+            (memcmp(userperm->gids, gids, groups * sizeof(gid_t)) == 0)) {
+            if (userperm->refs++ == 0) {
+                userperm_idle--;
+            }
+            list_move(&userperm->list, &userperm_list);
+            handle = userperm->handle;
+            break;
+        }
+    }
+
+    proxy_mutex_unlock(&userperm_mutex);
+
+    return handle;
+}
+
+/* Returns false if the handle was already cached (another thread created it
+ * at the same time). In that case the caller owns an extra reference in
+ * libcephfsd that needs to be released. */
+static bool
+proxy_userperm_insert(uint64_t handle, uid_t uid, gid_t gid, int32_t groups,
+                      const gid_t *gids)
+{
+    proxy_userperm_t *userperm;
+
+    proxy_mutex_lock(&userperm_mutex);
+
+    list_for_each_entry(userperm, &userperm_list, list) {
+        if (!userperm->stale && (userperm->handle == handle)) {
+            if (userperm->refs++ == 0) {
+                userperm_idle--;
+            }
+            proxy_mutex_unlock(&userperm_mutex);
+
+            return false;
+        }
+    }
+
+    proxy_mutex_unlock(&userperm_mutex);
+
+    /* If there's no memory, the handle is simply not cached. */
+    userperm = proxy_malloc(sizeof(proxy_userperm_t) +
+                            groups * sizeof(gid_t));
+    if (userperm == NULL) {
+        return true;
+    }
+
+    userperm->handle = handle;
+    userperm->refs = 1;
+    userperm->stale = false;
+    userperm->uid = uid;
+    userperm->gid = gid;
+    userperm->groups = groups;
+    memcpy(userperm->gids, gids, groups * sizeof(gid_t));
+
+    proxy_mutex_lock(&userperm_mutex);
+    list_add(&userperm->list, &userperm_list);
+    proxy_mutex_unlock(&userperm_mutex);
+
+    return true;
+}
+
+/* Release a reference to a handle. Returns the handle that needs to be
+ * destroyed in libcephfsd, if any. */
+static uint64_t
+proxy_userperm_release(uint64_t handle)
+{
+    proxy_userperm_t *userperm;
+    uint64_t victim;
+
+    victim = handle;
+
+    proxy_mutex_lock(&userperm_mutex);
+
+    list_for_each_entry(userperm, &userperm_list, list) {
+        if (userperm->handle == handle) {
+            victim = 0;
+            if (--userperm->refs > 0) {
+                break;
+            }
+            if (userperm->stale) {
+                /* The daemon that created it is gone. */
+                list_del(&userperm->list);
+                proxy_free(userperm);
+            } else {
+                userperm_idle++;
+            }
+            break;
+        }
+    }
+
+    /* Destroy the least recently used unused handle if there are too many. */
+    if (userperm_idle > PROXY_USERPERM_IDLE) {
+        for (userperm = list_last_entry(&userperm_list, proxy_userperm_t,
+                                        list);
+             userperm->refs > 0;
+             userperm = list_last_entry(&userperm->list, proxy_userperm_t,
+                                        list)) {
+        }
+        list_del(&userperm->list);
+        userperm_idle--;
+        victim = userperm->handle;
+        proxy_free(userperm);
+    }
+
+    proxy_mutex_unlock(&userperm_mutex);
+
+    return victim;
+}
+
+/* Forget all cached handles if the connection has been established with a
+ * different run of the daemon, since its handles are not valid anymore. There
+ * is nothing to destroy in the new daemon. Handles still in use are marked as
+ * stale so that they are never reused nor destroyed when released. */
+static void
+proxy_userperm_invalidate(uint64_t instance)
+{
+    proxy_userperm_t *userperm, *tmp;
+
+    proxy_mutex_lock(&userperm_mutex);
+
+    if (instance == userperm_instance) {
+        proxy_mutex_unlock(&userperm_mutex);
+        return;
+    }
+    userperm_instance = instance;
+
+    list_for_each_entry_safe(userperm, tmp, &userperm_list, list) {
+        if (userperm->refs > 0) {
+            userperm->stale = true;
+        } else {
+            list_del(&userperm->list);
+            proxy_free(userperm);
+        }
+    }
+    userperm_idle = 0;
+
+    proxy_mutex_unlock(&userperm_mutex);
+}
+
+/* Requests are numbered in the order they are sent through the connection of
+ * the mount, so that ceph_cancel() can identify the one in progress. Prefetches
+ * and one-way requests also take a number, so the number of the request whose
+ * answer the caller is waiting for is kept apart in 'wait_seq' (0 if none). */
+static void
+proxy_seq_next(struct ceph_mount_info *cmount)
+{
+    __atomic_store_n(&cmount->seq, cmount->seq + 1, __ATOMIC_RELAXED);
+}
+
+#define CEPH_REPLAY(_cmount, _op, _req, _ans) \
+    ({ \
+        proxy_seq_next(_cmount); \
+        int32_t __err = CEPH_CALL((_cmount)->link.sd, &(_cmount)->buffer, \
+                                  _op, _req, _ans); \
+        if (__err >= 0) { \
+            __err = (_ans).header.result; \
+            if ((__err >= 0) && \
+                ((_ans).header.header_len < sizeof(_ans))) { \
+                __err = -EPROTO; \
+            } \
+        } \
+        __err; \
+    })
+
+static int32_t
+proxy_setup_replay(struct ceph_mount_info *cmount, proxy_setup_t *setup)
+{
+    switch (setup->op) {
+    case LIBCEPHFSD_OP_CREATE: {
+        CEPH_REQ(ceph_create, req, 1, ans, 0);
+        int32_t err;
+
+        CEPH_STR_ADD(req, id, setup->args[0]);
+
+        err = CEPH_REPLAY(cmount, LIBCEPHFSD_OP_CREATE, req, ans);
+        if (err >= 0) {
+            cmount->cmount = ans.cmount;
+        }
+
+        return err;
+    }
+    case LIBCEPHFSD_OP_CONF_READ_FILE: {
+        CEPH_REQ(ceph_conf_read_file, req, 1, ans, 0);
+
+        req.cmount = cmount->cmount;
+        CEPH_STR_ADD(req, path, setup->args[0]);
+
+        return CEPH_REPLAY(cmount, LIBCEPHFSD_OP_CONF_READ_FILE, req, ans);
+    }
+    case LIBCEPHFSD_OP_CONF_GET: {
+        CEPH_REQ(ceph_conf_get, req, 1, ans, 1);
+        char value[setup->size + 1];
+
+        req.cmount = cmount->cmount;
+        req.size = setup->size;
+        CEPH_STR_ADD(req, option, setup->args[0]);
+        CEPH_BUFF_ADD(ans, value, setup->size);
+
+        return CEPH_REPLAY(cmount, LIBCEPHFSD_OP_CONF_GET, req, ans);
+    }
+    case LIBCEPHFSD_OP_CONF_SET: {
+        CEPH_REQ(ceph_conf_set, req, 2, ans, 0);
+
+        req.cmount = cmount->cmount;
+        CEPH_STR_ADD(req, option, setup->args[0]);
+        CEPH_STR_ADD(req, value, setup->args[1]);
+
+        return CEPH_REPLAY(cmount, LIBCEPHFSD_OP_CONF_SET, req, ans);
+    }
+    case LIBCEPHFSD_OP_SELECT_FILESYSTEM: {
+        CEPH_REQ(ceph_select_filesystem, req, 1, ans, 0);
+
+        req.cmount = cmount->cmount;
+        CEPH_STR_ADD(req, fs, setup->args[0]);
+
+        return CEPH_REPLAY(cmount, LIBCEPHFSD_OP_SELECT_FILESYSTEM, req, ans);
+    }
+    case LIBCEPHFSD_OP_INIT: {
+        CEPH_REQ(ceph_init, req, 0, ans, 0);
+
+        req.cmount = cmount->cmount;
+
+        return CEPH_REPLAY(cmount, LIBCEPHFSD_OP_INIT, req, ans);
+    }
+    case LIBCEPHFSD_OP_MOUNT: {
+        CEPH_REQ(ceph_mount, req, 1, ans, 0);
+
+        req.cmount = cmount->cmount;
+        CEPH_STR_ADD(req, root, setup->args[0]);
+
+        return CEPH_REPLAY(cmount, LIBCEPHFSD_OP_MOUNT, req, ans);
+    }
+    case LIBCEPHFSD_OP_CHDIR: {
+        CEPH_REQ(ceph_chdir, req, 1, ans, 0);
+
+        req.cmount = cmount->cmount;
+        CEPH_STR_ADD(req, path, setup->args[0]);
+
+        return CEPH_REPLAY(cmount, LIBCEPHFSD_OP_CHDIR, req, ans);
+    }
+    }
+
+    return proxy_log(LOG_ERR, EINVAL, "Unexpected recorded operation");
+}
+
+/* Negotiate the session of a new connection. Returns 1 if the previous session
+ * has been resumed or 0 if a new session has been created. The identifier of
+ * the daemon instance is returned in 'instance'. */
+static int32_t
+proxy_session(struct ceph_mount_info *cmount, uint64_t *instance)
+{
+    CEPH_REQ(session, req, 0, ans, 0);
+    int32_t err;
+
+    req.token = cmount->session;
+
+    err = CEPH_REPLAY(cmount, LIBCEPHFSD_OP_SESSION, req, ans);
+    if (err >= 0) {
+        cmount->session = ans.token;
+        *instance = ans.instance;
+    }
+
+    return err;
+}
+
+static int32_t
+proxy_session_connect(struct ceph_mount_info *cmount)
+{
+    proxy_setup_t *setup;
+    uint64_t instance;
+    int32_t err, res;
+
+    /* Anything left from the previous connection is useless. */
+    proxy_buffer_discard(&cmount->buffer);
+
+    err = proxy_connect(&cmount->link);
+    if (err < 0) {
+        return err;
+    }
+
+    __atomic_store_n(&cmount->seq, 0, __ATOMIC_RELAXED);
+
+    res = proxy_session(cmount, &instance);
+    if (res >= 0) {
+        /* Cached UserPerm handles only survive while the daemon keeps
+         * running. */
+        proxy_userperm_invalidate(instance);
+    }
+    if (res == 0) {
+        /* The daemon doesn't know about us anymore. Rebuild the mount from
+         * scratch. Previous handles are not valid anymore. */
+        proxy_xattr_invalidate(cmount, 0);
+        cmount->put_count = 0;
+
+        list_for_each_entry(setup, &cmount->setup, list) {
+            err = proxy_setup_replay(cmount, setup);
+            if (err < 0) {
+                proxy_log(LOG_ERR, -err, "Failed to restore the mount state");
+                res = err;
+                break;
+            }
+        }
+    }
+
+    if (res < 0) {
+        proxy_disconnect(&cmount->link);
+        return res;
+    }
+
+    cmount->good = true;
+
+    return res;
+}
+
+/* Establish a new connection with libcephfsd after a failure. Returns 1 if the
+ * previous session has been resumed, so all handles are still valid, or 0 if
+ * the mount had to be rebuilt. */
+static int32_t
+proxy_reconnect(struct ceph_mount_info *cmount)
+{
+    int32_t i, delay, err;
+
+    delay = PROXY_RECONNECT_DELAY;
+    for (i = 0; i < PROXY_RECONNECT_ATTEMPTS; i++) {
+        if (i > 0) {
+            usleep(delay);
+            delay <<= 1;
+            if (delay > PROXY_RECONNECT_MAX_DELAY) {
+                delay = PROXY_RECONNECT_MAX_DELAY;
+            }
+        }
+
+        err = proxy_session_connect(cmount);
+        if (err >= 0) {
+            proxy_log(LOG_INFO, 0, "Reconnected to libcephfsd (%s)",
+                      err > 0 ? "session resumed" : "session restored");
+            return err;
+        }
+    }
+
+    return proxy_log(LOG_ERR, -err, "Unable to reconnect to libcephfsd");
+}
+
+static int32_t
+proxy_ready(struct ceph_mount_info *cmount)
+{
+    if (cmount->good) {
+        return 0;
+    }
+
+    /* Only retry if there was a previous session. */
+    if (cmount->session == 0) {
+        return proxy_session_connect(cmount);
+    }
+
+    return proxy_reconnect(cmount);
+}
+
+static void
+proxy_failed(struct ceph_mount_info *cmount, int32_t err)
+{
+    proxy_disconnect(&cmount->link);
+    cmount->good = false;
+
+    /* The answer of a pending prefetch is lost. */
+    cmount->pending = NULL;
+    proxy_log(LOG_ERR, -err, "Disconnected from libcephfsd");
+}
+
+/* Send a request. If the connection fails, the request is sent again once
+ * reconnected, as long as the previous session could be resumed. */
+static int64_t default_timeout = -1;
+
+/* Initial timeout of new mounts. */
+static uint32_t
+proxy_timeout_default(void)
+{
+    const char *env;
+    uint64_t timeout;
+
+    if (default_timeout < 0) {
+        env = getenv(PROXY_TIMEOUT_ENV);
+        timeout = (env != NULL) ? strtoul(env, NULL, 10) : 0;
+        if (timeout > PROXY_TIMEOUT_MAX) {
+            timeout = PROXY_TIMEOUT_MAX;
+        }
+        default_timeout = timeout;
+    }
+
+    return default_timeout;
+}
+
+/* Timeout of a request. One-way requests and requests that release resources
+ * never have a deadline, since the daemon would leak the resources if they
+ * were dropped. */
+static uint32_t
+proxy_timeout(struct ceph_mount_info *cmount, int32_t op, uint32_t flags)
+{
+    if ((flags & PROXY_LINK_ONEWAY) != 0) {
+        return 0;
+    }
+
+    switch (op) {
+    case LIBCEPHFSD_OP_LL_CLOSE:
+    case LIBCEPHFSD_OP_LL_CLOSE_PUT:
+    case LIBCEPHFSD_OP_LL_RELEASEDIR:
+        return 0;
+    }
+
+    return cmount->timeout;
+}
+
+static int32_t
+proxy_send(struct ceph_mount_info *cmount, int32_t op, uint32_t flags,
+           struct iovec *req_iov, int32_t req_count)
+{
+    struct iovec iov[req_count];
+    uint32_t timeout;
+    int32_t err, res;
+
+    /* proxy_link_req_send() modifies the iovec on partial writes. Use a copy
+     * to be able to send the request again. */
+    memcpy(iov, req_iov, sizeof(iov));
+
+    timeout = proxy_timeout(cmount, op, flags);
+
+    proxy_seq_next(cmount);
+    err = proxy_link_req_send(cmount->link.sd, op, flags, timeout, iov,
+                              req_count);
+    if (err < 0) {
+        proxy_failed(cmount, err);
+
+        /* The daemon never executes partially received requests, so it's safe
+         * to send it again if the same session is still active. Otherwise the
+         * request references stale handles and it can't be retried, unless
+         * it's a global request, which doesn't depend on the session. */
+        res = proxy_reconnect(cmount);
+        if ((res < 0) || ((res == 0) && !cmount->global)) {
+            return err;
+        }
+
+        memcpy(iov, req_iov, sizeof(iov));
+
+        proxy_seq_next(cmount);
+        err = proxy_link_req_send(cmount->link.sd, op, flags, timeout, iov,
+                                  req_count);
+        if (err < 0) {
+            proxy_failed(cmount, err);
+            proxy_reconnect(cmount);
+        }
+    }
+
+    return err;
+}
+
+/* Send the queued inode releases as a one-way request. */
+static void
+proxy_puts_flush(struct ceph_mount_info *cmount)
+{
+    CEPH_DATA(ceph_ll_puts, req, 1);
+
+    if ((cmount->put_count == 0) || !cmount->good) {
+        return;
+    }
+
+    req.cmount = cmount->cmount;
+    req.count = cmount->put_count;
+    CEPH_BUFF_ADD(req, cmount->puts,
+                  cmount->put_count * sizeof(proxy_put_entry_t));
+
+    proxy_send(cmount, LIBCEPHFSD_OP_LL_PUTS, PROXY_LINK_ONEWAY, req_iov,
+               req_count);
+
+    cmount->put_count = 0;
+}
+
+/* The queue can only be full if it couldn't be sent because the connection
+ * was lost. In that case the connection is re-established before queuing more
+ * releases, and the release fails if that's not possible. */
+static int32_t
+proxy_puts_add(struct ceph_mount_info *cmount, uint64_t inode)
+{
+    proxy_put_entry_t *entry;
+    uint32_t i;
+    int32_t err;
+
+    for (i = 0; i < cmount->put_count; i++) {
+        entry = &cmount->puts[i];
+        if (entry->inode == inode) {
+            entry->count++;
+            return 0;
+        }
+    }
+
+    if (cmount->put_count == PROXY_PUT_BATCH) {
+        err = proxy_ready(cmount);
+        if (err < 0) {
+            return err;
+        }
+        proxy_puts_flush(cmount);
+    }
+
+    if (cmount->put_count == 0) {
+        cmount->put_time = proxy_now();
+        proxy_flush_queue(cmount, cmount->put_time + PROXY_PUT_DELAY);
+    }
+
+    entry = &cmount->puts[cmount->put_count++];
+    entry->inode = inode;
+    entry->count = 1;
+    entry->reserved = 0;
+
+    if (cmount->put_count == PROXY_PUT_BATCH) {
+        proxy_puts_flush(cmount);
+    }
+
+    return 0;
+}
+
+static void
+proxy_puts_expire(struct ceph_mount_info *cmount)
+{
+    if ((cmount->put_count > 0) &&
+        (proxy_now() - cmount->put_time >= PROXY_PUT_DELAY)) {
+        proxy_puts_flush(cmount);
+    }
+}
+
+/* Receive the answer of the oldest request sent. */
+static int32_t
+proxy_receive(struct ceph_mount_info *cmount, struct iovec *ans_iov,
+              int32_t ans_count)
+{
+    proxy_link_ans_t *ans;
+    int32_t err, len;
+
+    ans = ans_iov[0].iov_base;
+    len = ans_iov[0].iov_len;
+
+    err = proxy_link_ans_recv(cmount->link.sd, &cmount->buffer, ans_iov,
+                              ans_count);
+    if (err < 0) {
+        /* We don't know if the request has been executed or not, so we can't
+         * retry it. Just try to be ready for the next request. */
+        proxy_failed(cmount, err);
+        proxy_reconnect(cmount);
+
+        return err;
+    }
+
+    /* Only the first failure is kept until it can be reported. */
+    if ((ans->flags & PROXY_LINK_DEFERRED) != 0) {
+        err = ans->flags >> PROXY_LINK_DEFERRED_SHIFT;
+        if (err == 0) {
+            err = EIO;
+        }
+        if (cmount->deferred == 0) {
+            cmount->deferred = -err;
+        }
+        proxy_log(LOG_ERR, err, "A previous one-way request has failed");
+    }
+
+    /* Errors may be sent with just the common header, but a successful answer
+     * must have at least the size that the operation defines. Newer daemons
+     * may append fields, which are ignored. */
+    if ((ans->result >= 0) && (ans->header_len < len)) {
+        return proxy_log(LOG_ERR, EPROTO, "Unexpected answer size");
+    }
+
+    return ans->result;
+}
+
+/* Calls that make data durable (fsync and close) also report the first failure
+ * of a one-way request of the mount, once, if they succeed themselves. */
+static int32_t
+proxy_deferred(struct ceph_mount_info *cmount, int32_t err)
+{
+    if ((err >= 0) && (cmount->deferred < 0)) {
+        err = cmount->deferred;
+        cmount->deferred = 0;
+    }
+
+    return err;
+}
+
+/* Read-ahead
+ *
+ * Reads are tracked for each file handle. Once a handle has been read
+ * sequentially for a few calls, a read of the next window is sent without
+ * waiting for the answer. The answer is only received when the next request
+ * is made on the same mount, so the daemon reads the data while the caller is
+ * processing the previous one, and sequential reads are served locally.
+ *
+ * Writes and attribute changes through the same mount discard the prefetched
+ * data, but changes made by other clients are not seen until the next window
+ * is read, so read-ahead is only enabled when explicitly requested. */
+
+static uint32_t read_ahead_size = UINT32_MAX;
+
+static uint32_t
+proxy_read_ahead(void)
+{
+    const char *env;
+    uint64_t size;
+
+    if (read_ahead_size == UINT32_MAX) {
+        env = getenv(PROXY_READ_AHEAD_ENV);
+        size = (env != NULL) ? strtoul(env, NULL, 10) * 1024 : 0;
+        if (size > PROXY_READ_AHEAD_MAX) {
+            size = PROXY_READ_AHEAD_MAX;
+        }
+        read_ahead_size = size;
+    }
+
+    return read_ahead_size;
+}
+
+/* Receive the data of the pending prefetch. */
+static void
+proxy_stream_complete(struct ceph_mount_info *cmount)
+{
+    proxy_stream_t *stream;
+    struct iovec ans_iov[2];
+    int32_t err;
+
+    stream = cmount->pending;
+    cmount->pending = NULL;
+
+    ans_iov[0].iov_base = &stream->ans;
+    ans_iov[0].iov_len = sizeof(stream->ans);
+    ans_iov[1].iov_base = stream->data;
+    ans_iov[1].iov_len = read_ahead_size;
+
+    err = proxy_receive(cmount, ans_iov, 2);
+    if (err > 0) {
+        stream->size = err;
+    }
+}
+
+static void
+proxy_stream_drop(struct ceph_mount_info *cmount, proxy_stream_t *stream)
+{
+    if (cmount->pending == stream) {
+        proxy_stream_complete(cmount);
+    }
+
+    list_del(&stream->list);
+    cmount->stream_count--;
+
+    proxy_free(stream->data);
+    proxy_free(stream);
+}
+
+static proxy_stream_t *
+proxy_stream_find(struct ceph_mount_info *cmount, uint64_t fh)
+{
+    proxy_stream_t *stream;
+
+    list_for_each_entry(stream, &cmount->streams, list) {
+        if (stream->fh == fh) {
+            list_move(&stream->list, &cmount->streams);
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+/* Get the read state of a file handle, creating it if needed. Returns NULL if
+ * read-ahead is disabled. */
+static proxy_stream_t *
+proxy_stream_get(struct ceph_mount_info *cmount, uint64_t fh)
+{
+    proxy_stream_t *stream;
+
+    if (proxy_read_ahead() == 0) {
+        return NULL;
+    }
+
+    stream = proxy_stream_find(cmount, fh);
+    if (stream != NULL) {
+        return stream;
+    }
+
+    if (cmount->stream_count >= PROXY_READ_FILES) {
+        proxy_stream_drop(cmount, list_last_entry(&cmount->streams,
+                                                  proxy_stream_t, list));
+    }
+
+    stream = proxy_malloc(sizeof(proxy_stream_t));
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->fh = fh;
+    stream->session = cmount->session;
+    stream->next = -1;
+    stream->sequential = 0;
+    stream->offset = 0;
+    stream->size = 0;
+    stream->data = NULL;
+    list_add(&stream->list, &cmount->streams);
+    cmount->stream_count++;
+
+    return stream;
+}
+
+/* Discard the prefetched data of a file handle, or of all of them if fh is 0.
+ */
+static void
+proxy_stream_invalidate(struct ceph_mount_info *cmount, uint64_t fh)
+{
+    proxy_stream_t *stream;
+
+    list_for_each_entry(stream, &cmount->streams, list) {
+        if ((fh == 0) || (stream->fh == fh)) {
+            if (cmount->pending == stream) {
+                proxy_stream_complete(cmount);
+            }
+            stream->size = 0;
+            stream->sequential = 0;
+        }
+    }
+}
+
+/* Forget the read state of a file handle, or of all of them if fh is 0. */
+static void
+proxy_stream_forget(struct ceph_mount_info *cmount, uint64_t fh)
+{
+    proxy_stream_t *stream;
+    list_t *item, *next;
+
+    for (item = cmount->streams.next; item != &cmount->streams; item = next) {
+        next = item->next;
+        stream = list_entry(item, proxy_stream_t, list);
+        if ((fh == 0) || (stream->fh == fh)) {
+            proxy_stream_drop(cmount, stream);
+        }
+    }
+}
+
+/* Copy the prefetched data that the read needs. Returns the number of bytes
+ * copied from the beginning of the requested range. */
+static uint32_t
+proxy_stream_read(struct ceph_mount_info *cmount, proxy_stream_t *stream,
+                  int64_t offset, uint64_t len, char *buf)
+{
+    uint64_t size;
+
+    if (cmount->pending == stream) {
+        proxy_stream_complete(cmount);
+    }
+
+    /* Handles from a previous session are not valid anymore. */
+    if (stream->session != cmount->session) {
+        stream->session = cmount->session;
+        stream->size = 0;
+    }
+
+    if ((offset < stream->offset) ||
+        (offset >= stream->offset + stream->size)) {
+        return 0;
+    }
+
+    size = stream->offset + stream->size - offset;
+    if (size > len) {
+        size = len;
+    }
+    memcpy(buf, stream->data + offset - stream->offset, size);
+
+    return size;
+}
+
+/* Account a completed read and, if the handle is being read sequentially and
+ * all the prefetched data has been used, send the read of the next window. */
+static void
+proxy_stream_update(struct ceph_mount_info *cmount, proxy_stream_t *stream,
+                    int64_t offset, uint64_t len, int32_t res)
+{
+    CEPH_DATA(ceph_ll_read, req, 0);
+
+    if (offset == stream->next) {
+        stream->sequential++;
+    } else {
+        stream->sequential = 0;
+    }
+    stream->next = offset + res;
+
+    /* Short reads normally mean that the end of the file has been reached. */
+    if ((stream->sequential < PROXY_READ_SEQUENTIAL) || ((uint64_t)res < len) ||
+        (len > read_ahead_size) || (cmount->pending != NULL) ||
+        ((stream->next >= stream->offset) &&
+         (stream->next < stream->offset + stream->size)) || !cmount->good) {
+        return;
+    }
+
+    if (stream->data == NULL) {
+        stream->data = proxy_malloc(read_ahead_size);
+        if (stream->data == NULL) {
+            return;
+        }
+    }
+
+    stream->offset = stream->next;
+    stream->size = 0;
+
+    req.cmount = cmount->cmount;
+    req.fh = stream->fh;
+    req.offset = stream->offset;
+    req.len = read_ahead_size;
+
+    if (proxy_send(cmount, LIBCEPHFSD_OP_LL_READ, 0, req_iov, req_count) >= 0) {
+        cmount->pending = stream;
+    }
+}
+
+/* Send a request and wait for its answer. */
+static int32_t
+proxy_exchange(struct ceph_mount_info *cmount, int32_t op,
+               struct iovec *req_iov, int32_t req_count,
+               struct iovec *ans_iov, int32_t ans_count)
+{
+    int32_t err;
+
+    /* Answers come in order, so the one of a pending prefetch must be
+     * received first. */
+    if (cmount->pending != NULL) {
+        proxy_stream_complete(cmount);
+    }
+
+    err = proxy_send(cmount, op, 0, req_iov, req_count);
+    if (err < 0) {
+        return err;
+    }
+
+    __atomic_store_n(&cmount->wait_seq, cmount->seq, __ATOMIC_RELAXED);
+    err = proxy_receive(cmount, ans_iov, ans_count);
+    __atomic_store_n(&cmount->wait_seq, 0, __ATOMIC_RELAXED);
+
+    return err;
+}
+
+/* Write-behind
+ *
+ * Small writes to a file handle are kept in a buffer as long as each one
+ * continues the previous one. The buffered data is sent as a single write
+ * when a write doesn't fit or is not contiguous, when the file handle is
+ * synced or closed, before other requests that could observe the file, or
+ * once it has waited for PROXY_WRITE_DELAY milliseconds.
+ *
+ * Since the write has already succeeded from the point of view of the caller,
+ * an error sending the data is kept and returned by the next ceph_ll_fsync()
+ * or ceph_ll_close() of the same file handle. Writes to the same file through
+ * different handles are only ordered at those sync points, so write-behind is
+ * only enabled when explicitly requested. */
+
+static uint32_t write_behind_size = UINT32_MAX;
+
+static uint32_t
+proxy_write_behind(void)
+{
+    const char *env;
+    uint64_t size;
+
+    if (write_behind_size == UINT32_MAX) {
+        env = getenv(PROXY_WRITE_BEHIND_ENV);
+        size = (env != NULL) ? strtoul(env, NULL, 10) * 1024 : 0;
+        if (size > PROXY_WRITE_MAX_SIZE) {
+            size = PROXY_WRITE_MAX_SIZE;
+        }
+        write_behind_size = size;
+    }
+
+    return write_behind_size;
+}
+
+static proxy_file_t *
+proxy_file_find(struct ceph_mount_info *cmount, uint64_t fh)
+{
+    proxy_file_t *file;
+
+    list_for_each_entry(file, &cmount->files, list) {
+        if (file->fh == fh) {
+            return file;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+proxy_file_drop(struct ceph_mount_info *cmount, proxy_file_t *file)
+{
+    if (file->size > 0) {
+        cmount->dirty--;
+    }
+    list_del(&file->list);
+    cmount->file_count--;
+
+    proxy_free(file);
+}
+
+/* Send the buffered data of a file handle. Failures are recorded to be
+ * reported later. */
+static void
+proxy_file_send(struct ceph_mount_info *cmount, proxy_file_t *file)
+{
+    CEPH_REQ(ceph_ll_write, req, 1, ans, 0);
+    uint32_t done, size;
+    int32_t err;
+
+    size = file->size;
+    file->size = 0;
+    cmount->dirty--;
+
+    /* A short write is not an error by itself. Keep sending the remaining
+     * data until all of it is written or an error is returned. */
+    for (done = 0; done < size; done += err) {
+        req.fh = file->fh;
+        req.offset = file->offset + done;
+        req.len = size - done;
+        req_count = 1;
+        CEPH_BUFF_ADD(req, file->data + done, size - done);
+
+        err = proxy_ready(cmount);
+        if (err >= 0) {
+            req.cmount = cmount->cmount;
+            err = proxy_exchange(cmount, LIBCEPHFSD_OP_LL_WRITE, req_iov,
+                                 req_count, ans_iov, ans_count);
+        }
+        if (err == 0) {
+            err = -EIO;
+        }
+        if (err < 0) {
+            if (file->error == 0) {
+                file->error = err;
+            }
+            return;
+        }
+    }
+}
+
+/* Send the buffered data of all file handles. */
+static void
+proxy_files_flush(struct ceph_mount_info *cmount)
+{
+    proxy_file_t *file;
+    list_t *item, *next;
+
+    for (item = cmount->files.next; item != &cmount->files; item = next) {
+        next = item->next;
+        file = list_entry(item, proxy_file_t, list);
+        if (file->size > 0) {
+            proxy_file_send(cmount, file);
+        }
+        if (file->error == 0) {
+            proxy_file_drop(cmount, file);
+        }
+    }
+}
+
+/* Forget all file handles, including the errors not yet reported. */
+static void
+proxy_files_drop(struct ceph_mount_info *cmount)
+{
+    while (!list_empty(&cmount->files)) {
+        proxy_file_drop(cmount, list_first_entry(&cmount->files,
+                                                 proxy_file_t, list));
+    }
+}
+
+/* Send the buffered data of a file handle and forget it. Returns the first
+ * error of its writes since the last sync. */
+static int32_t
+proxy_file_sync(struct ceph_mount_info *cmount, uint64_t fh)
+{
+    proxy_file_t *file;
+    int32_t err;
+
+    file = proxy_file_find(cmount, fh);
+    if (file == NULL) {
+        return 0;
+    }
+
+    if (file->size > 0) {
+        proxy_file_send(cmount, file);
+    }
+    err = file->error;
+
+    proxy_file_drop(cmount, file);
+
+    return err;
+}
+
+/* Try to keep the data of a write in the buffer of its file handle. Returns
+ * false if it needs to be sent now. */
+static bool
+proxy_file_write(struct ceph_mount_info *cmount, uint64_t fh, int64_t offset,
+                 uint64_t len, const void *data)
+{
+    proxy_file_t *file;
+    uint32_t size;
+
+    size = proxy_write_behind();
+    if (size == 0) {
+        return false;
+    }
+
+    file = proxy_file_find(cmount, fh);
+    if (file != NULL) {
+        if ((file->size > 0) && (offset == file->offset + file->size) &&
+            (len <= size - file->size)) {
+            memcpy(file->data + file->size, data, len);
+            file->size += len;
+
+            return true;
+        }
+
+        /* The previous data must be written first to keep the order. */
+        if (file->size > 0) {
+            proxy_file_send(cmount, file);
+        }
+        if (file->error != 0) {
+            return false;
+        }
+    }
+
+    /* A negative offset means the current position of the file, so it can't
+     * be buffered. */
+    if ((offset < 0) || (len >= size)) {
+        if (file != NULL) {
+            proxy_file_drop(cmount, file);
+        }
+        return false;
+    }
+
+    if (file == NULL) {
+        if (cmount->file_count >= PROXY_WRITE_FILES) {
+            return false;
+        }
+
+        file = proxy_malloc(sizeof(proxy_file_t) + size);
+        if (file == NULL) {
+            return false;
+        }
+        file->fh = fh;
+        file->size = 0;
+        file->error = 0;
+        list_add_tail(&file->list, &cmount->files);
+        cmount->file_count++;
+    }
+
+    if (cmount->dirty++ == 0) {
+        cmount->dirty_time = proxy_now();
+        proxy_flush_queue(cmount, cmount->dirty_time + PROXY_WRITE_DELAY);
+    }
+    file->offset = offset;
+    file->size = len;
+    memcpy(file->data, data, len);
 
-static struct ceph_mount_info global_cmount = { .good = false };
+    return true;
+}
 
-static bool
-client_stop(proxy_link_t *link)
+/* Opening a file with O_TRUNC must discard the data written before, so the
+ * buffered writes are sent first. Their inode is not known, so all of them
+ * are sent, and prefetched data is discarded. */
+static void
+proxy_files_truncate(struct ceph_mount_info *cmount, int32_t flags)
 {
-    return false;
+    if ((flags & O_TRUNC) != 0) {
+        proxy_files_flush(cmount);
+        proxy_stream_invalidate(cmount, 0);
+    }
+}
+
+static void
+proxy_files_expire(struct ceph_mount_info *cmount)
+{
+    if ((cmount->dirty > 0) &&
+        (proxy_now() - cmount->dirty_time >= PROXY_WRITE_DELAY)) {
+        proxy_files_flush(cmount);
+    }
 }
 
 static int32_t
-proxy_connect(proxy_link_t *link)
+proxy_request(struct ceph_mount_info *cmount, int32_t op,
+              struct iovec *req_iov, int32_t req_count,
+              struct iovec *ans_iov, int32_t ans_count)
 {
-    CEPH_REQ(hello, req, 0, ans, 0);
-    int32_t sd, err;
+    proxy_puts_expire(cmount);
+    proxy_files_expire(cmount);
 
-    sd = proxy_link_client(link, "/tmp/libcephfsd.sock", client_stop);
-    if (sd < 0) {
-        return sd;
-    }
+    return proxy_exchange(cmount, op, req_iov, req_count, ans_iov, ans_count);
+}
 
-    req.id = LIBCEPHFS_LIB_CLIENT;
-    err = proxy_link_send(sd, req_iov, 1);
-    if (err < 0) {
-        goto failed;
+/* Send the deferred work of a mount that has waited long enough, and check it
+ * again later if something is left. Must be called with the mutex of the
+ * mount held. */
+static void
+proxy_flush_expired(struct ceph_mount_info *cmount)
+{
+    proxy_puts_expire(cmount);
+    proxy_files_expire(cmount);
+
+    /* Releases are not sent while disconnected. The next request reconnects
+     * and sends them. */
+    if ((cmount->put_count > 0) && cmount->good) {
+        proxy_flush_queue(cmount, cmount->put_time + PROXY_PUT_DELAY);
     }
-    err = proxy_link_recv(sd, ans_iov, 1);
-    if (err < 0) {
-        goto failed;
+    if (cmount->dirty > 0) {
+        proxy_flush_queue(cmount, cmount->dirty_time + PROXY_WRITE_DELAY);
     }
+}
 
-    proxy_log(LOG_INFO, 0, "Connected to libcephfsd version %d.%d", ans.major,
-              ans.minor);
+static void *
+proxy_flush_worker(void *arg)
+{
+    struct ceph_mount_info *cmount;
+    struct timespec ts;
+    uint64_t now, next;
+    int32_t err;
+    bool found;
+
+    proxy_mutex_lock(&flush_mutex);
+
+    while (true) {
+        now = proxy_now();
+        next = UINT64_MAX;
+        found = false;
+
+        list_for_each_entry(cmount, &flush_list, flush) {
+            if (cmount->flush_time > now) {
+                if (cmount->flush_time < next) {
+                    next = cmount->flush_time;
+                }
+            } else if (pthread_mutex_trylock(&cmount->mutex) == 0) {
+                found = true;
+                break;
+            } else if (now + PROXY_FLUSH_RETRY < next) {
+                next = now + PROXY_FLUSH_RETRY;
+            }
+        }
 
-    if ((ans.major != LIBCEPHFSD_MAJOR) || (ans.minor != LIBCEPHFSD_MINOR)) {
-        err = proxy_log(LOG_ERR, ENOTSUP, "Version not supported");
-        goto failed;
+        if (found) {
+            list_del_init(&cmount->flush);
+            proxy_mutex_unlock(&flush_mutex);
+
+            proxy_flush_expired(cmount);
+            proxy_mutex_unlock(&cmount->mutex);
+
+            proxy_mutex_lock(&flush_mutex);
+        } else if (next == UINT64_MAX) {
+            proxy_condition_wait(&flush_condition, &flush_mutex);
+        } else {
+            ts.tv_sec = next / 1000;
+            ts.tv_nsec = (next % 1000) * 1000000;
+            err = pthread_cond_timedwait(&flush_condition, &flush_mutex, &ts);
+            if ((err != 0) && (err != ETIMEDOUT)) {
+                proxy_abort(err, "Condition variable cannot be waited");
+            }
+        }
     }
 
-    return sd;
+    return NULL;
+}
 
-failed:
-    proxy_link_close(link);
+static void
+proxy_flush_prepare(void)
+{
+    proxy_mutex_lock(&flush_mutex);
+}
 
-    return err;
+static void
+proxy_flush_parent(void)
+{
+    proxy_mutex_unlock(&flush_mutex);
 }
 
+/* The thread doesn't exist in a forked child. It's started again by the next
+ * ceph_create(). */
 static void
-proxy_disconnect(proxy_link_t *link)
+proxy_flush_child(void)
 {
-    proxy_link_close(link);
+    flush_started = false;
+    proxy_mutex_unlock(&flush_mutex);
 }
 
-static int32_t
-proxy_global_connect(void)
+/* Start the flush thread if it's not running. */
+static void
+proxy_flush_start(void)
 {
+    static bool registered = false;
+    pthread_condattr_t attr;
+    pthread_t tid;
     int32_t err;
 
-    err = 0;
-
-    if (!global_cmount.good) {
-        err = proxy_connect(&global_cmount.link);
-        if (err >= 0) {
-            global_cmount.good = true;
+    proxy_mutex_lock(&flush_mutex);
+
+    if (!flush_started) {
+        if (!registered) {
+            err = pthread_atfork(proxy_flush_prepare, proxy_flush_parent,
+                                 proxy_flush_child);
+            if (err != 0) {
+                proxy_log(LOG_ERR, err, "Failed to register fork handlers");
+                goto done;
+            }
+            registered = true;
         }
-    }
 
-    return err;
-}
+        /* Timeouts are computed with proxy_now(). */
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        err = pthread_cond_init(&flush_condition, &attr);
+        pthread_condattr_destroy(&attr);
+        if (err != 0) {
+            proxy_log(LOG_ERR, err,
+                      "Failed to initialize a condition variable");
+            goto done;
+        }
 
-static int32_t
-proxy_check(struct ceph_mount_info *cmount, int32_t err, int32_t result)
-{
-    if (err < 0) {
-        proxy_disconnect(&cmount->link);
-        cmount->good = false;
-        proxy_log(LOG_ERR, err, "Disconnected from libcephfsd");
+        if (proxy_thread_create(&tid, proxy_flush_worker, NULL) != 0) {
+            pthread_cond_destroy(&flush_condition);
+            goto done;
+        }
+        pthread_detach(tid);
 
-        return err;
+        flush_started = true;
     }
 
-    return result;
+done:
+    proxy_mutex_unlock(&flush_mutex);
 }
 
 #define CEPH_RUN(_cmount, _op, _req, _ans) \
+    proxy_request(_cmount, _op, _req##_iov, _req##_count, _ans##_iov, \
+                  _ans##_count)
+
+#define CEPH_PROCESS(_cmount, _op, _req, _ans) \
     ({ \
-        int32_t __err = CEPH_CALL((_cmount)->link.sd, _op, _req, _ans); \
-        __err = proxy_check(_cmount, __err, (_ans).header.result); \
+        int32_t __err = proxy_ready(_cmount); \
+        if (__err >= 0) { \
+            (_req).cmount = (_cmount)->cmount; \
+            __err = CEPH_RUN(_cmount, _op, _req, _ans); \
+        } \
         __err; \
     })
 
-#define CEPH_PROCESS(_cmount, _op, _req, _ans) \
+/* Requests whose result is not needed don't wait for an answer. Errors are
+ * only logged once the next answer is received. */
+#define CEPH_RUN_ONEWAY(_cmount, _op, _req) \
+    proxy_send(_cmount, _op, PROXY_LINK_ONEWAY, _req##_iov, _req##_count)
+
+#define CEPH_PROCESS_ONEWAY(_cmount, _op, _req) \
     ({ \
-        int32_t __err = -ENOTCONN; \
-        if ((_cmount)->good) { \
+        int32_t __err = proxy_ready(_cmount); \
+        if (__err >= 0) { \
             (_req).cmount = (_cmount)->cmount; \
-            __err = CEPH_RUN(_cmount, _op, _req, _ans); \
+            __err = CEPH_RUN_ONEWAY(_cmount, _op, _req); \
         } \
         __err; \
     })
 
+static int32_t
+proxy_mount_read(proxy_buffer_t *buffer, void *ptr, int32_t size)
+{
+    struct ceph_mount_info *cmount;
+
+    cmount = container_of(buffer, struct ceph_mount_info, buffer);
+
+    return proxy_link_read(&cmount->link, cmount->link.sd, ptr, size);
+}
+
+static proxy_buffer_ops_t proxy_mount_read_ops = {
+    .read = proxy_mount_read
+};
+
+static struct ceph_mount_info *
+proxy_mount_alloc(bool global)
+{
+    struct ceph_mount_info *cmount;
+
+    cmount = proxy_malloc(sizeof(struct ceph_mount_info));
+    if (cmount == NULL) {
+        return NULL;
+    }
+
+    if (proxy_mutex_init(&cmount->mutex) < 0) {
+        proxy_free(cmount);
+        return NULL;
+    }
+
+    if (proxy_buffer_open(&cmount->buffer, &proxy_mount_read_ops, NULL,
+                          PROXY_LINK_BUFFER, BUFFER_READ) < 0) {
+        pthread_mutex_destroy(&cmount->mutex);
+        proxy_free(cmount);
+        return NULL;
+    }
+
+    list_init(&cmount->setup);
+    list_init(&cmount->xattrs);
+    cmount->xattr_count = 0;
+    cmount->stash = NULL;
+    cmount->put_count = 0;
+    list_init(&cmount->files);
+    cmount->file_count = 0;
+    cmount->dirty = 0;
+    list_init(&cmount->streams);
+    cmount->stream_count = 0;
+    cmount->pending = NULL;
+    cmount->session = 0;
+    cmount->seq = 0;
+    cmount->wait_seq = 0;
+    list_init(&cmount->flush);
+    cmount->deferred = 0;
+    cmount->timeout = global ? 0 : proxy_timeout_default();
+    cmount->global = global;
+    cmount->good = false;
+
+    return cmount;
+}
+
+/* Take a connection for a global operation. It's not connected until
+ * proxy_ready() is called. */
+static struct ceph_mount_info *
+proxy_global_get(void)
+{
+    struct ceph_mount_info *cmount;
+
+    cmount = NULL;
+
+    proxy_mutex_lock(&global_mutex);
+
+    if (!list_empty(&global_pool)) {
+        cmount = list_first_entry(&global_pool, struct ceph_mount_info, list);
+        list_del(&cmount->list);
+        global_idle--;
+    }
+
+    proxy_mutex_unlock(&global_mutex);
+
+    if (cmount == NULL) {
+        cmount = proxy_mount_alloc(true);
+    }
+
+    return cmount;
+}
+
+/* Return a connection to the pool. Connections above the limit of idle ones,
+ * created during a burst of concurrent global operations, are closed. */
+static void
+proxy_global_put(struct ceph_mount_info *cmount)
+{
+    proxy_mutex_lock(&global_mutex);
+
+    if (global_idle < PROXY_GLOBAL_IDLE) {
+        list_add(&cmount->list, &global_pool);
+        global_idle++;
+        cmount = NULL;
+    }
+
+    proxy_mutex_unlock(&global_mutex);
+
+    if (cmount != NULL) {
+        if (cmount->good) {
+            proxy_disconnect(&cmount->link);
+        }
+        proxy_buffer_close(&cmount->buffer);
+        pthread_mutex_destroy(&cmount->mutex);
+        proxy_free(cmount);
+    }
+}
+
+/* Cancel the request in progress on a mount from another thread. The request
+ * fails with ECANCELED if it was still waiting in the daemon. Requests already
+ * running are not interrupted, and requests that release handles are never
+ * cancelled. Returns -ENOENT if no call of the mount is waiting for an answer,
+ * or if the daemon is already serving another request of the mount. Read-ahead
+ * prefetches are never cancelled, so this is also the case while a call is
+ * still receiving a prefetch before sending its own request. */
+__public int
+ceph_cancel(struct ceph_mount_info *cmount)
+{
+    CEPH_REQ(cancel, req, 0, ans, 0);
+    struct ceph_mount_info *global;
+    int32_t err;
+
+    /* The session may change if the mount reconnects concurrently, but then
+     * the request being cancelled has already failed. The request is
+     * identified by its sequence number, so a cancellation that arrives late
+     * never affects the following requests. */
+    req.token = __atomic_load_n(&cmount->session, __ATOMIC_RELAXED);
+    req.seq = __atomic_load_n(&cmount->wait_seq, __ATOMIC_RELAXED);
+    if (req.token == 0) {
+        return -ENOTCONN;
+    }
+    if (req.seq == 0) {
+        return -ENOENT;
+    }
+
+    global = proxy_global_get();
+    if (global == NULL) {
+        return -ENOMEM;
+    }
+
+    err = proxy_ready(global);
+    if (err >= 0) {
+        err = CEPH_RUN(global, LIBCEPHFSD_OP_CANCEL, req, ans);
+    }
+
+    proxy_global_put(global);
+
+    return err;
+}
+
 __public int
 ceph_chdir(struct ceph_mount_info *cmount, const char *path)
 {
     CEPH_REQ(ceph_chdir, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     CEPH_STR_ADD(req, path, path);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_CHDIR, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_CHDIR, req, ans);
+    if (err >= 0) {
+        err = proxy_setup_add(cmount, LIBCEPHFSD_OP_CHDIR, path, NULL, 0);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -125,23 +2079,47 @@ ceph_conf_get(struct ceph_mount_info *cmount, const char *option, char *buf,
               size_t len)
 {
     CEPH_REQ(ceph_conf_get, req, 1, ans, 1);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.size = len;
 
     CEPH_STR_ADD(req, option, option);
     CEPH_BUFF_ADD(ans, buf, len);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_CONF_GET, req, ans);
+    /* The daemon takes configuration reads into account to decide if a client
+     * instance can be shared, so they also need to be recorded. */
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_CONF_GET, req, ans);
+    if (err >= 0) {
+        err = proxy_setup_add(cmount, LIBCEPHFSD_OP_CONF_GET, option, NULL,
+                              len);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
 ceph_conf_read_file(struct ceph_mount_info *cmount, const char *path_list)
 {
     CEPH_REQ(ceph_conf_read_file, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     CEPH_STR_ADD(req, path, path_list);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_CONF_READ_FILE, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_CONF_READ_FILE, req, ans);
+    if (err >= 0) {
+        err = proxy_setup_add(cmount, LIBCEPHFSD_OP_CONF_READ_FILE, path_list,
+                              NULL, 0);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -149,11 +2127,22 @@ ceph_conf_set(struct ceph_mount_info *cmount, const char *option,
               const char *value)
 {
     CEPH_REQ(ceph_conf_set, req, 2, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     CEPH_STR_ADD(req, option, option);
     CEPH_STR_ADD(req, value, value);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_CONF_SET, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_CONF_SET, req, ans);
+    if (err >= 0) {
+        err = proxy_setup_add(cmount, LIBCEPHFSD_OP_CONF_SET, option, value,
+                              0);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -161,28 +2150,33 @@ ceph_create(struct ceph_mount_info **cmount, const char *const id)
 {
     CEPH_REQ(ceph_create, req, 1, ans, 0);
     struct ceph_mount_info *ceph_mount;
-    int32_t sd, err;
+    int32_t err;
 
-    ceph_mount = proxy_malloc(sizeof(struct ceph_mount_info));
+    ceph_mount = proxy_mount_alloc(false);
     if (ceph_mount == NULL) {
         return -ENOMEM;
     }
 
-    err = proxy_connect(&ceph_mount->link);
+    proxy_flush_start();
+
+    err = proxy_session_connect(ceph_mount);
     if (err < 0) {
         goto failed;
     }
-    sd = err;
 
     CEPH_STR_ADD(req, id, id);
 
-    err = CEPH_CALL(sd, LIBCEPHFSD_OP_CREATE, req, ans);
-    if ((err < 0) || ((err = ans.header.result) < 0)) {
+    err = CEPH_REPLAY(ceph_mount, LIBCEPHFSD_OP_CREATE, req, ans);
+    if (err < 0) {
+        goto failed_link;
+    }
+
+    err = proxy_setup_add(ceph_mount, LIBCEPHFSD_OP_CREATE, id, NULL, 0);
+    if (err < 0) {
         goto failed_link;
     }
 
     ceph_mount->cmount = ans.cmount;
-    ceph_mount->good = true;
 
     *cmount = ceph_mount;
 
@@ -192,6 +2186,8 @@ failed_link:
     proxy_disconnect(&ceph_mount->link);
 
 failed:
+    proxy_buffer_close(&ceph_mount->buffer);
+    pthread_mutex_destroy(&ceph_mount->mutex);
     proxy_free(ceph_mount);
 
     return err;
@@ -207,7 +2203,10 @@ ceph_getcwd(struct ceph_mount_info *cmount)
 
     CEPH_BUFF_ADD(ans, cwd, sizeof(cwd));
 
+    proxy_mutex_lock(&cmount->mutex);
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_GETCWD, req, ans);
+    proxy_mutex_unlock(&cmount->mutex);
+
     if (err >= 0) {
         return cwd;
     }
@@ -221,18 +2220,105 @@ __public int
 ceph_init(struct ceph_mount_info *cmount)
 {
     CEPH_REQ(ceph_init, req, 0, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_INIT, req, ans);
+    if (err >= 0) {
+        err = proxy_setup_add(cmount, LIBCEPHFSD_OP_INIT, NULL, NULL, 0);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_INIT, req, ans);
+    return err;
 }
 
 __public int
 ceph_ll_close(struct ceph_mount_info *cmount, struct Fh *filehandle)
 {
     CEPH_REQ(ceph_ll_close, req, 0, ans, 0);
+    int32_t err, res;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    req.fh = ptr_value(filehandle);
+
+    res = proxy_file_sync(cmount, req.fh);
+    proxy_stream_forget(cmount, req.fh);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_CLOSE, req, ans);
+    if ((err >= 0) && (res < 0)) {
+        err = res;
+    }
+    err = proxy_deferred(cmount, err);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
+}
+
+/* Equivalent to ceph_ll_close() followed by ceph_ll_put(), in a single
+ * request. */
+__public int
+ceph_ll_close_put(struct ceph_mount_info *cmount, struct Fh *filehandle,
+                  struct Inode *in)
+{
+    CEPH_REQ(ceph_ll_close_put, req, 0, ans, 0);
+    int32_t err, res;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.fh = ptr_value(filehandle);
+    req.inode = ptr_value(in);
+
+    /* The same handle could be reused for a different inode. */
+    proxy_xattr_invalidate(cmount, req.inode);
+
+    res = proxy_file_sync(cmount, req.fh);
+    proxy_stream_forget(cmount, req.fh);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_CLOSE_PUT, req, ans);
+    if ((err >= 0) && (res < 0)) {
+        err = res;
+    }
+    err = proxy_deferred(cmount, err);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
+}
+
+/* Copy up to 'len' bytes from one open file to another one of the same mount.
+ * The data is copied by libcephfsd and never transferred to this process.
+ * Returns the number of bytes copied, which can be smaller than 'len'. */
+__public int
+ceph_ll_copy_range(struct ceph_mount_info *cmount, struct Fh *src,
+                   int64_t src_offset, struct Fh *dst, int64_t dst_offset,
+                   uint64_t len)
+{
+    CEPH_REQ(ceph_ll_copy_range, req, 0, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    req.src = ptr_value(src);
+    req.src_offset = src_offset;
+    req.dst = ptr_value(dst);
+    req.dst_offset = dst_offset;
+    req.len = len;
+
+    /* Buffered writes to the source must be visible to the daemon, and data
+     * prefetched from the destination will be stale. */
+    proxy_files_flush(cmount);
+    /* Other handles of the destination file may have prefetched data. */
+    proxy_stream_invalidate(cmount, 0);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_COPY_RANGE, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_CLOSE, req, ans);
+    return err;
 }
 
 __public int
@@ -242,8 +2328,11 @@ ceph_ll_create(struct ceph_mount_info *cmount, Inode *parent, const char *name,
                const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_create, req, 1, ans, 1);
+    uint8_t stx_data[PROXY_STATX_SIZE];
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.userperm = ptr_value(perms);
     req.parent = ptr_value(parent);
     req.mode = mode;
@@ -252,14 +2341,19 @@ ceph_ll_create(struct ceph_mount_info *cmount, Inode *parent, const char *name,
     req.flags = lflags;
 
     CEPH_STR_ADD(req, name, name);
-    CEPH_BUFF_ADD(ans, stx, sizeof(*stx));
+    CEPH_BUFF_ADD(ans, stx_data, sizeof(stx_data));
+
+    proxy_files_truncate(cmount, oflags);
 
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_CREATE, req, ans);
     if (err >= 0) {
         *outp = value_ptr(ans.inode);
         *fhp = value_ptr(ans.fh);
+        err = proxy_statx_decode(stx, stx_data, ans.header.data_len);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -268,41 +2362,116 @@ ceph_ll_fallocate(struct ceph_mount_info *cmount, struct Fh *fh, int mode,
                   int64_t offset, int64_t length)
 {
     CEPH_REQ(ceph_ll_fallocate, req, 0, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.fh = ptr_value(fh);
     req.mode = mode;
     req.offset = offset;
     req.length = length;
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_FALLOCATE, req, ans);
+    proxy_files_flush(cmount);
+    proxy_stream_invalidate(cmount, 0);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_FALLOCATE, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
 ceph_ll_fsync(struct ceph_mount_info *cmount, struct Fh *fh, int syncdataonly)
 {
     CEPH_REQ(ceph_ll_fsync, req, 0, ans, 0);
+    int32_t err, res;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    req.fh = ptr_value(fh);
+    req.dataonly = syncdataonly;
+
+    res = proxy_file_sync(cmount, req.fh);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_FSYNC, req, ans);
+    if ((err >= 0) && (res < 0)) {
+        err = res;
+    }
+    err = proxy_deferred(cmount, err);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
+}
+
+__public int
+ceph_ll_getattr(struct ceph_mount_info *cmount, struct Inode *in,
+                struct ceph_statx *stx, unsigned int want, unsigned int flags,
+                const UserPerm *perms)
+{
+    CEPH_REQ(ceph_ll_getattr, req, 0, ans, 1);
+    uint8_t stx_data[PROXY_STATX_SIZE];
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    req.userperm = ptr_value(perms);
+    req.inode = ptr_value(in);
+    req.want = want;
+    req.flags = flags;
+
+    CEPH_BUFF_ADD(ans, stx_data, sizeof(stx_data));
+
+    proxy_files_flush(cmount);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_GETATTR, req, ans);
+    if (err >= 0) {
+        err = proxy_statx_decode(stx, stx_data, ans.header.data_len);
+    }
 
-    req.fh = ptr_value(fh);
-    req.dataonly = syncdataonly;
+    proxy_mutex_unlock(&cmount->mutex);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_FSYNC, req, ans);
+    return err;
 }
 
-__public int
-ceph_ll_getattr(struct ceph_mount_info *cmount, struct Inode *in,
-                struct ceph_statx *stx, unsigned int want, unsigned int flags,
-                const UserPerm *perms)
+/* Get all the xattrs of an inode and add them to the cache. */
+static proxy_xattr_cache_t *
+proxy_xattr_fetch(struct ceph_mount_info *cmount, struct Inode *in,
+                  const UserPerm *perms)
 {
-    CEPH_REQ(ceph_ll_getattr, req, 0, ans, 1);
+    CEPH_REQ(ceph_ll_getxattrs, req, 0, ans, 1);
+    proxy_xattr_cache_t *cache;
+    int32_t err;
+
+    cache = proxy_malloc(sizeof(proxy_xattr_cache_t) + PROXY_XATTR_CACHE_SIZE);
+    if (cache == NULL) {
+        return NULL;
+    }
 
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
-    req.want = want;
-    req.flags = flags;
+    req.names = 0;
+
+    CEPH_BUFF_ADD(ans, cache->data, PROXY_XATTR_CACHE_SIZE);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_GETXATTRS, req, ans);
+    if (err >= 0) {
+        cache->inode = req.inode;
+        cache->userperm = req.userperm;
+        cache->count = ans.count;
+        cache->size = ans.header.data_len;
+        err = proxy_realloc((void **)&cache,
+                            sizeof(proxy_xattr_cache_t) + cache->size);
+    }
+    if (err < 0) {
+        proxy_free(cache);
+        return NULL;
+    }
 
-    CEPH_BUFF_ADD(ans, stx, sizeof(*stx));
+    proxy_xattr_insert(cmount, cache);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_GETATTR, req, ans);
+    return cache;
 }
 
 __public int
@@ -311,15 +2480,57 @@ ceph_ll_getxattr(struct ceph_mount_info *cmount, struct Inode *in,
                  const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_getxattr, req, 1, ans, 1);
+    proxy_xattr_cache_t *cache;
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    if (proxy_xattr_enabled(name)) {
+        cache = proxy_xattr_find(cmount, ptr_value(in), ptr_value(perms));
+        if (cache == NULL) {
+            cache = proxy_xattr_fetch(cmount, in, perms);
+        }
+        if (cache != NULL) {
+            err = proxy_xattr_lookup(cache, name, value, size);
+            if (err != -EAGAIN) {
+                goto done;
+            }
+        }
+    }
+
+    err = proxy_xattr_stashed(cmount, ptr_value(in), ptr_value(perms),
+                             name, value, size);
+    if (err != -EAGAIN) {
+        goto done;
+    }
 
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
     req.size = size;
+    req.fetch = 0;
     CEPH_STR_ADD(req, name, name);
 
+    if (size == 0) {
+        /* The value is received in a buffer allocated on demand. */
+        req.fetch = PROXY_XATTR_FETCH;
+        value = NULL;
+    }
     CEPH_BUFF_ADD(ans, value, size);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_GETXATTR, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_GETXATTR, req, ans);
+    if ((size == 0) && (ans_iov[1].iov_base != NULL)) {
+        if ((err > 0) && (ans.header.data_len == err)) {
+            proxy_xattr_stash(cmount, req.inode, req.userperm, name,
+                              ans_iov[1].iov_base, err);
+        } else {
+            proxy_free(ans_iov[1].iov_base);
+        }
+    }
+
+done:
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -327,13 +2538,20 @@ ceph_ll_link(struct ceph_mount_info *cmount, struct Inode *in,
              struct Inode *newparent, const char *name, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_link, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
     req.parent = ptr_value(newparent);
     CEPH_STR_ADD(req, name, name);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_LINK, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_LINK, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -343,16 +2561,46 @@ ceph_ll_listxattr(struct ceph_mount_info *cmount, struct Inode *in, char *list,
     CEPH_REQ(ceph_ll_listxattr, req, 0, ans, 1);
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
+    err = proxy_xattr_stashed(cmount, ptr_value(in), ptr_value(perms),
+                             NULL, list, buf_size);
+    if (err != -EAGAIN) {
+        if (err >= 0) {
+            *list_size = err;
+            err = 0;
+        }
+        goto done;
+    }
+
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
     req.size = buf_size;
+    req.fetch = 0;
 
+    if (buf_size == 0) {
+        /* The list is received in a buffer allocated on demand. */
+        req.fetch = PROXY_XATTR_FETCH;
+        list = NULL;
+    }
     CEPH_BUFF_ADD(ans, list, buf_size);
 
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_LISTXATTR, req, ans);
     if (err >= 0) {
         *list_size = ans.size;
     }
+    if ((buf_size == 0) && (ans_iov[1].iov_base != NULL)) {
+        if ((err >= 0) && (ans.size > 0) &&
+            (ans.header.data_len == ans.size)) {
+            proxy_xattr_stash(cmount, req.inode, req.userperm, NULL,
+                              ans_iov[1].iov_base, ans.size);
+        } else {
+            proxy_free(ans_iov[1].iov_base);
+        }
+    }
+
+done:
+    proxy_mutex_unlock(&cmount->mutex);
 
     return err;
 }
@@ -363,21 +2611,29 @@ ceph_ll_lookup(struct ceph_mount_info *cmount, Inode *parent, const char *name,
                unsigned flags, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_lookup, req, 1, ans, 1);
+    uint8_t stx_data[PROXY_STATX_SIZE];
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.userperm = ptr_value(perms);
     req.parent = ptr_value(parent);
     req.want = want;
     req.flags = flags;
     CEPH_STR_ADD(req, name, name);
 
-    CEPH_BUFF_ADD(ans, stx, sizeof(*stx));
+    CEPH_BUFF_ADD(ans, stx_data, sizeof(stx_data));
+
+    proxy_files_flush(cmount);
 
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_LOOKUP, req, ans);
     if (err >= 0) {
         *out = value_ptr(ans.inode);
+        err = proxy_statx_decode(stx, stx_data, ans.header.data_len);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -388,13 +2644,17 @@ ceph_ll_lookup_inode(struct ceph_mount_info *cmount, struct inodeno_t ino,
     CEPH_REQ(ceph_ll_lookup_inode, req, 0, ans, 0);
     int32_t err;
 
-    req.ino = ino;
+    proxy_mutex_lock(&cmount->mutex);
+
+    req.ino = ino.val;
 
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_LOOKUP_INODE, req, ans);
     if (err >= 0) {
         *inode = value_ptr(ans.inode);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -404,11 +2664,15 @@ ceph_ll_lookup_root(struct ceph_mount_info *cmount, Inode **parent)
     CEPH_REQ(ceph_ll_lookup_root, req, 0, ans, 0);
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_LOOKUP_ROOT, req, ans);
     if (err >= 0) {
         *parent = value_ptr(ans.inode);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -419,11 +2683,18 @@ ceph_ll_lseek(struct ceph_mount_info *cmount, struct Fh *filehandle,
     CEPH_REQ(ceph_ll_lseek, req, 0, ans, 0);
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.fh = ptr_value(filehandle);
     req.offset = offset;
     req.whence = whence;
 
+    proxy_files_flush(cmount);
+
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_LSEEK, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
     if (err >= 0) {
         return ans.offset;
     }
@@ -437,8 +2708,11 @@ ceph_ll_mkdir(struct ceph_mount_info *cmount, Inode *parent, const char *name,
               unsigned flags, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_mkdir, req, 1, ans, 1);
+    uint8_t stx_data[PROXY_STATX_SIZE];
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.userperm = ptr_value(perms);
     req.parent = ptr_value(parent);
     req.mode = mode;
@@ -446,13 +2720,16 @@ ceph_ll_mkdir(struct ceph_mount_info *cmount, Inode *parent, const char *name,
     req.flags = flags;
     CEPH_STR_ADD(req, name, name);
 
-    CEPH_BUFF_ADD(ans, stx, sizeof(*stx));
+    CEPH_BUFF_ADD(ans, stx_data, sizeof(stx_data));
 
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_MKDIR, req, ans);
     if (err >= 0) {
         *out = value_ptr(ans.inode);
+        err = proxy_statx_decode(stx, stx_data, ans.header.data_len);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -462,8 +2739,11 @@ ceph_ll_mknod(struct ceph_mount_info *cmount, Inode *parent, const char *name,
               unsigned want, unsigned flags, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_mknod, req, 1, ans, 1);
+    uint8_t stx_data[PROXY_STATX_SIZE];
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.userperm = ptr_value(perms);
     req.parent = ptr_value(parent);
     req.mode = mode;
@@ -472,13 +2752,16 @@ ceph_ll_mknod(struct ceph_mount_info *cmount, Inode *parent, const char *name,
     req.flags = flags;
     CEPH_STR_ADD(req, name, name);
 
-    CEPH_BUFF_ADD(ans, stx, sizeof(*stx));
+    CEPH_BUFF_ADD(ans, stx_data, sizeof(stx_data));
 
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_MKNOD, req, ans);
     if (err >= 0) {
         *out = value_ptr(ans.inode);
+        err = proxy_statx_decode(stx, stx_data, ans.header.data_len);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -489,15 +2772,57 @@ ceph_ll_open(struct ceph_mount_info *cmount, struct Inode *in, int flags,
     CEPH_REQ(ceph_ll_open, req, 0, ans, 0);
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
     req.flags = flags;
 
+    proxy_files_truncate(cmount, flags);
+
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_OPEN, req, ans);
     if (err >= 0) {
         *fh = value_ptr(ans.fh);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
+}
+
+/* Equivalent to ceph_ll_lookup() followed by ceph_ll_open(), in a single
+ * request. The returned statx reflects the state after opening the file. */
+__public int
+ceph_ll_openat(struct ceph_mount_info *cmount, Inode *parent, const char *name,
+               int oflags, Inode **outp, Fh **fhp, struct ceph_statx *stx,
+               unsigned want, unsigned lflags, const UserPerm *perms)
+{
+    CEPH_REQ(ceph_ll_openat, req, 1, ans, 1);
+    uint8_t stx_data[PROXY_STATX_SIZE];
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    req.userperm = ptr_value(perms);
+    req.parent = ptr_value(parent);
+    req.oflags = oflags;
+    req.want = want;
+    req.flags = lflags;
+    CEPH_STR_ADD(req, name, name);
+
+    CEPH_BUFF_ADD(ans, stx_data, sizeof(stx_data));
+
+    proxy_files_truncate(cmount, oflags);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_OPENAT, req, ans);
+    if (err >= 0) {
+        *outp = value_ptr(ans.inode);
+        *fhp = value_ptr(ans.fh);
+        err = proxy_statx_decode(stx, stx_data, ans.header.data_len);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -508,6 +2833,8 @@ ceph_ll_opendir(struct ceph_mount_info *cmount, struct Inode *in,
     CEPH_REQ(ceph_ll_opendir, req, 0, ans, 0);
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
 
@@ -516,17 +2843,31 @@ ceph_ll_opendir(struct ceph_mount_info *cmount, struct Inode *in,
         *dirpp = value_ptr(ans.dir);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
 __public int
 ceph_ll_put(struct ceph_mount_info *cmount, struct Inode *in)
 {
-    CEPH_REQ(ceph_ll_put, req, 0, ans, 0);
+    uint64_t inode;
+    int32_t err;
 
-    req.inode = ptr_value(in);
+    proxy_mutex_lock(&cmount->mutex);
+
+    inode = ptr_value(in);
+
+    /* The same handle could be reused for a different inode. */
+    proxy_xattr_invalidate(cmount, inode);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_PUT, req, ans);
+    /* Errors of the daemon are not reported, but they are logged once the
+     * answer is received. */
+    err = proxy_puts_add(cmount, inode);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -534,14 +2875,51 @@ ceph_ll_read(struct ceph_mount_info *cmount, struct Fh *filehandle, int64_t off,
              uint64_t len, char *buf)
 {
     CEPH_REQ(ceph_ll_read, req, 0, ans, 1);
+    proxy_stream_t *stream;
+    uint32_t done;
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.fh = ptr_value(filehandle);
-    req.offset = off;
-    req.len = len;
 
-    CEPH_BUFF_ADD(ans, buf, len);
+    proxy_files_flush(cmount);
+
+    /* A negative offset means the current position of the file, which is
+     * not tracked. */
+    done = 0;
+    stream = NULL;
+    if (off >= 0) {
+        stream = proxy_stream_get(cmount, req.fh);
+        if (stream != NULL) {
+            done = proxy_stream_read(cmount, stream, off, len, buf);
+        }
+    }
+
+    err = done;
+    if (done < len) {
+        req.offset = off + done;
+        req.len = len - done;
+
+        CEPH_BUFF_ADD(ans, buf + done, len - done);
+
+        err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_READ, req, ans);
+        if (err >= 0) {
+            err += done;
+        } else if (done > 0) {
+            /* Return what has already been read. The error will probably be
+             * returned by the next read. */
+            err = done;
+        }
+    }
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_READ, req, ans);
+    if ((stream != NULL) && (err >= 0)) {
+        proxy_stream_update(cmount, stream, off, len, err);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -549,6 +2927,9 @@ ceph_ll_readlink(struct ceph_mount_info *cmount, struct Inode *in, char *buf,
                  size_t bufsize, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_readlink, req, 0, ans, 1);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
@@ -556,17 +2937,28 @@ ceph_ll_readlink(struct ceph_mount_info *cmount, struct Inode *in, char *buf,
 
     CEPH_BUFF_ADD(ans, buf, bufsize);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_READLINK, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_READLINK, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
 ceph_ll_releasedir(struct ceph_mount_info *cmount, struct ceph_dir_result *dir)
 {
     CEPH_REQ(ceph_ll_releasedir, req, 0, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.dir = ptr_value(dir);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_RELEASEDIR, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_RELEASEDIR, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -574,12 +2966,21 @@ ceph_ll_removexattr(struct ceph_mount_info *cmount, struct Inode *in,
                     const char *name, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_removexattr, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
+
+    proxy_xattr_invalidate(cmount, req.inode);
     CEPH_STR_ADD(req, name, name);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_REMOVEXATTR, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_REMOVEXATTR, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -588,6 +2989,9 @@ ceph_ll_rename(struct ceph_mount_info *cmount, struct Inode *parent,
                const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_rename, req, 2, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.userperm = ptr_value(perms);
     req.old_parent = ptr_value(parent);
@@ -595,17 +2999,25 @@ ceph_ll_rename(struct ceph_mount_info *cmount, struct Inode *parent,
     CEPH_STR_ADD(req, old_name, name);
     CEPH_STR_ADD(req, new_name, newname);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_RENAME, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_RENAME, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public void
 ceph_rewinddir(struct ceph_mount_info *cmount, struct ceph_dir_result *dirp)
 {
-    CEPH_REQ(ceph_rewinddir, req, 0, ans, 0);
+    CEPH_DATA(ceph_rewinddir, req, 0);
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.dir = ptr_value(dirp);
 
-    CEPH_PROCESS(cmount, LIBCEPHFSD_OP_REWINDDIR, req, ans);
+    CEPH_PROCESS_ONEWAY(cmount, LIBCEPHFSD_OP_REWINDDIR, req);
+
+    proxy_mutex_unlock(&cmount->mutex);
 }
 
 __public int
@@ -613,12 +3025,19 @@ ceph_ll_rmdir(struct ceph_mount_info *cmount, struct Inode *in,
               const char *name, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_rmdir, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.userperm = ptr_value(perms);
     req.parent = ptr_value(in);
     CEPH_STR_ADD(req, name, name);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_RMDIR, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_RMDIR, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -626,13 +3045,25 @@ ceph_ll_setattr(struct ceph_mount_info *cmount, struct Inode *in,
                 struct ceph_statx *stx, int mask, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_setattr, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
+
+    proxy_xattr_invalidate(cmount, req.inode);
     req.mask = mask;
     CEPH_BUFF_ADD(req, stx, sizeof(*stx));
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_SETATTR, req, ans);
+    proxy_files_flush(cmount);
+    proxy_stream_invalidate(cmount, 0);
+
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_SETATTR, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -641,15 +3072,24 @@ ceph_ll_setxattr(struct ceph_mount_info *cmount, struct Inode *in,
                  const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_setxattr, req, 2, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.userperm = ptr_value(perms);
     req.inode = ptr_value(in);
+
+    proxy_xattr_invalidate(cmount, req.inode);
     req.size = size;
     req.flags = flags;
     CEPH_STR_ADD(req, name, name);
     CEPH_BUFF_ADD(req, value, size);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_SETXATTR, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_SETXATTR, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -657,12 +3097,19 @@ ceph_ll_statfs(struct ceph_mount_info *cmount, struct Inode *in,
                struct statvfs *stbuf)
 {
     CEPH_REQ(ceph_ll_statfs, req, 0, ans, 1);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.inode = ptr_value(in);
 
     CEPH_BUFF_ADD(ans, stbuf, sizeof(*stbuf));
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_STATFS, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_STATFS, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -671,8 +3118,11 @@ ceph_ll_symlink(struct ceph_mount_info *cmount, Inode *in, const char *name,
                 unsigned want, unsigned flags, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_symlink, req, 2, ans, 1);
+    uint8_t stx_data[PROXY_STATX_SIZE];
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.userperm = ptr_value(perms);
     req.parent = ptr_value(in);
     req.want = want;
@@ -680,13 +3130,16 @@ ceph_ll_symlink(struct ceph_mount_info *cmount, Inode *in, const char *name,
     CEPH_STR_ADD(req, name, name);
     CEPH_STR_ADD(req, target, value);
 
-    CEPH_BUFF_ADD(req, stx, sizeof(*stx));
+    CEPH_BUFF_ADD(ans, stx_data, sizeof(stx_data));
 
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_SYMLINK, req, ans);
     if (err >= 0) {
         *out = value_ptr(ans.inode);
+        err = proxy_statx_decode(stx, stx_data, ans.header.data_len);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -695,12 +3148,19 @@ ceph_ll_unlink(struct ceph_mount_info *cmount, struct Inode *in,
                const char *name, const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_unlink, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     req.userperm = ptr_value(perms);
     req.parent = ptr_value(in);
     CEPH_STR_ADD(req, name, name);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_UNLINK, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_UNLINK, req, ans);
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
@@ -709,20 +3169,26 @@ ceph_ll_walk(struct ceph_mount_info *cmount, const char *name, Inode **i,
              const UserPerm *perms)
 {
     CEPH_REQ(ceph_ll_walk, req, 1, ans, 1);
+    uint8_t stx_data[PROXY_STATX_SIZE];
     int32_t err;
 
+    proxy_mutex_lock(&cmount->mutex);
+
     req.userperm = ptr_value(perms);
     req.want = want;
     req.flags = flags;
     CEPH_STR_ADD(req, path, name);
 
-    CEPH_BUFF_ADD(ans, stx, sizeof(*stx));
+    CEPH_BUFF_ADD(ans, stx_data, sizeof(stx_data));
 
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_WALK, req, ans);
     if (err >= 0) {
         *i = value_ptr(ans.inode);
+        err = proxy_statx_decode(stx, stx_data, ans.header.data_len);
     }
 
+    proxy_mutex_unlock(&cmount->mutex);
+
     return err;
 }
 
@@ -731,23 +3197,55 @@ ceph_ll_write(struct ceph_mount_info *cmount, struct Fh *filehandle,
               int64_t off, uint64_t len, const char *data)
 {
     CEPH_REQ(ceph_ll_write, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    /* The result can't report more than INT32_MAX bytes, so bigger writes are
+     * short, like write(2). */
+    if (len > INT32_MAX) {
+        len = INT32_MAX;
+    }
 
     req.fh = ptr_value(filehandle);
-    req.offset = off;
-    req.len = len;
-    CEPH_BUFF_ADD(req, data, len);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_WRITE, req, ans);
+    /* Other handles of the same file may have prefetched data. */
+    proxy_stream_invalidate(cmount, 0);
+
+    if (proxy_file_write(cmount, req.fh, off, len, data)) {
+        proxy_files_expire(cmount);
+        err = len;
+    } else {
+        req.offset = off;
+        req.len = len;
+        CEPH_BUFF_ADD(req, data, len);
+
+        err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_LL_WRITE, req, ans);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public int
 ceph_mount(struct ceph_mount_info *cmount, const char *root)
 {
     CEPH_REQ(ceph_mount, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     CEPH_STR_ADD(req, root, root);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_MOUNT, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_MOUNT, req, ans);
+    if (err >= 0) {
+        err = proxy_setup_add(cmount, LIBCEPHFSD_OP_MOUNT, root, NULL, 0);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
 }
 
 __public struct dirent *
@@ -762,7 +3260,10 @@ ceph_readdir(struct ceph_mount_info *cmount, struct ceph_dir_result *dirp)
 
     CEPH_BUFF_ADD(ans, &de, sizeof(de));
 
+    proxy_mutex_lock(&cmount->mutex);
     err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_READDIR, req, ans);
+    proxy_mutex_unlock(&cmount->mutex);
+
     if (err < 0) {
         errno = -err;
     }
@@ -777,54 +3278,171 @@ __public int
 ceph_release(struct ceph_mount_info *cmount)
 {
     CEPH_REQ(ceph_release, req, 0, ans, 0);
+    int32_t err;
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_RELEASE, req, ans);
+    proxy_mutex_lock(&cmount->mutex);
+
+    proxy_files_flush(cmount);
+    proxy_stream_forget(cmount, 0);
+
+    /* Releases are not sent while disconnected. Reconnect first so that they
+     * are not lost with the mount. */
+    err = proxy_ready(cmount);
+    if (err >= 0) {
+        proxy_puts_flush(cmount);
+        err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_RELEASE, req, ans);
+    }
+    if (err < 0) {
+        proxy_mutex_unlock(&cmount->mutex);
+        return err;
+    }
+
+    /* The flush thread can't take the mount once it's out of the list. */
+    proxy_flush_cancel(cmount);
+
+    proxy_xattr_invalidate(cmount, 0);
+    proxy_files_drop(cmount);
+    proxy_disconnect(&cmount->link);
+    proxy_setup_destroy(cmount);
+    proxy_buffer_close(&cmount->buffer);
+
+    proxy_mutex_unlock(&cmount->mutex);
+    pthread_mutex_destroy(&cmount->mutex);
+    proxy_free(cmount);
+
+    return err;
 }
 
 __public int
 ceph_select_filesystem(struct ceph_mount_info *cmount, const char *fs_name)
 {
     CEPH_REQ(ceph_select_filesystem, req, 1, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
 
     CEPH_STR_ADD(req, fs, fs_name);
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_SELECT_FILESYSTEM, req, ans);
+    err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_SELECT_FILESYSTEM, req, ans);
+    if (err >= 0) {
+        err = proxy_setup_add(cmount, LIBCEPHFSD_OP_SELECT_FILESYSTEM, fs_name,
+                              NULL, 0);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
+}
+
+/* Set the maximum time, in milliseconds, that requests sent through the mount
+ * can wait in the daemon before being started. Requests that can't start in
+ * time fail with ETIMEDOUT. A value of 0 removes the deadline. */
+__public int
+ceph_set_timeout(struct ceph_mount_info *cmount, uint32_t msecs)
+{
+    if (msecs > PROXY_TIMEOUT_MAX) {
+        return -EINVAL;
+    }
+
+    cmount->timeout = msecs;
+
+    return 0;
 }
 
 __public int
 ceph_unmount(struct ceph_mount_info *cmount)
 {
     CEPH_REQ(ceph_unmount, req, 0, ans, 0);
+    int32_t err;
+
+    proxy_mutex_lock(&cmount->mutex);
+
+    proxy_files_flush(cmount);
+    proxy_stream_forget(cmount, 0);
+
+    /* Releases are not sent while disconnected. Reconnect first so that they
+     * are not lost. */
+    err = proxy_ready(cmount);
+    if (err >= 0) {
+        proxy_puts_flush(cmount);
+        err = CEPH_PROCESS(cmount, LIBCEPHFSD_OP_UNMOUNT, req, ans);
+    }
+    if (err >= 0) {
+        proxy_xattr_invalidate(cmount, 0);
+        proxy_setup_del(cmount, LIBCEPHFSD_OP_MOUNT);
+    }
+
+    proxy_mutex_unlock(&cmount->mutex);
+
+    return err;
+}
+
+static void
+proxy_userperm_destroy(uint64_t handle)
+{
+    CEPH_DATA(ceph_userperm_destroy, req, 0);
+    struct ceph_mount_info *cmount;
+
+    cmount = proxy_global_get();
+    if (cmount == NULL) {
+        return;
+    }
 
-    return CEPH_PROCESS(cmount, LIBCEPHFSD_OP_UNMOUNT, req, ans);
+    req.userperm = handle;
+
+    if (proxy_ready(cmount) >= 0) {
+        CEPH_RUN_ONEWAY(cmount, LIBCEPHFSD_OP_USERPERM_DESTROY, req);
+    }
+
+    proxy_global_put(cmount);
 }
 
 __public void
 ceph_userperm_destroy(UserPerm *perms)
 {
-    CEPH_REQ(ceph_userperm_destroy, req, 0, ans, 0);
-
-    req.userperm = ptr_value(perms);
+    uint64_t handle;
 
-    CEPH_RUN(&global_cmount, LIBCEPHFSD_OP_USERPERM_DESTROY, req, ans);
+    handle = proxy_userperm_release(ptr_value(perms));
+    if (handle != 0) {
+        proxy_userperm_destroy(handle);
+    }
 }
 
 __public UserPerm *
 ceph_userperm_new(uid_t uid, gid_t gid, int ngids, gid_t *gidlist)
 {
     CEPH_REQ(ceph_userperm_new, req, 1, ans, 0);
+    struct ceph_mount_info *cmount;
     int32_t err;
 
+    ans.userperm = proxy_userperm_find(uid, gid, ngids, gidlist);
+    if (ans.userperm != 0) {
+        return value_ptr(ans.userperm);
+    }
+
+    cmount = proxy_global_get();
+    if (cmount == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
     req.uid = uid;
     req.gid = gid;
     req.groups = ngids;
     CEPH_BUFF_ADD(req, gidlist, sizeof(gid_t) * ngids);
 
-    err = proxy_global_connect();
+    err = proxy_ready(cmount);
     if (err >= 0) {
-        err = CEPH_RUN(&global_cmount, LIBCEPHFSD_OP_USERPERM_NEW, req, ans);
+        err = CEPH_RUN(cmount, LIBCEPHFSD_OP_USERPERM_NEW, req, ans);
     }
+
+    proxy_global_put(cmount);
+
     if (err >= 0) {
+        if (!proxy_userperm_insert(ans.userperm, uid, gid, ngids, gidlist)) {
+            proxy_userperm_destroy(ans.userperm);
+        }
+
         return value_ptr(ans.userperm);
     }
 
@@ -836,8 +3454,13 @@ ceph_userperm_new(uid_t uid, gid_t gid, int ngids, gid_t *gidlist)
 __public const char *
 ceph_version(int *major, int *minor, int *patch)
 {
+    static pthread_mutex_t version_mutex = PTHREAD_MUTEX_INITIALIZER;
     static char cached_version[128];
     static int32_t cached_major = -1, cached_minor, cached_patch;
+    struct ceph_mount_info *cmount;
+
+    /* The version never changes, so it's only requested once. */
+    proxy_mutex_lock(&version_mutex);
 
     if (cached_major < 0) {
         CEPH_REQ(ceph_version, req, 0, ans, 1);
@@ -845,12 +3468,19 @@ ceph_version(int *major, int *minor, int *patch)
 
         CEPH_BUFF_ADD(ans, cached_version, sizeof(cached_version));
 
-        err = proxy_global_connect();
-        if (err >= 0) {
-            err = CEPH_RUN(&global_cmount, LIBCEPHFSD_OP_VERSION, req, ans);
+        err = -ENOMEM;
+        cmount = proxy_global_get();
+        if (cmount != NULL) {
+            err = proxy_ready(cmount);
+            if (err >= 0) {
+                err = CEPH_RUN(cmount, LIBCEPHFSD_OP_VERSION, req, ans);
+            }
+            proxy_global_put(cmount);
         }
 
         if (err < 0) {
+            proxy_mutex_unlock(&version_mutex);
+
             *major = 0;
             *minor = 0;
             *patch = 0;
@@ -863,6 +3493,8 @@ ceph_version(int *major, int *minor, int *patch)
         cached_patch = ans.patch;
     }
 
+    proxy_mutex_unlock(&version_mutex);
+
     *major = cached_major;
     *minor = cached_minor;
     *patch = cached_patch;
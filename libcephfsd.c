@@ -1,8 +1,11 @@
-
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <endian.h>
 #include <ctype.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/random.h>
 
 #include <cephfs/libcephfs.h>
 
@@ -10,37 +13,92 @@
 #include "proxy_link.h"
 #include "proxy_buffer.h"
 #include "proxy_helpers.h"
+#include "proxy_list.h"
 #include "proxy_log.h"
 #include "proxy_requests.h"
 #include "proxy_mount.h"
+#include "proxy_sched.h"
+#include "proxy_trace.h"
+
+/* Number of seconds a disconnected session is kept before destroying it. */
+#define PROXY_SESSION_TIMEOUT 60
+
+/* Default size of the segments in which large reads are done and sent. It's
+ * also the maximum memory used by each read. */
+#define PROXY_READ_SEGMENT (1024 * 1024)
+#define PROXY_READ_SEGMENT_MAX (64 * 1024 * 1024)
+
+/* Same for writes whose data doesn't fit in the request buffer. The data is
+ * received and written one segment at a time. */
+#define PROXY_WRITE_SEGMENT (1024 * 1024)
+#define PROXY_WRITE_SEGMENT_MAX (64 * 1024 * 1024)
 
 typedef struct _proxy_server {
+    proxy_worker_t worker;
     proxy_link_t link;
     proxy_manager_t *manager;
+    const char *path;
+    cpu_set_t cpus;
+    int32_t backlog;
+    int32_t error;
+    bool pinned;
 } proxy_server_t;
 
+typedef struct _proxy_session {
+    list_t list;
+    list_t mounts;
+    proxy_random_t random;
+    proxy_flow_t *flow;
+    uint64_t token;
+    time_t expires;
+    bool attached;
+} proxy_session_t;
+
 typedef struct _proxy_client {
     proxy_worker_t worker;
     proxy_buffer_t buffer_read;
     proxy_buffer_t buffer_write;
     proxy_log_handler_t log_handler;
     proxy_link_t *link;
+    proxy_session_t *session;
+    proxy_flow_t flow;
+    proxy_sched_t *sched;
+    proxy_trace_t *trace;
+    proxy_req_t *trace_req;
+    const void *trace_data;
+    uint64_t trace_time;
+    uint32_t trace_id;
     pthread_mutex_t log_mutex;
     proxy_random_t random;
     void *buffer;
     uint32_t buffer_size;
+    uint64_t seq;
+    uint64_t perms_handle;
+    uint64_t perms_generation;
+    uint32_t perms_uid;
+    int32_t deferred;
+    int32_t sched_class;
     int32_t sd;
+    bool sched_paused;
+    bool oneway;
+    bool counted;
 } proxy_client_t;
 
 typedef struct _proxy {
     proxy_manager_t manager;
     proxy_log_handler_t log_handler;
-    const char *socket_path;
+    proxy_worker_t sweeper;
+    proxy_server_t *servers;
+    proxy_trace_t trace;
+    const char *trace_path;
+    uint64_t trace_size;
+    uint32_t trace_data;
+    int32_t count;
 } proxy_t;
 
 typedef struct _client_command {
     const char *name;
-    void (*handler)(proxy_client_t *);
+    void (*handler)(proxy_client_t *, char *);
 } client_command_t;
 
 typedef int32_t (*proxy_handler_t)(proxy_client_t *, proxy_req_t *,
@@ -48,6 +106,28 @@ typedef int32_t (*proxy_handler_t)(proxy_client_t *, proxy_req_t *,
 
 static proxy_random_t global_random;
 
+/* Tag of the last proxy_random_t created. Consecutive sessions get different
+ * ones, starting from a random value, so that most handles of old sessions are
+ * rejected as stale even after a restart. The checksum of the handles catches
+ * the ones whose tag has been reused. */
+static uint8_t random_tag;
+
+/* Random identifier of this run of the daemon. */
+static uint64_t daemon_instance;
+
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list_t session_list = LIST_INIT(&session_list);
+
+static uint32_t read_segment = PROXY_READ_SEGMENT;
+static uint32_t write_segment = PROXY_WRITE_SEGMENT;
+
+/* Number of library connections being served, and the maximum allowed (0
+ * means no limit). */
+static pthread_mutex_t connection_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t connection_count = 0;
+static uint32_t connection_max = 0;
+static bool connection_warned = false;
+
 /*
 struct _proxy_link_cmd {
     uint16_t op;
@@ -262,6 +342,54 @@ client_log_handler(proxy_log_handler_t *handler, int32_t level, int32_t err,
     client_write(client, "[%d] %s\n", level, msg);
 }
 
+static int32_t
+send_answer(proxy_client_t *client, int32_t result, struct iovec *iov,
+            int32_t count)
+{
+    proxy_link_ans_t *ans;
+    uint32_t flags;
+    int32_t err;
+
+    /* proxy_link_ans_send() modifies the iovec, so keep a reference to the
+     * answer header. */
+    ans = iov[0].iov_base;
+
+    if (client->oneway) {
+        /* Nobody is waiting for this answer. A failure is reported in the
+         * next answer sent. The header is only filled for the trace. */
+        if ((result < 0) && (client->deferred == 0)) {
+            client->deferred = result;
+        }
+
+        ans->header_len = iov[0].iov_len;
+        ans->flags = 0;
+        ans->result = result;
+        ans->data_len = 0;
+
+        err = 0;
+    } else {
+        flags = 0;
+        if (client->deferred < 0) {
+            err = -client->deferred;
+            if (err > UINT8_MAX) {
+                err = EIO;
+            }
+            flags |= PROXY_LINK_DEFERRED | (err << PROXY_LINK_DEFERRED_SHIFT);
+            client->deferred = 0;
+        }
+
+        err = proxy_link_ans_send(client->sd, result, flags, iov, count);
+    }
+
+    if ((client->trace != NULL) && (client->trace_req != NULL)) {
+        proxy_trace_add(client->trace, client->trace_id, client->trace_time,
+                        &client->trace_req->header, client->trace_data, ans);
+        client->trace_req = NULL;
+    }
+
+    return err;
+}
+
 static int32_t
 send_error(proxy_client_t *client, int32_t error)
 {
@@ -271,18 +399,34 @@ send_error(proxy_client_t *client, int32_t error)
     iov[0].iov_base = &ans;
     iov[0].iov_len = sizeof(ans);
 
-    return proxy_link_ans_send(client->sd, error, iov, 1);
+    return send_answer(client, error, iov, 1);
 }
 
+static uint8_t
+random_tag_next(void)
+{
+    uint8_t tag;
+
+    /* A tag of 0 is not used, so that handles are never 0. */
+    do {
+        tag = __atomic_add_fetch(&random_tag, 1, __ATOMIC_RELAXED);
+    } while (tag == 0);
+
+    return tag;
+}
+
+/* Valid pointers are 8-byte aligned and below 128 TiB (47 bits), so only 44
+ * bits are significant. The remaining scrambled bits hold a checksum. */
+#define PTR_ADDRESS_BITS 44
+#define PTR_ADDRESS_MASK ((1ULL << PTR_ADDRESS_BITS) - 1)
+
 static uint64_t
 uint64_checksum(uint64_t value)
 {
-    value = (value & 0xff00ff00ff00ffULL) +
-            ((value >> 8) & 0xff00ff00ff00ffULL);
-    value += value >> 16;
-    value += value >> 32;
+    value ^= value >> 24;
+    value ^= value >> 12;
 
-    return value & 0xff;
+    return value & ((1ULL << (RANDOM_BITS - PTR_ADDRESS_BITS)) - 1);
 }
 
 static uint64_t
@@ -297,22 +441,29 @@ ptr_checksum(proxy_random_t *rnd, void *ptr)
     value = (uint64_t)(uintptr_t)ptr;
     /* Many current processors don't use the full 64-bits for the virtual
      * address space, and Linux assigns the lower 128 TiB (47 bits) for
-     * user-space applications on most architectures, so the highest 8 bits
-     * of all valid addressess are always 0.
+     * user-space applications on most architectures, so the highest 17 bits
+     * of all valid addressess are always 0. Pointers to our structures are
+     * also aligned to 8 bytes, so the lowest 3 bits are 0 too.
      *
-     * We use this to encode a checksum in the high byte of the address to
-     * be able to do a verification before dereferencing the pointer, avoiding
-     * crashes if the client passes an invalid or corrupted pointer value.
+     * We use this to encode a checksum next to the significant bits of the
+     * address before scrambling them, to be able to do a verification before
+     * dereferencing the pointer, avoiding crashes if the client passes an
+     * invalid or corrupted pointer value. The tag of the session that created
+     * the handle is stored in clear in the highest byte, so that handles from
+     * another session (for example one that has expired, or from before a
+     * restart of the daemon) are usually detected as stale before even
+     * unscrambling them.
      *
      * Alternatives like using indexes in a table or registering valid pointers
      * require access to a shared data structure that will require thread
      * synchronization, making it slower. */
-    if ((value & 0xff00000000000007ULL) != 0) {
+    if ((value & ~(PTR_ADDRESS_MASK << 3)) != 0) {
         proxy_log(LOG_ERR, EINVAL, "Unexpected or corrupted pointer value");
         abort();
     }
 
-    value -= uint64_checksum(value) << 56;
+    value >>= 3;
+    value |= uint64_checksum(value) << PTR_ADDRESS_BITS;
 
     return random_scramble(rnd, value);
 }
@@ -320,30 +471,257 @@ ptr_checksum(proxy_random_t *rnd, void *ptr)
 static int32_t
 ptr_check(proxy_random_t *rnd, uint64_t value, void **pptr)
 {
+    uint64_t address;
+
     if (value == 0) {
         *pptr = NULL;
         return 0;
     }
 
+    if ((value & ~RANDOM_MASK) != rnd->tag) {
+        proxy_log(LOG_ERR, ESTALE, "Handle from another session");
+        return -ESTALE;
+    }
+
     value = random_unscramble(rnd, value);
+    address = value & PTR_ADDRESS_MASK;
 
-    if ((uint64_checksum(value) != 0) || ((value & 7) != 0)) {
+    if ((address == 0) ||
+        ((value >> PTR_ADDRESS_BITS) != uint64_checksum(address))) {
         proxy_log(LOG_ERR, EFAULT, "Unexpected pointer value");
         return -EFAULT;
     }
 
-    *pptr = (void *)(uintptr_t)(value & 0xffffffffffffffULL);
+    *pptr = (void *)(uintptr_t)(address << 3);
+
+    return 0;
+}
+
+/* Client sessions
+ *
+ * Each binary connection is bound to a session that owns all the mounts
+ * created through it, as well as the random values used to encode the pointers
+ * sent to the client. When the connection is lost, the session is not
+ * destroyed immediately. It's kept for PROXY_SESSION_TIMEOUT seconds so that
+ * the client can reconnect and resume it by presenting its token. This way
+ * all the handles the client owns remain valid after a reconnection.
+ *
+ * Sessions that are not resumed in time are destroyed, and all their mounts
+ * are unmounted and released. Handles carry the tag of the session that
+ * created them, so once a session is gone its handles are rejected with ESTALE
+ * (or with EFAULT by the checksum if the tag has been reused) instead of being
+ * dereferenced.
+ */
+
+static time_t
+session_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec;
+}
+
+static int32_t
+session_token(uint64_t *token)
+{
+    ssize_t len;
+
+    *token = 0;
+    while (*token == 0) {
+        len = getrandom(token, sizeof(*token), 0);
+        if (len < 0) {
+            if (errno != EINTR) {
+                return proxy_log(LOG_ERR, errno,
+                                 "Failed to generate a session token");
+            }
+            *token = 0;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t
+session_create(proxy_client_t *client)
+{
+    proxy_session_t *session;
+    int32_t err;
+
+    session = proxy_malloc(sizeof(proxy_session_t));
+    if (session == NULL) {
+        return -ENOMEM;
+    }
+
+    err = session_token(&session->token);
+    if (err < 0) {
+        proxy_free(session);
+        return err;
+    }
+
+    list_init(&session->mounts);
+    session->random = client->random;
+    session->flow = &client->flow;
+    session->expires = 0;
+    session->attached = true;
+
+    proxy_mutex_lock(&session_mutex);
+    list_add_tail(&session->list, &session_list);
+    proxy_mutex_unlock(&session_mutex);
+
+    client->session = session;
+
+    return 0;
+}
+
+static void
+session_destroy(proxy_session_t *session)
+{
+    proxy_mount_t *mount;
+
+    while (!list_empty(&session->mounts)) {
+        mount = list_first_entry(&session->mounts, proxy_mount_t, list);
+        list_del_init(&mount->list);
+
+        if (mount->root != NULL) {
+            proxy_mount_unmount(mount);
+        }
+        if (proxy_mount_release(mount) < 0) {
+            proxy_log(LOG_ERR, 0, "Unable to release a mount of an expired "
+                                  "session (%p)", mount);
+        }
+    }
+
+    proxy_free(session);
+}
+
+/* Destroy all detached sessions whose grace period has expired. */
+static void
+session_sweep(void)
+{
+    proxy_session_t *session;
+    list_t expired, *item;
+    time_t now;
+
+    list_init(&expired);
+    now = session_now();
+
+    proxy_mutex_lock(&session_mutex);
+
+    item = session_list.next;
+    while (item != &session_list) {
+        session = list_entry(item, proxy_session_t, list);
+        item = item->next;
+
+        if (!session->attached && (session->expires <= now)) {
+            list_move_tail(&session->list, &expired);
+        }
+    }
+
+    proxy_mutex_unlock(&session_mutex);
+
+    while (!list_empty(&expired)) {
+        session = list_first_entry(&expired, proxy_session_t, list);
+        list_del(&session->list);
+
+        proxy_log(LOG_INFO, 0, "Destroying expired session (%p)", session);
+
+        session_destroy(session);
+    }
+}
+
+/* Attach the session identified by 'token' to the client. Returns 1 if the
+ * session has been resumed or 0 if it doesn't exist. In the later case, the
+ * client keeps its new session. */
+static int32_t
+session_resume(proxy_client_t *client, uint64_t token)
+{
+    proxy_session_t *session;
+
+    if (!list_empty(&client->session->mounts)) {
+        return proxy_log(LOG_ERR, EISCONN,
+                         "Cannot resume a session after creating mounts");
+    }
+
+    proxy_mutex_lock(&session_mutex);
+
+    list_for_each_entry(session, &session_list, list) {
+        if (session->token != token) {
+            continue;
+        }
+
+        /* The previous connection may not have detected the disconnection
+         * yet. The client will retry later. */
+        if (session->attached) {
+            proxy_mutex_unlock(&session_mutex);
+
+            return -EBUSY;
+        }
+
+        session->attached = true;
+        session->flow = &client->flow;
+        list_del(&client->session->list);
+
+        proxy_mutex_unlock(&session_mutex);
+
+        proxy_free(client->session);
+        client->session = session;
+        client->random = session->random;
+
+        proxy_log(LOG_INFO, 0, "Resumed session (%p)", session);
+
+        return 1;
+    }
+
+    proxy_mutex_unlock(&session_mutex);
 
     return 0;
 }
 
+/* Cancel a request of the connection attached to a session. */
+static int32_t
+session_cancel(uint64_t token, uint64_t seq)
+{
+    proxy_session_t *session;
+    int32_t err;
+
+    err = -ENOENT;
+
+    proxy_mutex_lock(&session_mutex);
+
+    list_for_each_entry(session, &session_list, list) {
+        if ((session->token == token) && session->attached) {
+            err = proxy_flow_cancel(session->flow, seq);
+            break;
+        }
+    }
+
+    proxy_mutex_unlock(&session_mutex);
+
+    return err;
+}
+
+/* Sessions without mounts are also kept, since the client may still resume
+ * them to continue using the same handles. */
+static void
+session_detach(proxy_session_t *session)
+{
+    proxy_mutex_lock(&session_mutex);
+
+    session->attached = false;
+    session->expires = session_now() + PROXY_SESSION_TIMEOUT;
+
+    proxy_mutex_unlock(&session_mutex);
+}
+
 #define CEPH_COMPLETE(_client, _err, _ans) \
     ({ \
         int32_t __err = (_err); \
         if (__err < 0) { \
             __err = send_error(_client, __err); \
         } else { \
-            __err = CEPH_RET(_client->sd, __err, _ans); \
+            __err = send_answer(_client, __err, _ans##_iov, _ans##_count); \
         } \
         __err; \
     })
@@ -354,6 +732,43 @@ ptr_check(proxy_random_t *rnd, uint64_t value, void **pptr)
 #define TRACE(_fmt, _args...) printf(_fmt "\n", ## _args)
 #endif
 
+static int32_t
+libcephfsd_session(proxy_client_t *client, proxy_req_t *req, const void *data,
+                   int32_t data_size)
+{
+    CEPH_DATA(session, ans, 0);
+    uint64_t token;
+    int32_t err;
+
+    token = req->session.token;
+
+    err = 0;
+    if ((token != 0) && (token != client->session->token)) {
+        err = session_resume(client, token);
+    }
+    TRACE("session(%p) -> %d", client->session, err);
+
+    if (err >= 0) {
+        ans.token = client->session->token;
+        ans.instance = daemon_instance;
+    }
+
+    return CEPH_COMPLETE(client, err, ans);
+}
+
+static int32_t
+libcephfsd_cancel(proxy_client_t *client, proxy_req_t *req, const void *data,
+                  int32_t data_size)
+{
+    CEPH_DATA(cancel, ans, 0);
+    int32_t err;
+
+    err = session_cancel(req->cancel.token, req->cancel.seq);
+    TRACE("cancel() -> %d", err);
+
+    return CEPH_COMPLETE(client, err, ans);
+}
+
 static int32_t
 libcephfsd_version(proxy_client_t *client, proxy_req_t *req, const void *data,
                    int32_t data_size)
@@ -371,7 +786,180 @@ libcephfsd_version(proxy_client_t *client, proxy_req_t *req, const void *data,
 
     CEPH_STR_ADD(ans, text, text);
 
-    return CEPH_RET(client->sd, 0, ans);
+    return send_answer(client, 0, ans_iov, ans_count);
+}
+
+/* UserPerm registry
+ *
+ * Clients create a UserPerm for almost every request they process, but most of
+ * them use the same credentials. Instead of creating a new UserPerm each time,
+ * a single reference counted UserPerm is kept for each set of credentials. It
+ * can be found by its credentials or by its address.
+ *
+ * Connections cache the uid of the last UserPerm they used, to charge their
+ * requests to it without searching the registry. The generation changes each
+ * time a UserPerm is destroyed, since its address (and so its handle) can be
+ * reused for other credentials, and invalidates all the cached uids. */
+
+#define USERPERM_HASH_SIZE 256
+
+typedef struct _proxy_userperm {
+    list_t creds_list;
+    list_t ptr_list;
+    UserPerm *perms;
+    uint32_t refs;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t groups;
+    gid_t gids[];
+} proxy_userperm_t;
+
+static pthread_mutex_t userperm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list_t userperm_creds[USERPERM_HASH_SIZE];
+static list_t userperm_ptrs[USERPERM_HASH_SIZE];
+static uint64_t userperm_generation = 1;
+
+/* Must be called with userperm_mutex held. */
+static list_t *
+userperm_bucket(list_t *table, uint32_t hash)
+{
+    list_t *list;
+
+    list = &table[hash % USERPERM_HASH_SIZE];
+    if (list->next == NULL) {
+        list_init(list);
+    }
+
+    return list;
+}
+
+static uint32_t
+userperm_hash(uint32_t uid, uint32_t gid, uint32_t groups, const gid_t *gids)
+{
+    uint32_t hash, i;
+
+    /* FNV-1a over the credentials, one 32-bit word at a time. */
+    hash = 2166136261U;
+    hash = (hash ^ uid) * 16777619U;
+    hash = (hash ^ gid) * 16777619U;
+    hash = (hash ^ groups) * 16777619U;
+    for (i = 0; i < groups; i++) {
+        hash = (hash ^ gids[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+static UserPerm *
+userperm_get(uint32_t uid, uint32_t gid, uint32_t groups, const gid_t *gids)
+{
+    proxy_userperm_t *userperm;
+    UserPerm *perms;
+    list_t *list;
+
+    perms = NULL;
+
+    proxy_mutex_lock(&userperm_mutex);
+
+    list = userperm_bucket(userperm_creds,
+                           userperm_hash(uid, gid, groups, gids));
+
+    list_for_each_entry(userperm, list, creds_list) {
+        if ((userperm->uid == uid) && (userperm->gid == gid) &&
+            (userperm->groups == groups) &&
+            (memcmp(userperm->gids, gids, groups * sizeof(gid_t)) == 0)) {
+            userperm->refs++;
+            perms = userperm->perms;
+            goto done;
+        }
+    }
+
+    userperm = proxy_malloc(sizeof(proxy_userperm_t) +
+                            groups * sizeof(gid_t));
+    if (userperm == NULL) {
+        goto done;
+    }
+
+    perms = ceph_userperm_new(uid, gid, groups, (gid_t *)gids);
+    TRACE("ceph_userperm_new(%u, %u, %u) -> %p", uid, gid, groups, perms);
+    if (perms == NULL) {
+        proxy_free(userperm);
+        goto done;
+    }
+
+    userperm->perms = perms;
+    userperm->refs = 1;
+    userperm->uid = uid;
+    userperm->gid = gid;
+    userperm->groups = groups;
+    memcpy(userperm->gids, gids, groups * sizeof(gid_t));
+
+    list_add(&userperm->creds_list, list);
+    list_add(&userperm->ptr_list,
+             userperm_bucket(userperm_ptrs, (uintptr_t)perms >> 4));
+
+done:
+    proxy_mutex_unlock(&userperm_mutex);
+
+    return perms;
+}
+
+static int32_t
+userperm_put(UserPerm *perms)
+{
+    proxy_userperm_t *userperm;
+    list_t *list;
+    int32_t err;
+
+    proxy_mutex_lock(&userperm_mutex);
+
+    list = userperm_bucket(userperm_ptrs, (uintptr_t)perms >> 4);
+
+    err = -EINVAL;
+    list_for_each_entry(userperm, list, ptr_list) {
+        if (userperm->perms == perms) {
+            err = 0;
+            if (--userperm->refs == 0) {
+                list_del(&userperm->creds_list);
+                list_del(&userperm->ptr_list);
+                __atomic_add_fetch(&userperm_generation, 1, __ATOMIC_RELEASE);
+                ceph_userperm_destroy(perms);
+                TRACE("ceph_userperm_destroy(%p)", perms);
+                proxy_free(userperm);
+            }
+            break;
+        }
+    }
+
+    proxy_mutex_unlock(&userperm_mutex);
+
+    return err;
+}
+
+/* Find the uid of a UserPerm created by userperm_get(). */
+static int32_t
+userperm_uid(UserPerm *perms, uint32_t *uid)
+{
+    proxy_userperm_t *userperm;
+    list_t *list;
+    int32_t err;
+
+    proxy_mutex_lock(&userperm_mutex);
+
+    list = userperm_bucket(userperm_ptrs, (uintptr_t)perms >> 4);
+
+    err = -ENOENT;
+    list_for_each_entry(userperm, list, ptr_list) {
+        if (userperm->perms == perms) {
+            *uid = userperm->uid;
+            err = 0;
+            break;
+        }
+    }
+
+    proxy_mutex_unlock(&userperm_mutex);
+
+    return err;
 }
 
 static int32_t
@@ -380,12 +968,16 @@ libcephfsd_userperm_new(proxy_client_t *client, proxy_req_t *req,
 {
     CEPH_DATA(ceph_userperm_new, ans, 0);
     UserPerm *userperm;
+    uint32_t groups;
     int32_t err;
 
-    userperm = ceph_userperm_new(req->userperm_new.uid, req->userperm_new.gid,
-                                 req->userperm_new.groups, (gid_t *)data);
-    TRACE("ceph_userperm_new(%u, %u, %u) -> %p", req->userperm_new.uid,
-          req->userperm_new.gid, req->userperm_new.groups, userperm);
+    groups = req->userperm_new.groups;
+    if (data_size != groups * sizeof(gid_t)) {
+        return CEPH_COMPLETE(client, -EINVAL, ans);
+    }
+
+    userperm = userperm_get(req->userperm_new.uid, req->userperm_new.gid,
+                            groups, data);
 
     err = -ENOMEM;
     if (userperm != NULL) {
@@ -408,8 +1000,7 @@ libcephfsd_userperm_destroy(proxy_client_t *client, proxy_req_t *req,
                     (void **)&perms);
 
     if (err >= 0) {
-        ceph_userperm_destroy(perms);
-        TRACE("ceph_userperm_destroy(%p)", perms);
+        err = userperm_put(perms);
     }
 
     return CEPH_COMPLETE(client, err, ans);
@@ -430,6 +1021,7 @@ libcephfsd_create(proxy_client_t *client, proxy_req_t *req, const void *data,
     TRACE("ceph_create(%p, '%s') -> %d", mount, id, err);
 
     if (err >= 0) {
+        list_add_tail(&mount->list, &client->session->mounts);
         ans.cmount = ptr_checksum(&client->random, mount);
     }
 
@@ -446,8 +1038,14 @@ libcephfsd_release(proxy_client_t *client, proxy_req_t *req, const void *data,
 
     err = ptr_check(&client->random, req->release.cmount, (void **)&mount);
     if (err >= 0) {
+        list_del_init(&mount->list);
+
         err = proxy_mount_release(mount);
         TRACE("ceph_release(%p) -> %d", mount, err);
+
+        if (err < 0) {
+            list_add_tail(&mount->list, &client->session->mounts);
+        }
     }
 
     return CEPH_COMPLETE(client, err, ans);
@@ -635,6 +1233,7 @@ libcephfsd_ll_lookup(proxy_client_t *client, proxy_req_t *req, const void *data,
 {
     CEPH_DATA(ceph_ll_lookup, ans, 1);
     struct ceph_statx stx;
+    uint8_t stx_data[PROXY_STATX_SIZE];
     proxy_mount_t *mount;
     struct Inode *parent, *out;
     const char *name;
@@ -656,8 +1255,6 @@ libcephfsd_ll_lookup(proxy_client_t *client, proxy_req_t *req, const void *data,
         flags = req->ll_lookup.flags;
         name = CEPH_STR_GET(req->ll_lookup, name, data);
 
-        CEPH_BUFF_ADD(ans, &stx, sizeof(stx));
-
         // Forbid going outside of the root mount point
         if ((parent == mount->root) && (strcmp(name, "..") == 0)) {
             name = ".";
@@ -669,6 +1266,7 @@ libcephfsd_ll_lookup(proxy_client_t *client, proxy_req_t *req, const void *data,
               parent, name, out, want, flags, perms, err);
 
         if (err >= 0) {
+            CEPH_STATX_ADD(ans, stx_data, &stx);
             ans.inode = ptr_checksum(&client->random, out);
         }
     }
@@ -689,7 +1287,7 @@ libcephfsd_ll_lookup_inode(proxy_client_t *client, proxy_req_t *req,
     err = ptr_check(&client->random, req->ll_lookup_inode.cmount,
                     (void **)&mount);
     if (err >= 0) {
-        ino = req->ll_lookup_inode.ino;
+        ino.val = req->ll_lookup_inode.ino;
 
         err = ceph_ll_lookup_inode(proxy_cmount(mount), ino, &inode);
         TRACE("ceph_ll_lookup_inode(%p, %lu, %p) -> %d", mount, ino.val, inode,
@@ -750,12 +1348,54 @@ libcephfsd_ll_put(proxy_client_t *client, proxy_req_t *req, const void *data,
     return CEPH_COMPLETE(client, err, ans);
 }
 
+static int32_t
+libcephfsd_ll_puts(proxy_client_t *client, proxy_req_t *req, const void *data,
+                   int32_t data_size)
+{
+    CEPH_DATA(ceph_ll_puts, ans, 0);
+    proxy_put_entry_t entry;
+    const char *pos;
+    proxy_mount_t *mount;
+    struct Inode *inode;
+    uint32_t i, count;
+    int32_t err, res;
+
+    err = ptr_check(&client->random, req->ll_puts.cmount, (void **)&mount);
+    if (err < 0) {
+        goto done;
+    }
+
+    count = req->ll_puts.count;
+    if (data_size != count * sizeof(proxy_put_entry_t)) {
+        err = proxy_log(LOG_ERR, EINVAL, "Invalid inode release list");
+        goto done;
+    }
+
+    /* Process all entries even if some of them fail. The first error is
+     * returned. The request data is not aligned, so each entry is copied. */
+    for (pos = data; count > 0; pos += sizeof(entry), count--) {
+        memcpy(&entry, pos, sizeof(entry));
+        res = ptr_check(&client->random, entry.inode, (void **)&inode);
+        for (i = 0; (res >= 0) && (i < entry.count); i++) {
+            res = ceph_ll_put(proxy_cmount(mount), inode);
+            TRACE("ceph_ll_put(%p, %p) -> %d", mount, inode, res);
+        }
+        if ((res < 0) && (err >= 0)) {
+            err = res;
+        }
+    }
+
+done:
+    return CEPH_COMPLETE(client, err, ans);
+}
+
 static int32_t
 libcephfsd_ll_walk(proxy_client_t *client, proxy_req_t *req, const void *data,
                    int32_t data_size)
 {
     CEPH_DATA(ceph_ll_walk, ans, 1);
     struct ceph_statx stx;
+    uint8_t stx_data[PROXY_STATX_SIZE];
     proxy_mount_t *mount;
     struct Inode *inode;
     const char *path;
@@ -772,14 +1412,13 @@ libcephfsd_ll_walk(proxy_client_t *client, proxy_req_t *req, const void *data,
         flags = req->ll_walk.flags;
         path = CEPH_STR_GET(req->ll_walk, path, data);
 
-        CEPH_BUFF_ADD(ans, &stx, sizeof(stx));
-
         err = proxy_path_resolve(mount, path, &inode, &stx, want, flags, perms,
                                  NULL);
         TRACE("ceph_ll_walk(%p, '%s', %p, %x, %x, %p) -> %d", mount, path,
               inode, want, flags, perms, err);
 
         if (err >= 0) {
+            CEPH_STATX_ADD(ans, stx_data, &stx);
             ans.inode = ptr_checksum(&client->random, inode);
         }
     }
@@ -939,6 +1578,7 @@ libcephfsd_ll_create(proxy_client_t *client, proxy_req_t *req, const void *data,
 {
     CEPH_DATA(ceph_ll_create, ans, 1);
     struct ceph_statx stx;
+    uint8_t stx_data[PROXY_STATX_SIZE];
     proxy_mount_t *mount;
     struct Inode *parent, *inode;
     struct Fh *fh;
@@ -964,8 +1604,6 @@ libcephfsd_ll_create(proxy_client_t *client, proxy_req_t *req, const void *data,
         flags = req->ll_create.flags;
         name = CEPH_STR_GET(req->ll_create, name, data);
 
-        CEPH_BUFF_ADD(ans, &stx, sizeof(stx));
-
         err = ceph_ll_create(proxy_cmount(mount), parent, name, mode, oflags,
                              &inode, &fh, &stx, want, flags, perms);
         TRACE("ceph_ll_create(%p, %p, '%s', %o, %x, %p, %p, %x, %x, %p) -> %d",
@@ -973,6 +1611,7 @@ libcephfsd_ll_create(proxy_client_t *client, proxy_req_t *req, const void *data,
               err);
 
         if (err >= 0) {
+            CEPH_STATX_ADD(ans, stx_data, &stx);
             ans.fh = ptr_checksum(&client->random, fh);
             ans.inode = ptr_checksum(&client->random, inode);
         }
@@ -987,6 +1626,7 @@ libcephfsd_ll_mknod(proxy_client_t *client, proxy_req_t *req, const void *data,
 {
     CEPH_DATA(ceph_ll_mknod, ans, 1);
     struct ceph_statx stx;
+    uint8_t stx_data[PROXY_STATX_SIZE];
     proxy_mount_t *mount;
     struct Inode *parent, *inode;
     const char *name;
@@ -1012,14 +1652,13 @@ libcephfsd_ll_mknod(proxy_client_t *client, proxy_req_t *req, const void *data,
         flags = req->ll_mknod.flags;
         name = CEPH_STR_GET(req->ll_mknod, name, data);
 
-        CEPH_BUFF_ADD(ans, &stx, sizeof(stx));
-
         err = ceph_ll_mknod(proxy_cmount(mount), parent, name, mode, rdev,
                             &inode, &stx, want, flags, perms);
         TRACE("ceph_ll_mknod(%p, %p, '%s', %o, %lx, %p, %x, %x, %p) -> %d",
               mount, parent, name, mode, rdev, inode, want, flags, perms, err);
 
         if (err >= 0) {
+            CEPH_STATX_ADD(ans, stx_data, &stx);
             ans.inode = ptr_checksum(&client->random, inode);
         }
     }
@@ -1050,8 +1689,122 @@ libcephfsd_ll_close(proxy_client_t *client, proxy_req_t *req, const void *data,
 }
 
 static int32_t
-libcephfsd_ll_rename(proxy_client_t *client, proxy_req_t *req, const void *data,
-                     int32_t data_size)
+libcephfsd_ll_openat(proxy_client_t *client, proxy_req_t *req,
+                     const void *data, int32_t data_size)
+{
+    CEPH_DATA(ceph_ll_openat, ans, 1);
+    struct ceph_statx stx;
+    uint8_t stx_data[PROXY_STATX_SIZE];
+    proxy_mount_t *mount;
+    struct Inode *parent, *inode;
+    struct Fh *fh;
+    const char *name;
+    UserPerm *perms;
+    uint32_t want, flags;
+    int32_t oflags, err;
+
+    err = ptr_check(&client->random, req->ll_openat.cmount, (void **)&mount);
+    if (err >= 0) {
+        err = ptr_check(&client->random, req->ll_openat.parent,
+                        (void **)&parent);
+    }
+    if (err >= 0) {
+        err = ptr_check(&global_random, req->ll_openat.userperm,
+                        (void **)&perms);
+    }
+    if (err < 0) {
+        goto done;
+    }
+
+    oflags = req->ll_openat.oflags;
+    want = req->ll_openat.want;
+    flags = req->ll_openat.flags;
+    name = CEPH_STR_GET(req->ll_openat, name, data);
+
+    // Forbid going outside of the root mount point
+    if ((parent == mount->root) && (strcmp(name, "..") == 0)) {
+        name = ".";
+    }
+
+    err = ceph_ll_lookup(proxy_cmount(mount), parent, name, &inode, &stx, want,
+                         flags, perms);
+    TRACE("ceph_ll_lookup(%p, %p, '%s', %p, %x, %x, %p) -> %d", mount, parent,
+          name, inode, want, flags, perms, err);
+    if (err < 0) {
+        goto done;
+    }
+
+    err = ceph_ll_open(proxy_cmount(mount), inode, oflags, &fh, perms);
+    TRACE("ceph_ll_open(%p, %p, %x, %p, %p) -> %d", mount, inode, oflags, fh,
+          perms, err);
+    if (err < 0) {
+        goto failed;
+    }
+
+    /* Opening with O_TRUNC changes the attributes returned by the lookup. */
+    if ((oflags & O_TRUNC) != 0) {
+        err = ceph_ll_getattr(proxy_cmount(mount), inode, &stx, want, flags,
+                              perms);
+        TRACE("ceph_ll_getattr(%p, %p, %x, %x, %p) -> %d", mount, inode, want,
+              flags, perms, err);
+        if (err < 0) {
+            ceph_ll_close(proxy_cmount(mount), fh);
+            goto failed;
+        }
+    }
+
+    CEPH_STATX_ADD(ans, stx_data, &stx);
+    ans.inode = ptr_checksum(&client->random, inode);
+    ans.fh = ptr_checksum(&client->random, fh);
+
+    goto done;
+
+failed:
+    ceph_ll_put(proxy_cmount(mount), inode);
+
+done:
+    return CEPH_COMPLETE(client, err, ans);
+}
+
+static int32_t
+libcephfsd_ll_close_put(proxy_client_t *client, proxy_req_t *req,
+                        const void *data, int32_t data_size)
+{
+    CEPH_DATA(ceph_ll_close_put, ans, 0);
+    proxy_mount_t *mount;
+    struct Inode *inode;
+    struct Fh *fh;
+    int32_t err, res;
+
+    err = ptr_check(&client->random, req->ll_close_put.cmount,
+                    (void **)&mount);
+    if (err >= 0) {
+        err = ptr_check(&client->random, req->ll_close_put.fh, (void **)&fh);
+    }
+    if (err >= 0) {
+        err = ptr_check(&client->random, req->ll_close_put.inode,
+                        (void **)&inode);
+    }
+
+    if (err >= 0) {
+        err = ceph_ll_close(proxy_cmount(mount), fh);
+        TRACE("ceph_ll_close(%p, %p) -> %d", mount, fh, err);
+
+        /* The reference is released even if close fails, like it would
+         * happen with separate calls. */
+        res = ceph_ll_put(proxy_cmount(mount), inode);
+        TRACE("ceph_ll_put(%p, %p) -> %d", mount, inode, res);
+        if (err >= 0) {
+            err = res;
+        }
+    }
+
+    return CEPH_COMPLETE(client, err, ans);
+}
+
+static int32_t
+libcephfsd_ll_rename(proxy_client_t *client, proxy_req_t *req, const void *data,
+                     int32_t data_size)
 {
     CEPH_DATA(ceph_ll_rename, ans, 0);
     proxy_mount_t *mount;
@@ -1119,6 +1872,68 @@ libcephfsd_ll_lseek(proxy_client_t *client, proxy_req_t *req, const void *data,
     return CEPH_COMPLETE(client, err, ans);
 }
 
+/* Release the slot of the running request while it waits for the client to
+ * send or receive data. */
+static void
+client_sched_pause(proxy_client_t *client)
+{
+    if ((client->sched != NULL) && !client->sched_paused) {
+        proxy_sched_leave(client->sched, client->sched_class);
+        client->sched_paused = true;
+    }
+}
+
+/* Take back the slot released by client_sched_pause(). */
+static int32_t
+client_sched_resume(proxy_client_t *client)
+{
+    int32_t err;
+
+    if (!client->sched_paused) {
+        return 0;
+    }
+
+    err = proxy_sched_resume(client->sched, client->sched_class);
+    if (err < 0) {
+        return err;
+    }
+
+    client->sched_paused = false;
+
+    return 0;
+}
+
+/* Send a segment of a read as a part of the answer. */
+static int32_t
+send_part(proxy_client_t *client, void *buffer, uint32_t size)
+{
+    proxy_link_ans_t ans;
+    struct iovec iov[2];
+    int32_t err;
+
+    /* Nobody is waiting for the answer of a one-way request. */
+    if (client->oneway) {
+        return 0;
+    }
+
+    iov[0].iov_base = &ans;
+    iov[0].iov_len = sizeof(ans);
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = size;
+
+    client_sched_pause(client);
+
+    err = proxy_link_ans_send(client->sd, 0, PROXY_LINK_MORE, iov, 2);
+    if (err < 0) {
+        return err;
+    }
+
+    return client_sched_resume(client);
+}
+
+/* Reads bigger than the client buffer are done in segments of 'read_segment'
+ * bytes using a single buffer. Each segment is sent as soon as it has been
+ * read, so the client receives the data while the next one is being read. */
 static int32_t
 libcephfsd_ll_read(proxy_client_t *client, proxy_req_t *req, const void *data,
                    int32_t data_size)
@@ -1127,7 +1942,7 @@ libcephfsd_ll_read(proxy_client_t *client, proxy_req_t *req, const void *data,
     proxy_mount_t *mount;
     struct Fh *fh;
     void *buffer;
-    uint64_t len;
+    uint64_t len, done;
     int64_t offset;
     uint32_t size;
     int32_t err;
@@ -1138,30 +1953,73 @@ libcephfsd_ll_read(proxy_client_t *client, proxy_req_t *req, const void *data,
     if (err >= 0) {
         err = ptr_check(&client->random, req->ll_read.fh, (void **)&fh);
     }
-    if (err >= 0) {
-        offset = req->ll_read.offset;
-        len = req->ll_read.len;
+    if (err < 0) {
+        return CEPH_COMPLETE(client, err, ans);
+    }
 
-        size = client->buffer_size;
-        if (len > size) {
-            buffer = proxy_malloc(size);
-            if (buffer == NULL) {
-                err = -ENOMEM;
-            }
+    offset = req->ll_read.offset;
+    len = req->ll_read.len;
+
+    /* The result is an int, so it can't be bigger than 2 GiB. */
+    if (len > INT32_MAX) {
+        len = INT32_MAX;
+    }
+    size = client->buffer_size;
+    if (len > size) {
+        size = read_segment;
+        if (len < size) {
+            size = len;
         }
-        if (err >= 0) {
-            err = ceph_ll_read(proxy_cmount(mount), fh, offset, len, buffer);
-            TRACE("ceph_ll_read(%p, %p, %ld, %lu) -> %d", mount, fh, offset,
-                  len, err);
+        buffer = proxy_malloc(size);
+        if (buffer == NULL) {
+            return CEPH_COMPLETE(client, -ENOMEM, ans);
+        }
+    }
 
-            if (err >= 0) {
-                CEPH_BUFF_ADD(ans, buffer, err);
+    done = 0;
+    while (true) {
+        if (len - done < size) {
+            size = len - done;
+        }
+        err = ceph_ll_read(proxy_cmount(mount), fh, offset, size, buffer);
+        TRACE("ceph_ll_read(%p, %p, %ld, %u) -> %d", mount, fh, offset, size,
+              err);
+
+        if (err < 0) {
+            /* Return what has already been sent. The error will probably be
+             * returned again by the next read. */
+            if (done > 0) {
+                err = 0;
             }
+            break;
+        }
+        if ((err < size) || (done + err == len)) {
+            break;
+        }
+
+        err = send_part(client, buffer, err);
+        if (err < 0) {
+            goto done;
         }
+        done += size;
+
+        /* A negative offset means the current position of the file, which
+         * has already been advanced. */
+        if (offset >= 0) {
+            offset += size;
+        }
+    }
+
+    if (err >= 0) {
+        CEPH_BUFF_ADD(ans, buffer, err);
+        err += done;
     }
 
+    client_sched_pause(client);
+
     err = CEPH_COMPLETE(client, err, ans);
 
+done:
     if (buffer != client->buffer) {
         proxy_free(buffer);
     }
@@ -1169,6 +2027,95 @@ libcephfsd_ll_read(proxy_client_t *client, proxy_req_t *req, const void *data,
     return err;
 }
 
+/* Receive the data of a write that didn't fit in the request buffer and
+ * write it as it arrives, in segments of 'write_segment' bytes. All the data
+ * is received even if a write fails, to be able to continue with the next
+ * request. Returns the number of bytes written, or the error if nothing could
+ * be written. The error is returned in 'fatal' if the connection fails. */
+static int32_t
+write_segments(proxy_client_t *client, proxy_mount_t *mount, struct Fh *fh,
+               int64_t offset, uint32_t len, int32_t err, int32_t *fatal)
+{
+    void *buffer;
+    uint32_t size, done, written;
+    int32_t res;
+    bool stop;
+
+    size = write_segment;
+    if (len < size) {
+        size = len;
+    }
+
+    buffer = client->buffer;
+    if (size > client->buffer_size) {
+        buffer = proxy_malloc(size);
+        if (buffer == NULL) {
+            /* The data still needs to be received. */
+            buffer = client->buffer;
+            size = client->buffer_size;
+            if (err >= 0) {
+                err = -ENOMEM;
+            }
+        }
+    }
+
+    stop = err < 0;
+    written = 0;
+    for (done = 0; done < len; done += size) {
+        if (len - done < size) {
+            size = len - done;
+        }
+
+        client_sched_pause(client);
+
+        res = proxy_link_req_data(client->sd, &client->buffer_read, buffer,
+                                  size);
+        if (res < 0) {
+            *fatal = res;
+            break;
+        }
+
+        /* Nothing else is written after an error or a short write. */
+        if (stop) {
+            continue;
+        }
+
+        res = client_sched_resume(client);
+        if (res >= 0) {
+            res = ceph_ll_write(proxy_cmount(mount), fh, offset, size, buffer);
+            TRACE("ceph_ll_write(%p, %p, %ld, %u) -> %d", mount, fh, offset,
+                  size, res);
+        }
+
+        if (res < 0) {
+            err = res;
+            stop = true;
+            continue;
+        }
+        written += res;
+        if (res < size) {
+            stop = true;
+            continue;
+        }
+
+        /* A negative offset means the current position of the file, which
+         * has already been advanced. */
+        if (offset >= 0) {
+            offset += size;
+        }
+    }
+
+    if (buffer != client->buffer) {
+        proxy_free(buffer);
+    }
+
+    if ((written == 0) && (err < 0)) {
+        return err;
+    }
+
+    return written;
+}
+
 static int32_t
 libcephfsd_ll_write(proxy_client_t *client, proxy_req_t *req, const void *data,
                     int32_t data_size)
@@ -1178,16 +2125,31 @@ libcephfsd_ll_write(proxy_client_t *client, proxy_req_t *req, const void *data,
     struct Fh *fh;
     uint64_t len;
     int64_t offset;
-    int32_t err;
+    int32_t err, fatal;
 
     err = ptr_check(&client->random, req->ll_write.cmount, (void **)&mount);
     if (err >= 0) {
         err = ptr_check(&client->random, req->ll_write.fh, (void **)&fh);
     }
-    if (err >= 0) {
-        offset = req->ll_write.offset;
-        len = req->ll_write.len;
 
+    offset = req->ll_write.offset;
+    len = req->ll_write.len;
+
+    /* Big writes are received by segments. */
+    if ((data == NULL) && (data_size > 0)) {
+        if (len != data_size) {
+            err = -EINVAL;
+        }
+
+        fatal = 0;
+        err = write_segments(client, mount, fh, offset, data_size, err,
+                             &fatal);
+        if (fatal < 0) {
+            return fatal;
+        }
+    } else if ((err >= 0) && (len != data_size)) {
+        err = -EINVAL;
+    } else if ((err >= 0) && (len > 0)) {
         err = ceph_ll_write(proxy_cmount(mount), fh, offset, len, data);
         TRACE("ceph_ll_write(%p, %p, %ld, %lu) -> %d", mount, fh, offset, len,
               err);
@@ -1196,6 +2158,116 @@ libcephfsd_ll_write(proxy_client_t *client, proxy_req_t *req, const void *data,
     return CEPH_COMPLETE(client, err, ans);
 }
 
+/* libcephfs doesn't provide a low level copy_file_range(), so the data is
+ * copied with reads and writes of up to 'read_segment' bytes using a single
+ * buffer, without sending it to the client. Returns the number of bytes
+ * copied, or the error if nothing could be copied. */
+static int32_t
+libcephfsd_ll_copy_range(proxy_client_t *client, proxy_req_t *req,
+                         const void *data, int32_t data_size)
+{
+    CEPH_DATA(ceph_ll_copy_range, ans, 0);
+    proxy_mount_t *mount;
+    struct Fh *src, *dst;
+    void *buffer;
+    uint64_t len, done;
+    int64_t src_offset, dst_offset;
+    uint32_t size;
+    int32_t err, res;
+
+    err = ptr_check(&client->random, req->ll_copy_range.cmount,
+                    (void **)&mount);
+    if (err >= 0) {
+        err = ptr_check(&client->random, req->ll_copy_range.src,
+                        (void **)&src);
+    }
+    if (err >= 0) {
+        err = ptr_check(&client->random, req->ll_copy_range.dst,
+                        (void **)&dst);
+    }
+    if (err < 0) {
+        return CEPH_COMPLETE(client, err, ans);
+    }
+
+    src_offset = req->ll_copy_range.src_offset;
+    dst_offset = req->ll_copy_range.dst_offset;
+    len = req->ll_copy_range.len;
+
+    /* The result is an int, so it can't be bigger than 2 GiB. */
+    if (len > INT32_MAX) {
+        len = INT32_MAX;
+    }
+
+    /* Like copy_file_range(2), overlapping ranges of the same file handle are
+     * not allowed. Using the current position for both sides of the same
+     * handle doesn't make sense either. */
+    if ((src == dst) &&
+        ((src_offset < 0) || (dst_offset < 0) ||
+         ((src_offset < dst_offset + (int64_t)len) &&
+          (dst_offset < src_offset + (int64_t)len)))) {
+        return CEPH_COMPLETE(client, -EINVAL, ans);
+    }
+
+    size = read_segment;
+    if (len < size) {
+        size = len;
+    }
+    buffer = client->buffer;
+    if (size > client->buffer_size) {
+        buffer = proxy_malloc(size);
+        if (buffer == NULL) {
+            return CEPH_COMPLETE(client, -ENOMEM, ans);
+        }
+    }
+
+    done = 0;
+    while (done < len) {
+        if (len - done < size) {
+            size = len - done;
+        }
+
+        res = ceph_ll_read(proxy_cmount(mount), src, src_offset, size, buffer);
+        TRACE("ceph_ll_read(%p, %p, %ld, %u) -> %d", mount, src, src_offset,
+              size, res);
+        if (res <= 0) {
+            err = res;
+            break;
+        }
+
+        err = ceph_ll_write(proxy_cmount(mount), dst, dst_offset, res, buffer);
+        TRACE("ceph_ll_write(%p, %p, %ld, %d) -> %d", mount, dst, dst_offset,
+              res, err);
+        if (err < 0) {
+            break;
+        }
+        done += err;
+
+        /* Stop at the end of the source file or after a short write. */
+        if ((res < size) || (err < res)) {
+            break;
+        }
+
+        /* A negative offset means the current position of the file, which
+         * has already been advanced. */
+        if (src_offset >= 0) {
+            src_offset += size;
+        }
+        if (dst_offset >= 0) {
+            dst_offset += size;
+        }
+    }
+
+    if (buffer != client->buffer) {
+        proxy_free(buffer);
+    }
+
+    if ((done > 0) || (err >= 0)) {
+        err = done;
+    }
+
+    return CEPH_COMPLETE(client, err, ans);
+}
+
 static int32_t
 libcephfsd_ll_link(proxy_client_t *client, proxy_req_t *req, const void *data,
                    int32_t data_size)
@@ -1265,6 +2337,7 @@ libcephfsd_ll_getattr(proxy_client_t *client, proxy_req_t *req,
 {
     CEPH_DATA(ceph_ll_getattr, ans, 1);
     struct ceph_statx stx;
+    uint8_t stx_data[PROXY_STATX_SIZE];
     proxy_mount_t *mount;
     struct Inode *inode;
     UserPerm *perms;
@@ -1284,12 +2357,14 @@ libcephfsd_ll_getattr(proxy_client_t *client, proxy_req_t *req,
         want = req->ll_getattr.want;
         flags = req->ll_getattr.flags;
 
-        CEPH_BUFF_ADD(ans, &stx, sizeof(stx));
-
         err = ceph_ll_getattr(proxy_cmount(mount), inode, &stx, want, flags,
                               perms);
         TRACE("ceph_ll_getattr(%p, %p, %x, %x, %p) -> %d", mount, inode, want,
               flags, perms, err);
+
+        if (err >= 0) {
+            CEPH_STATX_ADD(ans, stx_data, &stx);
+        }
     }
 
     return CEPH_COMPLETE(client, err, ans);
@@ -1376,6 +2451,32 @@ libcephfsd_ll_fsync(proxy_client_t *client, proxy_req_t *req, const void *data,
     return CEPH_COMPLETE(client, err, ans);
 }
 
+/* Size of the buffer needed to answer an xattr request. Size probes use the
+ * maximum size that the client is willing to fetch. */
+static size_t
+xattr_limit(size_t size, uint32_t fetch)
+{
+    if (size == 0) {
+        size = fetch;
+    }
+    if (size > PROXY_XATTR_MAX) {
+        size = PROXY_XATTR_MAX;
+    }
+
+    return size;
+}
+
+/* Values that don't fit in the client buffer use a temporary one. */
+static void *
+xattr_buffer(proxy_client_t *client, size_t size)
+{
+    if (size <= client->buffer_size) {
+        return client->buffer;
+    }
+
+    return proxy_malloc(size);
+}
+
 static int32_t
 libcephfsd_ll_listxattr(proxy_client_t *client, proxy_req_t *req,
                         const void *data, int32_t data_size)
@@ -1384,9 +2485,12 @@ libcephfsd_ll_listxattr(proxy_client_t *client, proxy_req_t *req,
     proxy_mount_t *mount;
     struct Inode *inode;
     UserPerm *perms;
-    size_t size;
+    void *buffer;
+    size_t size, limit;
     int32_t err;
 
+    buffer = client->buffer;
+
     err = ptr_check(&client->random, req->ll_listxattr.cmount,
                     (void **)&mount);
     if (err >= 0) {
@@ -1398,22 +2502,43 @@ libcephfsd_ll_listxattr(proxy_client_t *client, proxy_req_t *req,
                         (void **)&perms);
     }
     if (err >= 0) {
-        size = req->ll_listxattr.size;
-        if (size > client->buffer_size) {
-            size = client->buffer_size;
+        limit = xattr_limit(req->ll_listxattr.size, req->ll_listxattr.fetch);
+        buffer = xattr_buffer(client, limit);
+        if (buffer == NULL) {
+            err = -ENOMEM;
+            goto done;
         }
-        err = ceph_ll_listxattr(proxy_cmount(mount), inode, client->buffer,
-                                size, &size, perms);
+
+        err = ceph_ll_listxattr(proxy_cmount(mount), inode, buffer, limit,
+                                &size, perms);
         TRACE("ceph_ll_listxattr(%p, %p, %lu, %p) -> %d", mount, inode, size,
               perms, err);
 
+        if ((err == -ERANGE) && (req->ll_listxattr.size == 0)) {
+            /* The list is too big to be fetched. Only return its size. */
+            limit = 0;
+            err = ceph_ll_listxattr(proxy_cmount(mount), inode, NULL, 0,
+                                    &size, perms);
+            TRACE("ceph_ll_listxattr(%p, %p, %lu, %p) -> %d", mount, inode,
+                  size, perms, err);
+        }
+
         if (err >= 0) {
             ans.size = size;
-            CEPH_BUFF_ADD(ans, client->buffer, size);
+            if (limit > 0) {
+                CEPH_BUFF_ADD(ans, buffer, size);
+            }
         }
     }
 
-    return CEPH_COMPLETE(client, err, ans);
+done:
+    err = CEPH_COMPLETE(client, err, ans);
+
+    if (buffer != client->buffer) {
+        proxy_free(buffer);
+    }
+
+    return err;
 }
 
 static int32_t
@@ -1425,9 +2550,12 @@ libcephfsd_ll_getxattr(proxy_client_t *client, proxy_req_t *req,
     struct Inode *inode;
     const char *name;
     UserPerm *perms;
-    size_t size;
+    void *buffer;
+    size_t limit;
     int32_t err;
 
+    buffer = client->buffer;
+
     err = ptr_check(&client->random, req->ll_getxattr.cmount, (void **)&mount);
     if (err >= 0) {
         err = ptr_check(&client->random, req->ll_getxattr.inode,
@@ -1438,22 +2566,154 @@ libcephfsd_ll_getxattr(proxy_client_t *client, proxy_req_t *req,
                         (void **)&perms);
     }
     if (err >= 0) {
-        size = req->ll_getxattr.size;
         name = CEPH_STR_GET(req->ll_getxattr, name, data);
 
-        if (size > client->buffer_size) {
-            size = client->buffer_size;
+        limit = xattr_limit(req->ll_getxattr.size, req->ll_getxattr.fetch);
+        buffer = xattr_buffer(client, limit);
+        if (buffer == NULL) {
+            err = -ENOMEM;
+            goto done;
         }
-        err = ceph_ll_getxattr(proxy_cmount(mount), inode, name, client->buffer,
-                                size, perms);
+
+        err = ceph_ll_getxattr(proxy_cmount(mount), inode, name, buffer, limit,
+                               perms);
         TRACE("ceph_ll_getxattr(%p, %p, '%s', %p) -> %d", mount, inode, name,
               perms, err);
 
-        if (err >= 0) {
-            CEPH_BUFF_ADD(ans, client->buffer, err);
+        if ((err == -ERANGE) && (req->ll_getxattr.size == 0)) {
+            /* The value is too big to be fetched. Only return its size. */
+            limit = 0;
+            err = ceph_ll_getxattr(proxy_cmount(mount), inode, name, NULL, 0,
+                                   perms);
+            TRACE("ceph_ll_getxattr(%p, %p, '%s', %p) -> %d", mount, inode,
+                  name, perms, err);
+        }
+
+        if ((err >= 0) && (limit > 0)) {
+            CEPH_BUFF_ADD(ans, buffer, err);
         }
     }
 
+done:
+    err = CEPH_COMPLETE(client, err, ans);
+
+    if (buffer != client->buffer) {
+        proxy_free(buffer);
+    }
+
+    return err;
+}
+
+/* Append the value of an xattr to the answer buffer. The entry is copied
+ * because its position in the buffer is not aligned. */
+static int32_t
+getxattrs_add(proxy_client_t *client, proxy_mount_t *mount,
+              struct Inode *inode, UserPerm *perms, const char *name,
+              uint32_t *pos)
+{
+    proxy_xattr_entry_t entry;
+    uint32_t len, size;
+    int32_t err;
+
+    len = strlen(name) + 1;
+    size = *pos + sizeof(entry) + len;
+    if (size > client->buffer_size) {
+        return -ERANGE;
+    }
+
+    memcpy(client->buffer + *pos + sizeof(entry), name, len);
+
+    /* A size of 0 would return the length of the value without reading it. */
+    err = -ERANGE;
+    if (size < client->buffer_size) {
+        err = ceph_ll_getxattr(proxy_cmount(mount), inode, name,
+                               client->buffer + size,
+                               client->buffer_size - size, perms);
+        TRACE("ceph_ll_getxattr(%p, %p, '%s', %p) -> %d", mount, inode, name,
+              perms, err);
+    }
+
+    entry.name_len = len;
+    entry.reserved = 0;
+    entry.size = err;
+    memcpy(client->buffer + *pos, &entry, sizeof(entry));
+
+    if (err > 0) {
+        size += err;
+    }
+    *pos = size;
+
+    return 0;
+}
+
+static int32_t
+libcephfsd_ll_getxattrs(proxy_client_t *client, proxy_req_t *req,
+                        const void *data, int32_t data_size)
+{
+    CEPH_DATA(ceph_ll_getxattrs, ans, 1);
+    proxy_mount_t *mount;
+    struct Inode *inode;
+    const char *names;
+    char *list;
+    UserPerm *perms;
+    size_t size;
+    uint32_t pos, len;
+    int32_t err;
+
+    list = NULL;
+
+    err = ptr_check(&client->random, req->ll_getxattrs.cmount,
+                    (void **)&mount);
+    if (err >= 0) {
+        err = ptr_check(&client->random, req->ll_getxattrs.inode,
+                        (void **)&inode);
+    }
+    if (err >= 0) {
+        err = ptr_check(&global_random, req->ll_getxattrs.userperm,
+                        (void **)&perms);
+    }
+    if (err >= 0) {
+        names = data;
+        size = req->ll_getxattrs.names;
+        if (size == 0) {
+            list = proxy_malloc(client->buffer_size);
+            if (list == NULL) {
+                err = -ENOMEM;
+                goto done;
+            }
+            err = ceph_ll_listxattr(proxy_cmount(mount), inode, list,
+                                    client->buffer_size, &size, perms);
+            TRACE("ceph_ll_listxattr(%p, %p, %lu, %p) -> %d", mount, inode,
+                  size, perms, err);
+            if (err < 0) {
+                goto done;
+            }
+            names = list;
+        } else if ((size > data_size) || (names[size - 1] != 0)) {
+            err = -EINVAL;
+            goto done;
+        }
+
+        ans.count = 0;
+        pos = 0;
+        while (size > 0) {
+            err = getxattrs_add(client, mount, inode, perms, names, &pos);
+            if (err < 0) {
+                goto done;
+            }
+            ans.count++;
+
+            len = strlen(names) + 1;
+            names += len;
+            size -= len;
+        }
+
+        CEPH_BUFF_ADD(ans, client->buffer, pos);
+    }
+
+done:
+    proxy_free(list);
+
     return CEPH_COMPLETE(client, err, ans);
 }
 
@@ -1566,6 +2826,7 @@ libcephfsd_ll_symlink(proxy_client_t *client, proxy_req_t *req,
 {
     CEPH_DATA(ceph_ll_symlink, ans, 1);
     struct ceph_statx stx;
+    uint8_t stx_data[PROXY_STATX_SIZE];
     proxy_mount_t *mount;
     struct Inode *parent, *inode;
     UserPerm *perms;
@@ -1588,14 +2849,13 @@ libcephfsd_ll_symlink(proxy_client_t *client, proxy_req_t *req,
         want = req->ll_symlink.want;
         flags = req->ll_symlink.flags;
 
-        CEPH_BUFF_ADD(ans, &stx, sizeof(stx));
-
         err = ceph_ll_symlink(proxy_cmount(mount), parent, name, value, &inode,
                               &stx, want, flags, perms);
         TRACE("ceph_ll_symlink(%p, %p, '%s', '%s', %p, %x, %x, %p) -> %d",
               mount, parent, name, value, inode, want, flags, perms, err);
 
         if (err >= 0) {
+            CEPH_STATX_ADD(ans, stx_data, &stx);
             ans.inode = ptr_checksum(&client->random, inode);
         }
     }
@@ -1643,6 +2903,7 @@ libcephfsd_ll_mkdir(proxy_client_t *client, proxy_req_t *req, const void *data,
 {
     CEPH_DATA(ceph_ll_mkdir, ans, 1);
     struct ceph_statx stx;
+    uint8_t stx_data[PROXY_STATX_SIZE];
     proxy_mount_t *mount;
     struct Inode *parent, *inode;
     const char *name;
@@ -1666,14 +2927,13 @@ libcephfsd_ll_mkdir(proxy_client_t *client, proxy_req_t *req, const void *data,
         flags = req->ll_mkdir.flags;
         name = CEPH_STR_GET(req->ll_mkdir, name, data);
 
-        CEPH_BUFF_ADD(ans, &stx, sizeof(stx));
-
         err = ceph_ll_mkdir(proxy_cmount(mount), parent, name, mode, &inode,
                             &stx, want, flags, perms);
         TRACE("ceph_ll_mkdir(%p, %p, '%s', %o, %p, %x, %x, %p) -> %d", mount,
               parent, name, mode, inode, want, flags, perms, err);
 
         if (err >= 0) {
+            CEPH_STATX_ADD(ans, stx_data, &stx);
             ans.inode = ptr_checksum(&client->random, inode);
         }
     }
@@ -1736,57 +2996,273 @@ libcephfsd_ll_releasedir(proxy_client_t *client, proxy_req_t *req,
     return CEPH_COMPLETE(client, err, ans);
 }
 
+#define LIBCEPHFSD_HANDLER(_op, _type, _member) \
+    [LIBCEPHFSD_OP_##_op] = libcephfsd_##_member,
+
 static proxy_handler_t libcephfsd_handlers[LIBCEPHFSD_OP_TOTAL_OPS] = {
-    [LIBCEPHFSD_OP_VERSION] = libcephfsd_version,
-    [LIBCEPHFSD_OP_USERPERM_NEW] = libcephfsd_userperm_new,
-    [LIBCEPHFSD_OP_USERPERM_DESTROY] = libcephfsd_userperm_destroy,
-    [LIBCEPHFSD_OP_CREATE] = libcephfsd_create,
-    [LIBCEPHFSD_OP_RELEASE] = libcephfsd_release,
-    [LIBCEPHFSD_OP_CONF_READ_FILE] = libcephfsd_conf_read_file,
-    [LIBCEPHFSD_OP_CONF_GET] = libcephfsd_conf_get,
-    [LIBCEPHFSD_OP_CONF_SET] = libcephfsd_conf_set,
-    [LIBCEPHFSD_OP_INIT] = libcephfsd_init,
-    [LIBCEPHFSD_OP_SELECT_FILESYSTEM] = libcephfsd_select_filesystem,
-    [LIBCEPHFSD_OP_MOUNT] = libcephfsd_mount,
-    [LIBCEPHFSD_OP_UNMOUNT] = libcephfsd_unmount,
-    [LIBCEPHFSD_OP_LL_STATFS] = libcephfsd_ll_statfs,
-    [LIBCEPHFSD_OP_LL_LOOKUP] = libcephfsd_ll_lookup,
-    [LIBCEPHFSD_OP_LL_LOOKUP_INODE] = libcephfsd_ll_lookup_inode,
-    [LIBCEPHFSD_OP_LL_LOOKUP_ROOT] = libcephfsd_ll_lookup_root,
-    [LIBCEPHFSD_OP_LL_PUT] = libcephfsd_ll_put,
-    [LIBCEPHFSD_OP_LL_WALK] = libcephfsd_ll_walk,
-    [LIBCEPHFSD_OP_CHDIR] = libcephfsd_chdir,
-    [LIBCEPHFSD_OP_GETCWD] = libcephfsd_getcwd,
-    [LIBCEPHFSD_OP_READDIR] = libcephfsd_readdir,
-    [LIBCEPHFSD_OP_REWINDDIR] = libcephfsd_rewinddir,
-    [LIBCEPHFSD_OP_LL_OPEN] = libcephfsd_ll_open,
-    [LIBCEPHFSD_OP_LL_CREATE] = libcephfsd_ll_create,
-    [LIBCEPHFSD_OP_LL_MKNOD] = libcephfsd_ll_mknod,
-    [LIBCEPHFSD_OP_LL_CLOSE] = libcephfsd_ll_close,
-    [LIBCEPHFSD_OP_LL_RENAME] = libcephfsd_ll_rename,
-    [LIBCEPHFSD_OP_LL_LSEEK] = libcephfsd_ll_lseek,
-    [LIBCEPHFSD_OP_LL_READ] = libcephfsd_ll_read,
-    [LIBCEPHFSD_OP_LL_WRITE] = libcephfsd_ll_write,
-    [LIBCEPHFSD_OP_LL_LINK] = libcephfsd_ll_link,
-    [LIBCEPHFSD_OP_LL_UNLINK] = libcephfsd_ll_unlink,
-    [LIBCEPHFSD_OP_LL_GETATTR] = libcephfsd_ll_getattr,
-    [LIBCEPHFSD_OP_LL_SETATTR] = libcephfsd_ll_setattr,
-    [LIBCEPHFSD_OP_LL_FALLOCATE] = libcephfsd_ll_fallocate,
-    [LIBCEPHFSD_OP_LL_FSYNC] = libcephfsd_ll_fsync,
-    [LIBCEPHFSD_OP_LL_LISTXATTR] = libcephfsd_ll_listxattr,
-    [LIBCEPHFSD_OP_LL_GETXATTR] = libcephfsd_ll_getxattr,
-    [LIBCEPHFSD_OP_LL_SETXATTR] = libcephfsd_ll_setxattr,
-    [LIBCEPHFSD_OP_LL_REMOVEXATTR] = libcephfsd_ll_removexattr,
-    [LIBCEPHFSD_OP_LL_READLINK] = libcephfsd_ll_readlink,
-    [LIBCEPHFSD_OP_LL_SYMLINK] = libcephfsd_ll_symlink,
-    [LIBCEPHFSD_OP_LL_OPENDIR] = libcephfsd_ll_opendir,
-    [LIBCEPHFSD_OP_LL_MKDIR] = libcephfsd_ll_mkdir,
-    [LIBCEPHFSD_OP_LL_RMDIR] = libcephfsd_ll_rmdir,
-    [LIBCEPHFSD_OP_LL_RELEASEDIR] = libcephfsd_ll_releasedir,
+    LIBCEPHFSD_OPS(LIBCEPHFSD_HANDLER)
 };
 
+/* Scheduling class of each operation. Operations that don't use a mounted
+ * instance, or that don't call libcephfs, are not scheduled. Neither are the
+ * ones that release handles (like ceph_ll_put()), since rejecting them would
+ * leak the handles: the client has no way to retry them. */
+static const uint8_t libcephfsd_classes[LIBCEPHFSD_OP_TOTAL_OPS] = {
+    [LIBCEPHFSD_OP_LL_STATFS] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_LOOKUP] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_LOOKUP_INODE] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_LOOKUP_ROOT] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_WALK] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_CHDIR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_READDIR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_OPEN] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_CREATE] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_MKNOD] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_RENAME] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_LSEEK] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_READ] = PROXY_SCHED_DATA,
+    [LIBCEPHFSD_OP_LL_WRITE] = PROXY_SCHED_DATA,
+    [LIBCEPHFSD_OP_LL_LINK] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_UNLINK] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_GETATTR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_SETATTR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_FALLOCATE] = PROXY_SCHED_DATA,
+    [LIBCEPHFSD_OP_LL_FSYNC] = PROXY_SCHED_DATA,
+    [LIBCEPHFSD_OP_LL_LISTXATTR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_GETXATTR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_SETXATTR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_REMOVEXATTR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_READLINK] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_SYMLINK] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_OPENDIR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_MKDIR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_RMDIR] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_GETXATTRS] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_OPENAT] = PROXY_SCHED_META,
+    [LIBCEPHFSD_OP_LL_COPY_RANGE] = PROXY_SCHED_DATA
+};
+
+#define USERPERM_FIELD(_member) offsetof(proxy_req_t, _member.userperm)
+
+/* Position of the UserPerm in the scheduled requests that have one. Requests
+ * from processes running as root are charged to its user. */
+static const uint16_t libcephfsd_userperms[LIBCEPHFSD_OP_TOTAL_OPS] = {
+    [LIBCEPHFSD_OP_LL_LOOKUP] = USERPERM_FIELD(ll_lookup),
+    [LIBCEPHFSD_OP_LL_WALK] = USERPERM_FIELD(ll_walk),
+    [LIBCEPHFSD_OP_LL_OPEN] = USERPERM_FIELD(ll_open),
+    [LIBCEPHFSD_OP_LL_CREATE] = USERPERM_FIELD(ll_create),
+    [LIBCEPHFSD_OP_LL_MKNOD] = USERPERM_FIELD(ll_mknod),
+    [LIBCEPHFSD_OP_LL_RENAME] = USERPERM_FIELD(ll_rename),
+    [LIBCEPHFSD_OP_LL_LINK] = USERPERM_FIELD(ll_link),
+    [LIBCEPHFSD_OP_LL_UNLINK] = USERPERM_FIELD(ll_unlink),
+    [LIBCEPHFSD_OP_LL_GETATTR] = USERPERM_FIELD(ll_getattr),
+    [LIBCEPHFSD_OP_LL_SETATTR] = USERPERM_FIELD(ll_setattr),
+    [LIBCEPHFSD_OP_LL_LISTXATTR] = USERPERM_FIELD(ll_listxattr),
+    [LIBCEPHFSD_OP_LL_GETXATTR] = USERPERM_FIELD(ll_getxattr),
+    [LIBCEPHFSD_OP_LL_SETXATTR] = USERPERM_FIELD(ll_setxattr),
+    [LIBCEPHFSD_OP_LL_REMOVEXATTR] = USERPERM_FIELD(ll_removexattr),
+    [LIBCEPHFSD_OP_LL_READLINK] = USERPERM_FIELD(ll_readlink),
+    [LIBCEPHFSD_OP_LL_SYMLINK] = USERPERM_FIELD(ll_symlink),
+    [LIBCEPHFSD_OP_LL_OPENDIR] = USERPERM_FIELD(ll_opendir),
+    [LIBCEPHFSD_OP_LL_MKDIR] = USERPERM_FIELD(ll_mkdir),
+    [LIBCEPHFSD_OP_LL_RMDIR] = USERPERM_FIELD(ll_rmdir),
+    [LIBCEPHFSD_OP_LL_GETXATTRS] = USERPERM_FIELD(ll_getxattrs),
+    [LIBCEPHFSD_OP_LL_OPENAT] = USERPERM_FIELD(ll_openat)
+};
+
+/* Amount of data transferred by a request, used to compute its cost. */
+static uint64_t
+request_size(proxy_req_t *req)
+{
+    switch (req->header.op) {
+    case LIBCEPHFSD_OP_LL_READ:
+        return req->ll_read.len;
+    case LIBCEPHFSD_OP_LL_WRITE:
+        return req->header.data_len;
+    case LIBCEPHFSD_OP_LL_COPY_RANGE:
+        return req->ll_copy_range.len;
+    }
+
+    return 0;
+}
+
+/* Charge the request to the user of its UserPerm if the connection is shared
+ * by many users. */
+static int32_t
+client_sched_user(proxy_client_t *client, proxy_req_t *req)
+{
+    UserPerm *perms;
+    uint64_t userperm, generation;
+    uint32_t offset;
+
+    offset = libcephfsd_userperms[req->header.op];
+    if (!client->flow.shared || (offset == 0)) {
+        return 0;
+    }
+
+    memcpy(&userperm, (char *)req + offset, sizeof(userperm));
+    generation = __atomic_load_n(&userperm_generation, __ATOMIC_ACQUIRE);
+    if ((userperm != client->perms_handle) ||
+        (generation != client->perms_generation)) {
+        /* Invalid UserPerms are reported by the handler. */
+        if ((ptr_check(&global_random, userperm, (void **)&perms) < 0) ||
+            (userperm_uid(perms, &client->perms_uid) < 0)) {
+            return 0;
+        }
+        client->perms_handle = userperm;
+        client->perms_generation = generation;
+    }
+
+    return proxy_flow_user(&client->flow, client->perms_uid);
+}
+
+/* Wait until the request can run on the instance of its mount. If it's queued,
+ * the scheduler is kept in 'client->sched' and must be left once the request
+ * completes. Requests whose deadline has expired, or that have been cancelled,
+ * fail without being executed. */
+static int32_t
+client_sched_enter(proxy_client_t *client, proxy_req_t *req, int32_t class)
+{
+    proxy_mount_t *mount;
+    uint64_t size;
+    int32_t err;
+
+    proxy_flow_start(&client->flow, client->seq, req->header.timeout);
+
+    /* Without slots nor rate limits there's nothing to account. */
+    if (!proxy_sched_active()) {
+        return proxy_flow_check(&client->flow);
+    }
+
+    size = request_size(req);
+
+    err = client_sched_user(client, req);
+    if (err < 0) {
+        return err;
+    }
+
+    err = proxy_flow_throttle(&client->flow, class, size);
+    if (err < 0) {
+        return err;
+    }
+
+    /* Invalid mounts are reported by the handler. */
+    if ((proxy_sched_slots_get(class) > 0) &&
+        (ptr_check(&client->random, ((proxy_cmount_req_t *)req)->cmount,
+                   (void **)&mount) >= 0) &&
+        (mount != NULL)) {
+        err = proxy_sched_enter(&mount->instance->sched, &client->flow, class,
+                                size);
+        if (err < 0) {
+            return err;
+        }
+        if (err > 0) {
+            client->sched = &mount->instance->sched;
+            client->sched_class = class;
+        }
+    }
+
+    return proxy_flow_check(&client->flow);
+}
+
+/* Leave the scheduler once the request completes. */
+static void
+client_sched_leave(proxy_client_t *client)
+{
+    if ((client->sched != NULL) && !client->sched_paused) {
+        proxy_sched_leave(client->sched, client->sched_class);
+    }
+
+    client->sched = NULL;
+    client->sched_paused = false;
+}
+
+/* Answer a request that has not been admitted. The data of big writes must
+ * still be received to keep the connection usable. */
+static int32_t
+client_reject(proxy_client_t *client, proxy_req_t *req, const void *data,
+              int32_t error)
+{
+    int32_t fatal;
+
+    if ((data == NULL) && (req->header.data_len > 0)) {
+        fatal = 0;
+        write_segments(client, NULL, NULL, 0, req->header.data_len, error,
+                       &fatal);
+        if (fatal < 0) {
+            return fatal;
+        }
+    }
+
+    return send_error(client, error);
+}
+
+/* Extract the next space separated word from 'args'. */
+static char *
+client_arg(char **args)
+{
+    char *arg, *ptr;
+
+    arg = *args;
+    while (isspace(*arg)) {
+        arg++;
+    }
+    if (*arg == 0) {
+        return NULL;
+    }
+
+    ptr = arg;
+    while ((*ptr != 0) && !isspace(*ptr)) {
+        ptr++;
+    }
+    if (*ptr != 0) {
+        *ptr++ = 0;
+    }
+    *args = ptr;
+
+    return arg;
+}
+
+static int32_t
+client_arg_u32(char **args, uint32_t *value)
+{
+    char *arg, *end;
+    unsigned long num;
+
+    arg = client_arg(args);
+    if (arg == NULL) {
+        return proxy_log(LOG_ERR, EINVAL, "Missing argument");
+    }
+
+    errno = 0;
+    num = strtoul(arg, &end, 10);
+    if ((errno != 0) || (*end != 0) || (num > UINT32_MAX)) {
+        return proxy_log(LOG_ERR, EINVAL, "Invalid number");
+    }
+    *value = num;
+
+    return 0;
+}
+
+static int32_t
+client_arg_class(char **args, int32_t *class)
+{
+    char *arg;
+
+    *class = PROXY_SCHED_NONE;
+
+    arg = client_arg(args);
+    if (arg == NULL) {
+        return proxy_log(LOG_ERR, EINVAL, "Missing request class");
+    }
+
+    *class = proxy_sched_class(arg);
+
+    return *class;
+}
+
 static void
-client_cmd_version(proxy_client_t *client)
+client_cmd_version(proxy_client_t *client, char *args)
 {
     const char *text;
     int32_t major, minor, patch;
@@ -1797,8 +3273,95 @@ client_cmd_version(proxy_client_t *client)
                  patch, text);
 }
 
+static void
+client_qos_show(proxy_client_t *client)
+{
+    proxy_sched_info_t info;
+    uint32_t i, max, timeout;
+
+    client_write(client, "slots meta %u data %u\n",
+                 proxy_sched_slots_get(PROXY_SCHED_META),
+                 proxy_sched_slots_get(PROXY_SCHED_DATA));
+
+    proxy_sched_queue_get(&max, &timeout);
+    client_write(client, "queue max %u timeout %u\n", max, timeout);
+
+    for (i = 0; proxy_sched_user_get(i, &info) >= 0; i++) {
+        client_write(client, "uid %u weight %u meta %u/%u data %u/%u\n",
+                     info.uid, info.weight, info.rate[PROXY_SCHED_META],
+                     info.burst[PROXY_SCHED_META], info.rate[PROXY_SCHED_DATA],
+                     info.burst[PROXY_SCHED_DATA]);
+    }
+}
+
+/* qos
+ * qos slots <class> <count>
+ * qos queue <max> <timeout>
+ * qos weight <uid> <weight>
+ * qos limit <uid> <class> <rate> <burst>
+ *
+ * Without arguments, shows the current configuration. Otherwise, changes it
+ * and shows the result. */
+static void
+client_cmd_qos(proxy_client_t *client, char *args)
+{
+    const char *cmd;
+    uint32_t uid, value, burst, timeout;
+    int32_t class, err;
+
+    cmd = client_arg(&args);
+    if (cmd == NULL) {
+        err = 0;
+    } else if (strcmp(cmd, "slots") == 0) {
+        err = client_arg_class(&args, &class);
+        if (err >= 0) {
+            err = client_arg_u32(&args, &value);
+        }
+        if (err >= 0) {
+            err = proxy_sched_slots_set(class, value);
+        }
+    } else if (strcmp(cmd, "queue") == 0) {
+        err = client_arg_u32(&args, &value);
+        if (err >= 0) {
+            err = client_arg_u32(&args, &timeout);
+        }
+        if (err >= 0) {
+            err = proxy_sched_queue_set(value, timeout);
+        }
+    } else if (strcmp(cmd, "weight") == 0) {
+        err = client_arg_u32(&args, &uid);
+        if (err >= 0) {
+            err = client_arg_u32(&args, &value);
+        }
+        if (err >= 0) {
+            err = proxy_sched_weight(uid, value);
+        }
+    } else if (strcmp(cmd, "limit") == 0) {
+        err = client_arg_u32(&args, &uid);
+        if (err >= 0) {
+            err = client_arg_class(&args, &class);
+        }
+        if (err >= 0) {
+            err = client_arg_u32(&args, &value);
+        }
+        if (err >= 0) {
+            err = client_arg_u32(&args, &burst);
+        }
+        if (err >= 0) {
+            err = proxy_sched_limit(uid, class, value, burst);
+        }
+    } else {
+        err = proxy_log(LOG_ERR, EINVAL, "Unknown qos command");
+    }
+
+    if (err >= 0) {
+        client_qos_show(client);
+    }
+}
+
 static client_command_t client_commands[] = {
     { "version", client_cmd_version },
+    { "qos", client_cmd_qos },
     { NULL, NULL }
 };
 
@@ -1806,7 +3369,7 @@ static void
 serve_text(proxy_client_t *client)
 {
     client_command_t *cmd;
-    char *line;
+    char *line, *name;
     int32_t err;
 
     err = client_init(client, 4096);
@@ -1823,20 +3386,18 @@ serve_text(proxy_client_t *client)
             err--;
         }
         line[err] = 0;
-        while (isspace(*line)) {
-            line++;
-        }
-        if (*line == 0) {
+        name = client_arg(&line);
+        if (name == NULL) {
             continue;
         }
 
-        if (strcmp(line, "quit") == 0) {
+        if (strcmp(name, "quit") == 0) {
             break;
         }
 
         for (cmd = client_commands; cmd->name != NULL; cmd++) {
-            if (strcmp(cmd->name, line) == 0) {
-                cmd->handler(client);
+            if (strcmp(cmd->name, name) == 0) {
+                cmd->handler(client, line);
                 break;
             }
         }
@@ -1856,22 +3417,38 @@ serve_binary(proxy_client_t *client)
     proxy_req_t req;
     CEPH_DATA(hello, ans, 0);
     struct iovec req_iov[2];
+    proxy_handler_t handler;
     void *buffer;
     uint32_t size;
-    int32_t err;
+    int32_t class, err;
+
+    err = proxy_flow_init(&client->flow, client->sd);
+    if (err < 0) {
+        return;
+    }
 
     size = 65536;
     buffer = proxy_malloc(size);
     if (buffer == NULL) {
-        return;
+        goto done_flow;
+    }
+
+    err = proxy_buffer_open(&client->buffer_read, &client_read_ops, NULL,
+                            PROXY_LINK_BUFFER, BUFFER_READ);
+    if (err < 0) {
+        goto done_buffer;
+    }
+
+    err = session_create(client);
+    if (err < 0) {
+        goto done_read;
     }
 
     ans.major = LIBCEPHFSD_MAJOR;
     ans.minor = LIBCEPHFSD_MINOR;
     err = proxy_link_send(client->sd, ans_iov, ans_count);
     if (err < 0) {
-        proxy_free(buffer);
-        return;
+        goto done;
     }
 
     while (true) {
@@ -1880,16 +3457,52 @@ serve_binary(proxy_client_t *client)
         req_iov[1].iov_base = buffer;
         req_iov[1].iov_len = size;
 
-        err = proxy_link_req_recv(client->sd, req_iov, 2);
+        err = proxy_link_req_recv(client->sd, &client->buffer_read, req_iov, 2,
+                                  proxy_req_sizes(), LIBCEPHFSD_OP_TOTAL_OPS);
+
+        /* Data that doesn't fit in the buffer is received here, except for
+         * writes, which receive it by segments as it's written. */
+        if ((err > 0) && (req_iov[1].iov_base == NULL) &&
+            (req.header.data_len > 0) &&
+            (req.header.op != LIBCEPHFSD_OP_LL_WRITE)) {
+            req_iov[1].iov_base = proxy_malloc(req.header.data_len);
+            if (req_iov[1].iov_base == NULL) {
+                break;
+            }
+            err = proxy_link_req_data(client->sd, &client->buffer_read,
+                                      req_iov[1].iov_base,
+                                      req.header.data_len);
+        }
         if (err > 0) {
+            if (client->trace != NULL) {
+                client->trace_req = &req;
+                client->trace_data = req_iov[1].iov_base;
+                client->trace_time = proxy_trace_now();
+            }
+
+            client->oneway = (req.header.flags & PROXY_LINK_ONEWAY) != 0;
+            client->seq++;
+
             if (req.header.op >= LIBCEPHFSD_OP_TOTAL_OPS) {
                 err = send_error(client, -ENOSYS);
             } else if (libcephfsd_handlers[req.header.op] == NULL) {
                 err = send_error(client, -EOPNOTSUPP);
             } else {
-                err = libcephfsd_handlers[req.header.op](client, &req,
-                                                         req_iov[1].iov_base,
-                                                         req.header.data_len);
+                class = libcephfsd_classes[req.header.op];
+                if (class != PROXY_SCHED_NONE) {
+                    err = client_sched_enter(client, &req, class);
+                }
+
+                if (err < 0) {
+                    err = client_reject(client, &req, req_iov[1].iov_base,
+                                        err);
+                } else {
+                    handler = libcephfsd_handlers[req.header.op];
+                    err = handler(client, &req, req_iov[1].iov_base,
+                                  req.header.data_len);
+                }
+
+                client_sched_leave(client);
             }
         }
 
@@ -1902,7 +3515,62 @@ serve_binary(proxy_client_t *client)
         }
     }
 
+done:
+    session_detach(client->session);
+
+done_read:
+    proxy_buffer_close(&client->buffer_read);
+
+done_buffer:
     proxy_free(buffer);
+
+done_flow:
+    proxy_flow_destroy(&client->flow);
+}
+
+/* When the maximum number of connections is reached, new library connections
+ * are refused with EBUSY instead of creating more threads that would only
+ * block on an overloaded cluster. Text connections are never limited, so that
+ * the daemon can still be inspected and reconfigured. */
+static bool
+connection_enter(void)
+{
+    bool allowed;
+
+    proxy_mutex_lock(&connection_mutex);
+
+    allowed = (connection_max == 0) || (connection_count < connection_max);
+    if (allowed) {
+        connection_count++;
+    } else if (!connection_warned) {
+        proxy_log(LOG_WARN, EBUSY, "Too many connections, refusing new ones");
+        connection_warned = true;
+    }
+
+    proxy_mutex_unlock(&connection_mutex);
+
+    return allowed;
+}
+
+static void
+connection_done(void)
+{
+    proxy_mutex_lock(&connection_mutex);
+
+    connection_count--;
+    connection_warned = false;
+
+    proxy_mutex_unlock(&connection_mutex);
+}
+
+static void
+serve_refused(proxy_client_t *client, int32_t err)
+{
+    CEPH_DATA(hello, ans, 0);
+
+    ans.major = -err;
+    ans.minor = 0;
+    proxy_link_send(client->sd, ans_iov, ans_count);
 }
 
 static void
@@ -1919,7 +3587,12 @@ serve_connection(proxy_worker_t *worker)
         if (be32toh(req.id) == LIBCEPHFS_TEXT_CLIENT) {
             serve_text(client);
         } else if (req.id == LIBCEPHFS_LIB_CLIENT) {
-            serve_binary(client);
+            client->counted = connection_enter();
+            if (client->counted) {
+                serve_binary(client);
+            } else {
+                serve_refused(client, EBUSY);
+            }
         } else {
             proxy_log(LOG_ERR, EINVAL, "Invalid client initial message");
         }
@@ -1928,6 +3601,16 @@ serve_connection(proxy_worker_t *worker)
     close(client->sd);
 }
 
+static bool
+check_stop(proxy_link_t *link)
+{
+    proxy_server_t *server;
+
+    server = container_of(link, proxy_server_t, link);
+
+    return proxy_manager_stop(server->manager) || server->worker.stop;
+}
+
 static void
 destroy_connection(proxy_worker_t *worker)
 {
@@ -1935,6 +3618,10 @@ destroy_connection(proxy_worker_t *worker)
 
     client = container_of(worker, proxy_client_t, worker);
 
+    if (client->counted) {
+        connection_done();
+    }
+
     proxy_free(client->buffer);
     proxy_free(client);
 }
@@ -1944,6 +3631,7 @@ accept_connection(proxy_link_t *link, int32_t sd)
 {
     proxy_server_t *server;
     proxy_client_t *client;
+    proxy_t *proxy;
     int32_t err;
 
     server = container_of(link, proxy_server_t, link);
@@ -1954,16 +3642,34 @@ accept_connection(proxy_link_t *link, int32_t sd)
         goto failed_close;
     }
 
-    client->buffer_size = 65536;
+    client->buffer_size = PROXY_ANSWER_BUFFER;
     client->buffer = proxy_malloc(client->buffer_size);
     if (client->buffer == NULL) {
         err = -ENOMEM;
         goto failed_client;
     }
 
-    random_init(&client->random);
+    random_init(&client->random, random_tag_next());
     client->sd = sd;
+    client->sched = NULL;
+    client->seq = 0;
+    client->perms_handle = 0;
+    client->perms_generation = 0;
+    client->perms_uid = 0;
+    client->deferred = 0;
+    client->sched_class = PROXY_SCHED_NONE;
+    client->sched_paused = false;
+    client->oneway = false;
+    client->counted = false;
     client->link = link;
+    client->trace = NULL;
+    client->trace_req = NULL;
+
+    proxy = container_of(server->manager, proxy_t, manager);
+    if (proxy->trace_path != NULL) {
+        client->trace = &proxy->trace;
+        client->trace_id = proxy_trace_client(client->trace);
+    }
 
     err = proxy_manager_launch(server->manager, &client->worker,
                                serve_connection, destroy_connection);
@@ -1985,28 +3691,93 @@ failed_close:
     return err;
 }
 
-static bool
-check_stop(proxy_link_t *link)
+/* Each listening socket has its own accept thread. If the socket has a CPU
+ * set configured, the accept thread is pinned to it. Since threads inherit the
+ * affinity of their creator, all the connections served from this socket will
+ * also run on the same CPUs. */
+static int32_t
+server_run(proxy_server_t *server)
+{
+    int32_t err;
+
+    if (server->pinned) {
+        err = proxy_thread_affinity(&server->cpus);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    proxy_log(LOG_INFO, 0, "Listening on %s", server->path);
+
+    return proxy_link_server(&server->link, server->path, server->backlog,
+                             accept_connection, check_stop);
+}
+
+/* If an additional socket can't be served, the whole daemon is stopped and
+ * the error is returned from server_main(). */
+static void
+server_worker(proxy_worker_t *worker)
 {
     proxy_server_t *server;
+    int32_t err;
 
-    server = container_of(link, proxy_server_t, link);
+    server = container_of(worker, proxy_server_t, worker);
 
-    return proxy_manager_stop(server->manager);
+    err = server_run(server);
+    if (err < 0) {
+        __atomic_store_n(&server->error, err, __ATOMIC_RELEASE);
+        proxy_manager_shutdown(server->manager);
+    }
+}
+
+/* Expired sessions are destroyed from a dedicated thread, so that they don't
+ * depend on new connections being made. */
+static void
+sweeper_worker(proxy_worker_t *worker)
+{
+    while (!proxy_manager_stop(worker->manager) && !worker->stop) {
+        sleep(1);
+        session_sweep();
+    }
 }
 
 static int32_t
 server_main(proxy_manager_t *manager)
 {
-    proxy_server_t server;
+    proxy_server_t *server;
     proxy_t *proxy;
+    int32_t i, err;
 
     proxy = container_of(manager, proxy_t, manager);
 
-    server.manager = manager;
+    for (i = 0; i < proxy->count; i++) {
+        server = &proxy->servers[i];
+        server->manager = manager;
+        server->worker.stop = false;
+        server->error = 0;
+    }
 
-    return proxy_link_server(&server.link, proxy->socket_path,
-                             accept_connection, check_stop);
+    err = proxy_manager_launch(manager, &proxy->sweeper, sweeper_worker, NULL);
+    if (err < 0) {
+        return err;
+    }
+
+    /* The first socket is served from the main thread. */
+    for (i = 1; i < proxy->count; i++) {
+        err = proxy_manager_launch(manager, &proxy->servers[i].worker,
+                                   server_worker, NULL);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    err = server_run(&proxy->servers[0]);
+
+    for (i = 1; (err >= 0) && (i < proxy->count); i++) {
+        err = __atomic_load_n(&proxy->servers[i].error, __ATOMIC_ACQUIRE);
+    }
+
+    return err;
 }
 
 static void
@@ -2016,6 +3787,310 @@ log_print(proxy_log_handler_t *handler, int32_t level, int32_t err,
     printf("[%d] %s\n", level, msg);
 }
 
+static void
+usage(const char *name)
+{
+    printf("Usage: %s [<options>] [<socket path>]\n"
+           "\n"
+           "Options:\n"
+           "  -s, --socket <path>    Listen on the given Unix socket. It can\n"
+           "                         be used multiple times.\n"
+           "  -b, --backlog <n>      Listen backlog of the following sockets.\n"
+           "  -c, --cpus <list>      Run the accept thread and connections of\n"
+           "                         the last socket on the given CPUs.\n"
+           "  -n, --node <node>      Run the accept thread and connections of\n"
+           "                         the last socket on the CPUs of the given\n"
+           "                         NUMA node.\n"
+           "  -N, --numa             Place each Ceph client instance, and the\n"
+           "                         threads serving it, on a NUMA node. It\n"
+           "                         can't be combined with -c or -n.\n"
+           "  -S, --shards <n>       Maximum number of Ceph client instances\n"
+           "                         created for the same configuration.\n"
+           "  -t, --trace <file>     Record all binary requests into a trace\n"
+           "                         file.\n"
+           "      --trace-size <MiB> Maximum size of the trace file.\n"
+           "      --trace-data <n>   Maximum number of bytes of request data\n"
+           "                         stored for each request.\n"
+           "      --spin <usecs>     Maximum time spent polling a connection\n"
+           "                         for the next request before blocking.\n"
+           "      --uring            Use io_uring to send each answer and\n"
+           "                         receive the next request at once.\n"
+           "      --read-segment <KiB>\n"
+           "                         Size of the segments in which large\n"
+           "                         reads and copies are done (1 MiB by\n"
+           "                         default).\n"
+           "      --write-segment <KiB>\n"
+           "                         Size of the segments in which large\n"
+           "                         writes are received and written (1 MiB\n"
+           "                         by default).\n"
+           "      --meta-slots <n>   Maximum number of metadata requests\n"
+           "                         running at the same time on each Ceph\n"
+           "                         client instance (unlimited by default).\n"
+           "      --data-slots <n>   Same for data requests.\n"
+           "      --queue-max <n>    Maximum number of requests waiting for a\n"
+           "                         slot of each class on each instance.\n"
+           "                         Requests beyond it fail with EBUSY.\n"
+           "      --queue-timeout <msecs>\n"
+           "                         Maximum time a request waits for a slot\n"
+           "                         or for its rate limit. Requests that\n"
+           "                         would wait longer fail with EAGAIN.\n"
+           "      --max-connections <n>\n"
+           "                         Maximum number of library connections\n"
+           "                         served at the same time. Further ones\n"
+           "                         are refused with EBUSY.\n"
+           "  -h, --help             Show this help.\n"
+           "\n"
+           "If no socket is given, the path in the %s environment variable\n"
+           "or %s is used.\n",
+           name, PROXY_SOCKET_ENV, PROXY_SOCKET);
+}
+
+static int32_t
+server_add(proxy_t *proxy, const char *path, int32_t backlog)
+{
+    proxy_server_t *server;
+    int32_t err;
+
+    err = proxy_realloc((void **)&proxy->servers,
+                        sizeof(proxy_server_t) * (proxy->count + 1));
+    if (err < 0) {
+        return err;
+    }
+
+    server = &proxy->servers[proxy->count++];
+    memset(server, 0, sizeof(proxy_server_t));
+    server->path = path;
+    server->backlog = backlog;
+    server->pinned = false;
+
+    return 0;
+}
+
+static int32_t
+option_int(const char *arg, const char *name, int32_t min, int32_t max,
+           int32_t *value)
+{
+    char *end;
+    long num;
+
+    errno = 0;
+    num = strtol(arg, &end, 10);
+    if ((errno != 0) || (end == arg) || (*end != 0) || (num < min) ||
+        (num > max)) {
+        return proxy_log(LOG_ERR, EINVAL, "Invalid %s '%s'", name, arg);
+    }
+    *value = num;
+
+    return 0;
+}
+
+static int32_t
+server_pin(proxy_t *proxy, const char *cpus, int32_t node)
+{
+    proxy_server_t *server;
+    int32_t err;
+
+    if (proxy->count == 0) {
+        return proxy_log(LOG_ERR, EINVAL, "CPUs must be specified after the "
+                                          "socket");
+    }
+
+    server = &proxy->servers[proxy->count - 1];
+    if (cpus != NULL) {
+        err = proxy_cpus_parse(&server->cpus, cpus);
+    } else {
+        err = proxy_cpus_node(&server->cpus, node);
+    }
+    if (err >= 0) {
+        server->pinned = true;
+    }
+
+    return err;
+}
+
+enum {
+    OPT_TRACE_SIZE = 256,
+    OPT_TRACE_DATA,
+    OPT_SPIN,
+    OPT_URING,
+    OPT_READ_SEGMENT,
+    OPT_WRITE_SEGMENT,
+    OPT_META_SLOTS,
+    OPT_DATA_SLOTS,
+    OPT_QUEUE_MAX,
+    OPT_QUEUE_TIMEOUT,
+    OPT_MAX_CONNECTIONS
+};
+
+static int32_t
+parse_options(proxy_t *proxy, int32_t argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "socket", required_argument, NULL, 's' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "cpus", required_argument, NULL, 'c' },
+        { "node", required_argument, NULL, 'n' },
+        { "numa", no_argument, NULL, 'N' },
+        { "shards", required_argument, NULL, 'S' },
+        { "trace", required_argument, NULL, 't' },
+        { "trace-size", required_argument, NULL, OPT_TRACE_SIZE },
+        { "trace-data", required_argument, NULL, OPT_TRACE_DATA },
+        { "spin", required_argument, NULL, OPT_SPIN },
+        { "uring", no_argument, NULL, OPT_URING },
+        { "read-segment", required_argument, NULL, OPT_READ_SEGMENT },
+        { "write-segment", required_argument, NULL, OPT_WRITE_SEGMENT },
+        { "meta-slots", required_argument, NULL, OPT_META_SLOTS },
+        { "data-slots", required_argument, NULL, OPT_DATA_SLOTS },
+        { "queue-max", required_argument, NULL, OPT_QUEUE_MAX },
+        { "queue-timeout", required_argument, NULL, OPT_QUEUE_TIMEOUT },
+        { "max-connections", required_argument, NULL, OPT_MAX_CONNECTIONS },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *path;
+    uint32_t queue_max, queue_timeout;
+    int32_t opt, backlog, node, shards, value, err;
+    bool numa, pinned;
+
+    backlog = SOMAXCONN;
+    numa = false;
+    pinned = false;
+    err = 0;
+
+    while ((err >= 0) &&
+           ((opt = getopt_long(argc, argv, "s:b:c:n:NS:t:h", options,
+                               NULL)) >= 0)) {
+        switch (opt) {
+        case 's':
+            err = server_add(proxy, optarg, backlog);
+            break;
+        case 'b':
+            err = option_int(optarg, "backlog", 1, INT32_MAX, &backlog);
+            break;
+        case 'c':
+            err = server_pin(proxy, optarg, -1);
+            pinned = true;
+            break;
+        case 'n':
+            err = option_int(optarg, "NUMA node", 0, INT32_MAX, &node);
+            if (err >= 0) {
+                err = server_pin(proxy, NULL, node);
+            }
+            pinned = true;
+            break;
+        case 'N':
+            err = proxy_mount_numa();
+            numa = true;
+            break;
+        case 'S':
+            err = option_int(optarg, "number of shards", 1, INT32_MAX, &shards);
+            if (err >= 0) {
+                err = proxy_mount_shards(shards);
+            }
+            break;
+        case 't':
+            proxy->trace_path = optarg;
+            break;
+        case OPT_TRACE_SIZE:
+            /* The size in bytes always fits in 64 bits. */
+            err = option_int(optarg, "trace size", 1, INT32_MAX, &value);
+            if (err >= 0) {
+                proxy->trace_size = value * 1024ULL * 1024ULL;
+            }
+            break;
+        case OPT_TRACE_DATA:
+            err = option_int(optarg, "trace data size", 0, INT32_MAX, &value);
+            if (err >= 0) {
+                proxy->trace_data = value;
+            }
+            break;
+        case OPT_SPIN:
+            /* Spinning for more than a second makes no sense. */
+            err = option_int(optarg, "spin time", 0, 1000000, &value);
+            if (err >= 0) {
+                proxy_link_spin_set(value);
+            }
+            break;
+        case OPT_URING:
+            err = proxy_link_uring_enable();
+            break;
+        case OPT_READ_SEGMENT:
+            err = option_int(optarg, "read segment size", 1,
+                             PROXY_READ_SEGMENT_MAX / 1024, &value);
+            if (err >= 0) {
+                read_segment = value * 1024;
+            }
+            break;
+        case OPT_WRITE_SEGMENT:
+            err = option_int(optarg, "write segment size", 1,
+                             PROXY_WRITE_SEGMENT_MAX / 1024, &value);
+            if (err >= 0) {
+                write_segment = value * 1024;
+            }
+            break;
+        case OPT_META_SLOTS:
+        case OPT_DATA_SLOTS:
+            err = option_int(optarg, "number of slots", 0, INT32_MAX,
+                             &value);
+            if (err >= 0) {
+                err = proxy_sched_slots_set((opt == OPT_META_SLOTS)
+                                                ? PROXY_SCHED_META
+                                                : PROXY_SCHED_DATA,
+                                            value);
+            }
+            break;
+        case OPT_QUEUE_MAX:
+            err = option_int(optarg, "queue size", 0, INT32_MAX, &value);
+            if (err >= 0) {
+                proxy_sched_queue_get(&queue_max, &queue_timeout);
+                err = proxy_sched_queue_set(value, queue_timeout);
+            }
+            break;
+        case OPT_QUEUE_TIMEOUT:
+            err = option_int(optarg, "queue timeout", 0, INT32_MAX, &value);
+            if (err >= 0) {
+                proxy_sched_queue_get(&queue_max, &queue_timeout);
+                err = proxy_sched_queue_set(queue_max, value);
+            }
+            break;
+        case OPT_MAX_CONNECTIONS:
+            err = option_int(optarg, "maximum number of connections", 0,
+                             INT32_MAX, &value);
+            if (err >= 0) {
+                connection_max = value;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 1;
+        default:
+            usage(argv[0]);
+            return -EINVAL;
+        }
+    }
+
+    /* Threads serving a mount are moved to the node of its instance, which
+     * would silently override the CPUs of the socket. */
+    if ((err >= 0) && numa && pinned) {
+        err = proxy_log(LOG_ERR, EINVAL,
+                        "Options -c and -n can't be combined with -N");
+    }
+
+    while ((err >= 0) && (optind < argc)) {
+        err = server_add(proxy, argv[optind++], backlog);
+    }
+
+    if ((err >= 0) && (proxy->count == 0)) {
+        path = getenv(PROXY_SOCKET_ENV);
+        if ((path == NULL) || (*path == 0)) {
+            path = PROXY_SOCKET;
+        }
+        err = server_add(proxy, path, backlog);
+    }
+
+    return err;
+}
+
 int32_t
 main(int32_t argc, char *argv[])
 {
@@ -2026,16 +4101,37 @@ main(int32_t argc, char *argv[])
     clock_gettime(CLOCK_MONOTONIC, &now);
     srand(now.tv_nsec);
 
-    random_init(&global_random);
+    random_tag = random();
+    random_init(&global_random, random_tag_next());
 
     proxy_log_register(&proxy.log_handler, log_print);
 
-    proxy.socket_path = "/tmp/libcephfsd.sock";
-    if (argc > 1) {
-        proxy.socket_path = argv[1];
+    err = session_token(&daemon_instance);
+    if (err < 0) {
+        proxy_log_deregister(&proxy.log_handler);
+        return 1;
+    }
+
+    proxy.servers = NULL;
+    proxy.count = 0;
+    proxy.trace_path = NULL;
+    proxy.trace_size = PROXY_TRACE_SIZE;
+    proxy.trace_data = PROXY_TRACE_DATA;
+
+    err = parse_options(&proxy, argc, argv);
+    if ((err == 0) && (proxy.trace_path != NULL)) {
+        err = proxy_trace_open(&proxy.trace, proxy.trace_path,
+                               proxy.trace_size, proxy.trace_data);
+    }
+    if (err == 0) {
+        err = proxy_manager_run(&proxy.manager, server_main);
+
+        if (proxy.trace_path != NULL) {
+            proxy_trace_close(&proxy.trace);
+        }
     }
 
-    err = proxy_manager_run(&proxy.manager, server_main);
+    proxy_free(proxy.servers);
 
     proxy_log_deregister(&proxy.log_handler);
 
@@ -6,11 +6,15 @@
 #include <unistd.h>
 
 struct ceph_mount_info;
-typedef struct _UserPerm UserPerm;
-typedef struct _Inode Inode;
+typedef struct UserPerm UserPerm;
+struct Inode;
+typedef struct Inode Inode;
 struct Fh;
 typedef struct Fh Fh;
 
+int32_t
+ceph_cancel(struct ceph_mount_info *cmount);
+
 int32_t
 ceph_chdir(struct ceph_mount_info *cmount, const char *path);
 
@@ -37,6 +41,15 @@ ceph_init(struct ceph_mount_info *cmount);
 int32_t
 ceph_ll_close(struct ceph_mount_info *cmount, struct Fh* filehandle);
 
+int32_t
+ceph_ll_close_put(struct ceph_mount_info *cmount, struct Fh *filehandle,
+                  struct Inode *in);
+
+int32_t
+ceph_ll_copy_range(struct ceph_mount_info *cmount, struct Fh *src,
+                   int64_t src_offset, struct Fh *dst, int64_t dst_offset,
+                   uint64_t len);
+
 int32_t
 ceph_ll_create(struct ceph_mount_info *cmount, Inode *parent, const char *name,
                mode_t mode, int oflags, Inode **outp, Fh **fhp,
@@ -98,6 +111,11 @@ int32_t
 ceph_ll_open(struct ceph_mount_info *cmount, struct Inode *in, int flags,
              struct Fh **fh, const UserPerm *perms);
 
+int32_t
+ceph_ll_openat(struct ceph_mount_info *cmount, Inode *parent, const char *name,
+               int oflags, Inode **outp, Fh **fhp, struct ceph_statx *stx,
+               unsigned want, unsigned lflags, const UserPerm *perms);
+
 int32_t
 ceph_ll_opendir(struct ceph_mount_info *cmount, struct Inode *in,
                 struct ceph_dir_result **dirpp, const UserPerm *perms);
@@ -169,6 +187,9 @@ ceph_release(struct ceph_mount_info *cmount);
 int32_t
 ceph_select_filesystem(struct ceph_mount_info *cmount, const char *fs_name);
 
+int32_t
+ceph_set_timeout(struct ceph_mount_info *cmount, uint32_t msecs);
+
 int32_t
 ceph_unmount(struct ceph_mount_info *cmount);
 
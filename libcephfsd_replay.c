@@ -0,0 +1,775 @@
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cephfs/libcephfs.h>
+
+#include "proxy_link.h"
+#include "proxy_helpers.h"
+#include "proxy_log.h"
+#include "proxy_requests.h"
+#include "proxy_trace.h"
+
+/* Replay of binary request traces
+ *
+ * A trace recorded by libcephfsd contains the raw requests sent by each client,
+ * but the mount, inode, file handle and UserPerm references inside them are
+ * only valid for the daemon that created them. To be able to replay the trace
+ * against another daemon, the references returned in the answers received
+ * during the replay are compared with the recorded ones. If they differ, the
+ * recorded value is replaced by the new one in all subsequent requests.
+ *
+ * Each client connection found in the trace is replayed from its own thread,
+ * keeping the original timing (optionally accelerated) between requests.
+ */
+
+#define REPLAY_MAP_INITIAL 1024
+#define REPLAY_BUFFER_SIZE (1024 * 1024)
+
+/* Maximum number of references returned in a single answer. */
+#define REPLAY_ANS_REFS 2
+
+#define REPLAY_REF(_type, _field) offset_of(proxy_##_type##_ans_t, _field)
+
+typedef struct _replay_map {
+    uint64_t *keys;
+    uint64_t *values;
+    uint32_t size;
+    uint32_t used;
+} replay_map_t;
+
+struct _replay;
+typedef struct _replay replay_t;
+
+typedef struct _replay_client {
+    proxy_link_t link;
+    replay_t *replay;
+    proxy_trace_record_t **records;
+    void *buffer;
+    uint64_t latency;
+    uint32_t buffer_size;
+    uint32_t count;
+    uint32_t size;
+    uint32_t id;
+    uint32_t mismatches;
+    uint32_t failures;
+    pthread_t tid;
+} replay_client_t;
+
+struct _replay {
+    pthread_mutex_t mutex;
+    replay_map_t map;
+    proxy_trace_header_t *header;
+    replay_client_t *clients;
+    proxy_log_handler_t log_handler;
+    const char *socket;
+    double speed;
+    uint64_t start;
+    uint64_t size;
+    uint32_t count;
+};
+
+/* Offsets of the references returned in the answer of each operation. Only
+ * these fields are learned, so that other values that change between runs
+ * (sizes, offsets or the daemon instance) are never taken as references. */
+static const uint16_t replay_refs[LIBCEPHFSD_OP_TOTAL_OPS][REPLAY_ANS_REFS] = {
+    [LIBCEPHFSD_OP_SESSION] = { REPLAY_REF(session, token) },
+    [LIBCEPHFSD_OP_USERPERM_NEW] = { REPLAY_REF(ceph_userperm_new, userperm) },
+    [LIBCEPHFSD_OP_CREATE] = { REPLAY_REF(ceph_create, cmount) },
+    [LIBCEPHFSD_OP_LL_LOOKUP] = { REPLAY_REF(ceph_ll_lookup, inode) },
+    [LIBCEPHFSD_OP_LL_LOOKUP_INODE] = {
+        REPLAY_REF(ceph_ll_lookup_inode, inode)
+    },
+    [LIBCEPHFSD_OP_LL_LOOKUP_ROOT] = { REPLAY_REF(ceph_ll_lookup_root, inode) },
+    [LIBCEPHFSD_OP_LL_WALK] = { REPLAY_REF(ceph_ll_walk, inode) },
+    [LIBCEPHFSD_OP_LL_OPEN] = { REPLAY_REF(ceph_ll_open, fh) },
+    [LIBCEPHFSD_OP_LL_CREATE] = {
+        REPLAY_REF(ceph_ll_create, inode),
+        REPLAY_REF(ceph_ll_create, fh)
+    },
+    [LIBCEPHFSD_OP_LL_MKNOD] = { REPLAY_REF(ceph_ll_mknod, inode) },
+    [LIBCEPHFSD_OP_LL_OPENAT] = {
+        REPLAY_REF(ceph_ll_openat, inode),
+        REPLAY_REF(ceph_ll_openat, fh)
+    },
+    [LIBCEPHFSD_OP_LL_SYMLINK] = { REPLAY_REF(ceph_ll_symlink, inode) },
+    [LIBCEPHFSD_OP_LL_OPENDIR] = { REPLAY_REF(ceph_ll_opendir, dir) },
+    [LIBCEPHFSD_OP_LL_MKDIR] = { REPLAY_REF(ceph_ll_mkdir, inode) }
+};
+
+static bool
+replay_stop(proxy_link_t *link)
+{
+    return false;
+}
+
+static uint32_t
+replay_map_hash(uint64_t key, uint32_t size)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+
+    return key & (size - 1);
+}
+
+static int32_t
+replay_map_resize(replay_map_t *map, uint32_t size)
+{
+    uint64_t *keys, *values;
+    uint32_t i, idx;
+
+    keys = proxy_malloc(sizeof(uint64_t) * size * 2);
+    if (keys == NULL) {
+        return -ENOMEM;
+    }
+    memset(keys, 0, sizeof(uint64_t) * size * 2);
+    values = keys + size;
+
+    for (i = 0; i < map->size; i++) {
+        if (map->keys[i] != 0) {
+            idx = replay_map_hash(map->keys[i], size);
+            while (keys[idx] != 0) {
+                idx = (idx + 1) & (size - 1);
+            }
+            keys[idx] = map->keys[i];
+            values[idx] = map->values[i];
+        }
+    }
+
+    proxy_free(map->keys);
+
+    map->keys = keys;
+    map->values = values;
+    map->size = size;
+
+    return 0;
+}
+
+static int32_t
+replay_map_set(replay_map_t *map, uint64_t key, uint64_t value)
+{
+    uint32_t idx;
+    int32_t err;
+
+    if (map->used * 2 >= map->size) {
+        err = replay_map_resize(map, map->size * 2);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    idx = replay_map_hash(key, map->size);
+    while ((map->keys[idx] != 0) && (map->keys[idx] != key)) {
+        idx = (idx + 1) & (map->size - 1);
+    }
+    if (map->keys[idx] == 0) {
+        map->keys[idx] = key;
+        map->used++;
+    }
+    map->values[idx] = value;
+
+    return 0;
+}
+
+static bool
+replay_map_get(replay_map_t *map, uint64_t key, uint64_t *value)
+{
+    uint32_t idx;
+
+    idx = replay_map_hash(key, map->size);
+    while (map->keys[idx] != 0) {
+        if (map->keys[idx] == key) {
+            *value = map->values[idx];
+            return true;
+        }
+        idx = (idx + 1) & (map->size - 1);
+    }
+
+    return false;
+}
+
+/* Wire types are packed, so references are not necessarily aligned to 8 bytes.
+ * All fields are at least 4 bytes wide except the string lengths, which are
+ * always placed at the end, so references can only start at offsets that are
+ * a multiple of 4. Once a reference has been found, the scan continues after
+ * it. Only values returned as references are known, so other fields are very
+ * unlikely to match. */
+
+/* Replace all known references in a request header. */
+static void
+replay_translate(replay_t *replay, void *header, uint32_t size)
+{
+    uint64_t value;
+    uint32_t offset;
+
+    proxy_mutex_lock(&replay->mutex);
+
+    offset = sizeof(proxy_link_req_t);
+    while (offset + 8 <= size) {
+        memcpy(&value, header + offset, 8);
+        if ((value != 0) && replay_map_get(&replay->map, value, &value)) {
+            memcpy(header + offset, &value, 8);
+            offset += 8;
+        } else {
+            offset += 4;
+        }
+    }
+
+    proxy_mutex_unlock(&replay->mutex);
+}
+
+/* Replace the known inode references in the entries of a batch of releases,
+ * which are sent as request data. */
+static void
+replay_translate_puts(replay_t *replay, void *data, uint32_t size)
+{
+    proxy_put_entry_t entry;
+    uint32_t offset;
+
+    proxy_mutex_lock(&replay->mutex);
+
+    for (offset = 0; offset + sizeof(entry) <= size; offset += sizeof(entry)) {
+        memcpy(&entry, data + offset, sizeof(entry));
+        if (replay_map_get(&replay->map, entry.inode, &entry.inode)) {
+            memcpy(data + offset, &entry, sizeof(entry));
+        }
+    }
+
+    proxy_mutex_unlock(&replay->mutex);
+}
+
+/* Learn new references by comparing the recorded and the received answers. */
+static void
+replay_learn(replay_t *replay, uint32_t op, void *old, void *new,
+             uint32_t size)
+{
+    uint64_t old_value, new_value;
+    uint32_t i, offset;
+
+    if (op >= LIBCEPHFSD_OP_TOTAL_OPS) {
+        return;
+    }
+
+    proxy_mutex_lock(&replay->mutex);
+
+    for (i = 0; i < REPLAY_ANS_REFS; i++) {
+        offset = replay_refs[op][i];
+        if ((offset == 0) || (offset + 8 > size)) {
+            break;
+        }
+        memcpy(&old_value, old + offset, 8);
+        memcpy(&new_value, new + offset, 8);
+        if ((old_value != 0) && (old_value != new_value)) {
+            replay_map_set(&replay->map, old_value, new_value);
+        }
+    }
+
+    proxy_mutex_unlock(&replay->mutex);
+}
+
+static int32_t
+replay_connect(replay_client_t *client)
+{
+    CEPH_REQ(hello, req, 0, ans, 0);
+    int32_t sd, err;
+
+    sd = proxy_link_client(&client->link, client->replay->socket, replay_stop);
+    if (sd < 0) {
+        return sd;
+    }
+
+    req.id = LIBCEPHFS_LIB_CLIENT;
+    err = proxy_link_send(sd, req_iov, 1);
+    if (err >= 0) {
+        err = proxy_link_recv(sd, ans_iov, 1);
+    }
+    if (err < 0) {
+        proxy_link_close(&client->link);
+        return err;
+    }
+
+    if ((ans.major != client->replay->header->major) ||
+        (ans.minor != client->replay->header->minor)) {
+        proxy_log(LOG_WARN, 0, "Trace recorded with a different daemon "
+                               "version");
+    }
+
+    return 0;
+}
+
+static void
+replay_wait(replay_t *replay, proxy_trace_record_t *record)
+{
+    struct timespec ts;
+    uint64_t when;
+
+    if (replay->speed <= 0) {
+        return;
+    }
+
+    when = replay->start + (uint64_t)(record->time / replay->speed);
+    ts.tv_sec = when / 1000000000ULL;
+    ts.tv_nsec = when % 1000000000ULL;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+}
+
+/* Records whose headers don't fit in their size, or that are not valid
+ * requests, can't be replayed. */
+static bool
+replay_record_valid(proxy_trace_record_t *record)
+{
+    uint64_t size;
+
+    size = sizeof(proxy_trace_record_t) + record->req_len + record->ans_len +
+           record->data_stored;
+
+    return (record->req_len >= sizeof(proxy_link_req_t)) &&
+           (record->req_len <= sizeof(proxy_req_t)) &&
+           (record->ans_len >= sizeof(proxy_link_ans_t)) &&
+           (record->ans_len <= sizeof(proxy_req_t)) &&
+           (record->data_stored <= record->data_len) && (size <= record->size);
+}
+
+static int32_t
+replay_record(replay_client_t *client, proxy_trace_record_t *record)
+{
+    uint64_t header[(sizeof(proxy_req_t) + 7) / 8];
+    uint64_t answer[(sizeof(proxy_req_t) + 7) / 8];
+    struct iovec req_iov[2], ans_iov[2];
+    proxy_link_req_t *req;
+    proxy_link_ans_t *old, *ans;
+    proxy_ceph_ll_read_req_t *read;
+    void *data, *buffer;
+    uint64_t start, size;
+    int32_t err;
+
+    memcpy(header, proxy_trace_req(record), record->req_len);
+    req = (proxy_link_req_t *)header;
+    old = proxy_trace_ans(record);
+
+    /* Request data that was not completely stored in the trace is filled
+     * with zeros. Data that contains references also needs a copy to
+     * translate them. */
+    data = proxy_trace_data(record);
+    buffer = NULL;
+    if ((record->data_len > 0) &&
+        ((record->data_stored < record->data_len) ||
+         (req->op == LIBCEPHFSD_OP_LL_PUTS))) {
+        buffer = proxy_malloc(record->data_len);
+        if (buffer == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(buffer, data, record->data_stored);
+        memset(buffer + record->data_stored, 0,
+               record->data_len - record->data_stored);
+        data = buffer;
+    }
+
+    /* Big reads are answered in several parts, but only the size of the last
+     * one is recorded. */
+    size = old->data_len;
+    if ((req->op == LIBCEPHFSD_OP_LL_READ) &&
+        (record->req_len == sizeof(proxy_ceph_ll_read_req_t))) {
+        read = (proxy_ceph_ll_read_req_t *)header;
+        if (read->len > size) {
+            size = (read->len < INT32_MAX) ? read->len : INT32_MAX;
+        }
+    }
+
+    if (size > client->buffer_size) {
+        proxy_free(client->buffer);
+        client->buffer_size = size * 2;
+        client->buffer = proxy_malloc(client->buffer_size);
+        if (client->buffer == NULL) {
+            client->buffer_size = 0;
+            err = -ENOMEM;
+            goto done;
+        }
+    }
+
+    replay_translate(client->replay, header, record->req_len);
+    if (req->op == LIBCEPHFSD_OP_LL_PUTS) {
+        replay_translate_puts(client->replay, data, record->data_stored);
+    }
+
+    req_iov[0].iov_base = header;
+    req_iov[0].iov_len = record->req_len;
+    req_iov[1].iov_base = data;
+    req_iov[1].iov_len = record->data_len;
+
+    ans = (proxy_link_ans_t *)answer;
+    ans_iov[0].iov_base = answer;
+    ans_iov[0].iov_len = sizeof(answer);
+    ans_iov[1].iov_base = client->buffer;
+    ans_iov[1].iov_len = client->buffer_size;
+
+    start = proxy_trace_now();
+
+    /* One-way requests don't receive an answer. */
+    if ((req->flags & PROXY_LINK_ONEWAY) != 0) {
+        err = proxy_link_req_send(client->link.sd, req->op, req->flags, 0,
+                                  req_iov, record->data_len > 0 ? 2 : 1);
+        if (err >= 0) {
+            client->latency += proxy_trace_now() - start;
+        }
+        goto done;
+    }
+
+    err = proxy_link_request(client->link.sd, NULL, req->op, req_iov,
+                             record->data_len > 0 ? 2 : 1, ans_iov, 2);
+    if (err < 0) {
+        goto done;
+    }
+
+    client->latency += proxy_trace_now() - start;
+
+    if ((ans->result < 0) != (old->result < 0)) {
+        client->mismatches++;
+    }
+    if (ans->result < 0) {
+        client->failures++;
+    } else if (ans->header_len == old->header_len) {
+        replay_learn(client->replay, req->op, old, answer, ans->header_len);
+    }
+
+done:
+    proxy_free(buffer);
+
+    return err;
+}
+
+static void *
+replay_client_main(void *arg)
+{
+    replay_client_t *client;
+    uint32_t i;
+    int32_t err;
+
+    client = arg;
+
+    err = replay_connect(client);
+    if (err < 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < client->count; i++) {
+        replay_wait(client->replay, client->records[i]);
+
+        err = replay_record(client, client->records[i]);
+        if (err < 0) {
+            proxy_log(LOG_ERR, -err, "Replay of client %u aborted", client->id);
+            break;
+        }
+    }
+
+    proxy_link_close(&client->link);
+
+    return NULL;
+}
+
+static replay_client_t *
+replay_client_get(replay_t *replay, uint32_t id)
+{
+    replay_client_t *client;
+    uint32_t i;
+    int32_t err;
+
+    for (i = 0; i < replay->count; i++) {
+        if (replay->clients[i].id == id) {
+            return &replay->clients[i];
+        }
+    }
+
+    err = proxy_realloc((void **)&replay->clients,
+                        sizeof(replay_client_t) * (replay->count + 1));
+    if (err < 0) {
+        return NULL;
+    }
+
+    client = &replay->clients[replay->count++];
+    memset(client, 0, sizeof(replay_client_t));
+    client->replay = replay;
+    client->id = id;
+
+    return client;
+}
+
+static int32_t
+replay_client_add(replay_client_t *client, proxy_trace_record_t *record)
+{
+    int32_t err;
+
+    if (client->count == client->size) {
+        client->size = client->size == 0 ? 256 : client->size * 2;
+        err = proxy_realloc((void **)&client->records,
+                            sizeof(proxy_trace_record_t *) * client->size);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    client->records[client->count++] = record;
+
+    return 0;
+}
+
+static int32_t
+replay_load(replay_t *replay, const char *path)
+{
+    proxy_trace_header_t *header;
+    struct stat st;
+    int32_t fd, err;
+
+    header = NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return proxy_log(LOG_ERR, errno, "Unable to open the trace file");
+    }
+
+    err = 0;
+    if (fstat(fd, &st) < 0) {
+        err = proxy_log(LOG_ERR, errno, "Unable to get the trace file size");
+    } else if (st.st_size < sizeof(proxy_trace_header_t)) {
+        err = proxy_log(LOG_ERR, EINVAL, "Invalid trace file");
+    } else {
+        /* The mapping is private, so the header can be fixed without
+         * modifying the file. */
+        header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd, 0);
+        if (header == MAP_FAILED) {
+            err = proxy_log(LOG_ERR, errno, "Unable to map the trace file");
+        }
+    }
+
+    close(fd);
+
+    if (err < 0) {
+        return err;
+    }
+
+    replay->header = header;
+    replay->size = st.st_size;
+
+    if ((header->magic != PROXY_TRACE_MAGIC) ||
+        (header->version != PROXY_TRACE_VERSION)) {
+        return proxy_log(LOG_ERR, EINVAL, "Unsupported trace file");
+    }
+    /* A truncated file is replayed up to its last complete record. */
+    if (header->size > st.st_size) {
+        proxy_log(LOG_WARN, 0, "Trace file is truncated");
+        header->size = st.st_size;
+    }
+
+    return 0;
+}
+
+static int32_t
+replay_prepare(replay_t *replay)
+{
+    proxy_trace_record_t *record;
+    replay_client_t *client;
+    uint32_t skipped;
+    int32_t err;
+
+    skipped = 0;
+    record = NULL;
+    while ((record = proxy_trace_next(replay->header, record)) != NULL) {
+        if (!replay_record_valid(record)) {
+            skipped++;
+            continue;
+        }
+        client = replay_client_get(replay, record->client);
+        if (client == NULL) {
+            return -ENOMEM;
+        }
+        err = replay_client_add(client, record);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    if (skipped > 0) {
+        proxy_log(LOG_WARN, 0, "Skipped %u invalid trace records", skipped);
+    }
+
+    return 0;
+}
+
+static void
+replay_dump(replay_t *replay)
+{
+    proxy_trace_record_t *record;
+    proxy_link_req_t *req;
+    proxy_link_ans_t *ans;
+
+    printf("%-8s %-14s %-10s %-4s %-10s %s\n", "CLIENT", "TIME", "LATENCY",
+           "OP", "DATA", "RESULT");
+
+    record = NULL;
+    while ((record = proxy_trace_next(replay->header, record)) != NULL) {
+        if (!replay_record_valid(record)) {
+            continue;
+        }
+        req = proxy_trace_req(record);
+        ans = proxy_trace_ans(record);
+        printf("%-8u %-14lu %-10lu %-4u %-10u %d\n", record->client,
+               record->time, record->latency, req->op, record->data_len,
+               ans->result);
+    }
+}
+
+static int32_t
+replay_run(replay_t *replay)
+{
+    replay_client_t *client;
+    uint64_t latency, requests, elapsed;
+    uint32_t i, mismatches, failures;
+    int32_t err;
+
+    replay->start = proxy_trace_now();
+
+    for (i = 0; i < replay->count; i++) {
+        client = &replay->clients[i];
+        client->buffer_size = REPLAY_BUFFER_SIZE;
+        client->buffer = proxy_malloc(client->buffer_size);
+        if (client->buffer == NULL) {
+            return -ENOMEM;
+        }
+        err = proxy_thread_create(&client->tid, replay_client_main, client);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    latency = requests = 0;
+    mismatches = failures = 0;
+    for (i = 0; i < replay->count; i++) {
+        client = &replay->clients[i];
+        proxy_thread_join(client->tid);
+
+        latency += client->latency;
+        requests += client->count;
+        mismatches += client->mismatches;
+        failures += client->failures;
+
+        proxy_free(client->buffer);
+        proxy_free(client->records);
+    }
+
+    elapsed = proxy_trace_now() - replay->start;
+
+    printf("Replayed %lu requests from %u clients in %.3f seconds\n", requests,
+           replay->count, elapsed / 1e9);
+    if (requests > 0) {
+        printf("Average latency: %lu ns\n", latency / requests);
+    }
+    printf("Failed requests: %u (%u different from the trace)\n", failures,
+           mismatches);
+
+    return 0;
+}
+
+static void
+log_print(proxy_log_handler_t *handler, int32_t level, int32_t err,
+          const char *msg)
+{
+    fprintf(stderr, "[%d] %s\n", level, msg);
+}
+
+static void
+usage(const char *name)
+{
+    printf("Usage: %s [<options>] <trace file>\n"
+           "\n"
+           "Options:\n"
+           "  -s, --socket <path>    Socket of the daemon.\n"
+           "  -x, --speed <factor>   Replay speed relative to the original.\n"
+           "                         0 replays as fast as possible.\n"
+           "  -d, --dump             Print the requests instead of replaying\n"
+           "                         them.\n"
+           "  -h, --help             Show this help.\n",
+           name);
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+    static const struct option options[] = {
+        { "socket", required_argument, NULL, 's' },
+        { "speed", required_argument, NULL, 'x' },
+        { "dump", no_argument, NULL, 'd' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    replay_t replay;
+    bool dump;
+    int32_t opt, err;
+
+    memset(&replay, 0, sizeof(replay));
+    replay.speed = 1.0;
+    dump = false;
+
+    replay.socket = getenv(PROXY_SOCKET_ENV);
+    if ((replay.socket == NULL) || (*replay.socket == 0)) {
+        replay.socket = PROXY_SOCKET;
+    }
+
+    while ((opt = getopt_long(argc, argv, "s:x:dh", options, NULL)) >= 0) {
+        switch (opt) {
+        case 's':
+            replay.socket = optarg;
+            break;
+        case 'x':
+            replay.speed = strtod(optarg, NULL);
+            break;
+        case 'd':
+            dump = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    proxy_log_register(&replay.log_handler, log_print);
+
+    err = proxy_mutex_init(&replay.mutex);
+    if (err >= 0) {
+        err = replay_map_resize(&replay.map, REPLAY_MAP_INITIAL);
+    }
+    if (err >= 0) {
+        err = replay_load(&replay, argv[optind]);
+    }
+    if (err >= 0) {
+        if (dump) {
+            replay_dump(&replay);
+        } else {
+            err = replay_prepare(&replay);
+            if (err >= 0) {
+                err = replay_run(&replay);
+            }
+        }
+    }
+
+    proxy_log_deregister(&replay.log_handler);
+
+    return err < 0 ? 1 : 0;
+}
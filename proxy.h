@@ -10,8 +10,18 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* Clients accept a daemon with the same major version and the same or a newer
+ * minor version. A new minor version can add operations and append fields to
+ * answers, but it must not change the existing requests. */
 #define LIBCEPHFSD_MAJOR 0
-#define LIBCEPHFSD_MINOR 2
+#define LIBCEPHFSD_MINOR 14
+
+#define PROXY_SOCKET "/tmp/libcephfsd.sock"
+#define PROXY_SOCKET_ENV "LIBCEPHFSD_SOCKET"
+
+/* Maximum time (in microseconds) that the library spins waiting for an answer
+ * before blocking. */
+#define PROXY_SPIN_ENV "LIBCEPHFSD_SPIN"
 
 #define LIBCEPHFS_TEXT_CLIENT 0x74657874 // 'text'
 #define LIBCEPHFS_LIB_CLIENT 0xe3e5f0e8 // 'ceph' xor 0x80808080
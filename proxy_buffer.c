@@ -108,20 +108,21 @@ static int32_t
 proxy_buffer_load(proxy_buffer_t *buffer, int32_t size)
 {
     void *ptr;
-    int32_t max, err;
-
-    ptr = buffer->data + buffer->pos + buffer->available;
+    int32_t err;
 
-    max = buffer->size - buffer->pos;
-    if (size > max) {
-        memmove(buffer->data, ptr, max - buffer->available);
+    /* Move the pending data to the beginning of the buffer if there isn't
+     * enough space after it. */
+    if (buffer->pos + size > buffer->size) {
+        memmove(buffer->data, buffer->data + buffer->pos, buffer->available);
         buffer->pos = 0;
-        ptr = buffer->data;
     }
 
-    size -= buffer->available;
-    while (size > 0) {
-        err = proxy_buffer_op_read(buffer, ptr, max - buffer->available);
+    /* Read as much as possible, even if more than needed, so that following
+     * reads can be served from the buffer. */
+    ptr = buffer->data + buffer->pos + buffer->available;
+    while (buffer->available < size) {
+        err = proxy_buffer_op_read(buffer, ptr, buffer->size - buffer->pos -
+                                                buffer->available);
         if (err < 0) {
             return err;
         }
@@ -130,7 +131,6 @@ proxy_buffer_load(proxy_buffer_t *buffer, int32_t size)
         }
         ptr += err;
         buffer->available += err;
-        size -= err;
     }
 
     return buffer->available;
@@ -294,6 +294,30 @@ proxy_buffer_read(proxy_buffer_t *buffer, void **pdata, int32_t size)
     return size;
 }
 
+/* Copy up to 'size' bytes of the data already loaded, without reading more. */
+int32_t
+proxy_buffer_take(proxy_buffer_t *buffer, void *data, int32_t size)
+{
+    if (size > buffer->available) {
+        size = buffer->available;
+    }
+    memcpy(data, buffer->data + buffer->pos, size);
+    buffer->pos += size;
+    buffer->available -= size;
+
+    return size;
+}
+
+/* Drop all the data already loaded. */
+void
+proxy_buffer_discard(proxy_buffer_t *buffer)
+{
+    if ((buffer->flags & BUFFER_READ) != 0) {
+        buffer->pos = 0;
+        buffer->available = 0;
+    }
+}
+
 int32_t
 proxy_buffer_read_line(proxy_buffer_t *buffer, char **pline)
 {
@@ -310,10 +334,15 @@ proxy_buffer_read_line(proxy_buffer_t *buffer, char **pline)
                 buffer->available = 0;
                 ignore = true;
             }
-            err = proxy_buffer_load(buffer, 1);
+            len = buffer->available;
+            err = proxy_buffer_load(buffer, len + 1);
             if (err < 0) {
                 return err;
             }
+            if (err == len) {
+                /* No more data. */
+                return -ENODATA;
+            }
 
             ptr = buffer->data + buffer->pos;
         }
@@ -52,6 +52,12 @@ proxy_buffer_write_format(proxy_buffer_t *buffer, const char *fmt, ...);
 int32_t
 proxy_buffer_read(proxy_buffer_t *buffer, void **pdata, int32_t size);
 
+int32_t
+proxy_buffer_take(proxy_buffer_t *buffer, void *data, int32_t size);
+
+void
+proxy_buffer_discard(proxy_buffer_t *buffer);
+
 int32_t
 proxy_buffer_read_line(proxy_buffer_t *buffer, char **pline);
 
@@ -1,6 +1,9 @@
+#include "proxy.h"
 
 #include "proxy_helpers.h"
 
+#include <stdio.h>
+
 #include <openssl/evp.h>
 
 static const char hex_digits[] = "0123456789abcdef";
@@ -78,3 +81,106 @@ proxy_hash_hex(char *digest, size_t size,
 
     return 0;
 }
+
+int32_t
+proxy_thread_affinity(cpu_set_t *cpus)
+{
+    int32_t err;
+
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus);
+    if (err != 0) {
+        return proxy_log(LOG_ERR, err, "Failed to set the CPU affinity");
+    }
+
+    return 0;
+}
+
+/* Parse a CPU list in the same format used by the kernel (i.e. "0-3,8,10-11")
+ * and add the CPUs to the set. */
+int32_t
+proxy_cpus_parse(cpu_set_t *cpus, const char *list)
+{
+    char *end;
+    unsigned long first, last;
+
+    while (*list != 0) {
+        first = strtoul(list, &end, 10);
+        if (end == list) {
+            return proxy_log(LOG_ERR, EINVAL, "Invalid CPU list");
+        }
+        last = first;
+        list = end;
+        if (*list == '-') {
+            list++;
+            last = strtoul(list, &end, 10);
+            if ((end == list) || (last < first)) {
+                return proxy_log(LOG_ERR, EINVAL, "Invalid CPU range");
+            }
+            list = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return proxy_log(LOG_ERR, ERANGE, "CPU number is too big");
+        }
+
+        while (first <= last) {
+            CPU_SET(first, cpus);
+            first++;
+        }
+
+        if (*list == ',') {
+            list++;
+        } else if ((*list != 0) && (*list != '\n')) {
+            return proxy_log(LOG_ERR, EINVAL, "Invalid CPU list");
+        } else {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int32_t
+proxy_cpus_read(cpu_set_t *cpus, const char *path)
+{
+    char list[1024];
+    FILE *f;
+    int32_t err;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return proxy_log(LOG_ERR, errno, "Unable to open a CPU list");
+    }
+
+    err = 0;
+    if (fgets(list, sizeof(list), f) == NULL) {
+        err = proxy_log(LOG_ERR, EIO, "Unable to read a CPU list");
+    }
+
+    fclose(f);
+
+    if (err >= 0) {
+        err = proxy_cpus_parse(cpus, list);
+    }
+
+    return err;
+}
+
+/* Add all the CPUs of a NUMA node to the set. */
+int32_t
+proxy_cpus_node(cpu_set_t *cpus, int32_t node)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+
+    return proxy_cpus_read(cpus, path);
+}
+
+/* Get the set of online NUMA nodes. The kernel uses the same format for node
+ * lists and CPU lists, so a cpu_set_t is used to store the node numbers. */
+int32_t
+proxy_numa_nodes(cpu_set_t *nodes)
+{
+    return proxy_cpus_read(nodes, "/sys/devices/system/node/online");
+}
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -15,11 +16,17 @@
 #define ptr_value(_ptr) ((uint64_t)(uintptr_t)(_ptr))
 #define value_ptr(_val) ((void *)(uintptr_t)(_val))
 
+/* Scrambled values have RANDOM_BITS bits. The remaining 8 high bits hold the
+ * tag of the proxy_random_t that scrambled them, in clear. */
+#define RANDOM_BITS 56
+#define RANDOM_MASK ((1ULL << RANDOM_BITS) - 1)
+
 typedef struct _proxy_random {
     uint64_t mask;
     uint64_t factor;
     uint64_t factor_inv;
     uint64_t shift;
+    uint64_t tag;
 } proxy_random_t;
 
 static inline uint64_t
@@ -40,11 +47,11 @@ random_u64(void)
 }
 
 static inline void
-random_init(proxy_random_t *rnd)
+random_init(proxy_random_t *rnd, uint8_t tag)
 {
     uint64_t inv;
 
-    rnd->mask = random_u64();
+    rnd->mask = random_u64() & RANDOM_MASK;
 
     do {
         rnd->factor = random_u64() | 1;
@@ -58,32 +65,45 @@ random_init(proxy_random_t *rnd)
     rnd->factor_inv = inv * (2 - rnd->factor * inv);
 
     rnd->shift = random_u64();
+    rnd->tag = (uint64_t)tag << RANDOM_BITS;
 }
 
+/* Rotate a RANDOM_BITS value by a number of bits that depends on its number of
+ * bits set, which doesn't change with the rotation itself. */
 static inline uint64_t
-random_scramble(proxy_random_t *rnd, uint64_t value)
+random_rotate(proxy_random_t *rnd, uint64_t value, bool reverse)
 {
     uint32_t bits;
 
-    bits = __builtin_popcountll(value);
-    bits = ((rnd->shift >> bits) | (rnd->shift << (64 - bits))) & 0x3f;
-    value = (value << bits) | (value >> (64 - bits));
+    bits = (rnd->shift >> __builtin_popcountll(value)) % RANDOM_BITS;
+    if (reverse && (bits != 0)) {
+        bits = RANDOM_BITS - bits;
+    }
+    if (bits == 0) {
+        return value;
+    }
+
+    return ((value << bits) | (value >> (RANDOM_BITS - bits))) & RANDOM_MASK;
+}
+
+/* 'value' must fit in RANDOM_BITS. The tag is added to the result. */
+static inline uint64_t
+random_scramble(proxy_random_t *rnd, uint64_t value)
+{
+    value = random_rotate(rnd, value, false);
     value ^= rnd->mask;
 
-    return value * rnd->factor;
+    return ((value * rnd->factor) & RANDOM_MASK) | rnd->tag;
 }
 
+/* The tag of 'value' is ignored. Callers must check it before. */
 static inline uint64_t
 random_unscramble(proxy_random_t *rnd, uint64_t value)
 {
-    uint32_t bits;
-
-    value *= rnd->factor_inv;
+    value = (value * rnd->factor_inv) & RANDOM_MASK;
     value ^= rnd->mask;
-    bits = __builtin_popcountll(value);
-    bits = ((rnd->shift >> bits) | (rnd->shift << (64 - bits))) & 0x3f;
 
-    return (value >> bits) | (value << (64 - bits));
+    return random_rotate(rnd, value, true);
 }
 
 static inline void *
@@ -305,4 +325,16 @@ int32_t
 proxy_hash_hex(char *digest, size_t size,
                int32_t (*feed)(void **, void *, int32_t), void *data);
 
+int32_t
+proxy_thread_affinity(cpu_set_t *cpus);
+
+int32_t
+proxy_cpus_parse(cpu_set_t *cpus, const char *list);
+
+int32_t
+proxy_cpus_node(cpu_set_t *cpus, int32_t node);
+
+int32_t
+proxy_numa_nodes(cpu_set_t *nodes);
+
 #endif
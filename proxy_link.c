@@ -1,13 +1,156 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
 
 #include "proxy_link.h"
+#include "proxy_buffer.h"
+#include "proxy_uring.h"
 #include "proxy_manager.h"
 #include "proxy_helpers.h"
 #include "proxy_log.h"
 
+/* When enabled, each thread that sends or receives messages gets its own
+ * io_uring (see proxy_uring.c), which is released when the thread exits. */
+static bool uring_enabled = false;
+static pthread_key_t uring_key;
+
+static void
+proxy_link_uring_release(void *data)
+{
+    proxy_uring_destroy(data);
+}
+
+int32_t
+proxy_link_uring_enable(void)
+{
+    proxy_uring_t *uring;
+    int32_t err;
+
+    /* Check that io_uring is supported before enabling it. */
+    err = proxy_uring_create(&uring);
+    if (err < 0) {
+        return err;
+    }
+    proxy_uring_destroy(uring);
+
+    err = pthread_key_create(&uring_key, proxy_link_uring_release);
+    if (err != 0) {
+        return proxy_log(LOG_ERR, err, "Failed to create a thread key");
+    }
+
+    uring_enabled = true;
+
+    return 0;
+}
+
+static proxy_uring_t *
+proxy_link_uring(void)
+{
+    proxy_uring_t *uring;
+
+    if (!uring_enabled) {
+        return NULL;
+    }
+
+    uring = pthread_getspecific(uring_key);
+    if (uring == NULL) {
+        if (proxy_uring_create(&uring) < 0) {
+            return NULL;
+        }
+        pthread_setspecific(uring_key, uring);
+    }
+
+    return uring;
+}
+
+/* Adaptive spinning
+ *
+ * Before blocking to wait for the next request or answer, the socket can be
+ * polled without blocking for up to 'spin_max' microseconds. If the message
+ * arrives in that time, the wakeup of the thread is avoided. Each thread keeps
+ * its own budget, which is halved every time the spin is not enough (down to
+ * PROXY_LINK_SPIN_MIN) and doubled every time it succeeds, so that threads
+ * that are mostly idle don't waste CPU time. Spinning is disabled by
+ * default. */
+#define PROXY_LINK_SPIN_MIN 2
+
+static uint32_t spin_max = 0;
+static __thread uint32_t spin_budget = 0;
+
+static uint64_t
+proxy_link_spin_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+void
+proxy_link_spin_set(uint32_t usecs)
+{
+    /* With a single CPU the peer can't make progress while we spin. */
+    if ((usecs > 0) && (sysconf(_SC_NPROCESSORS_ONLN) < 2)) {
+        proxy_log(LOG_WARN, 0, "Spinning disabled on a single CPU system");
+        usecs = 0;
+    }
+
+    spin_max = usecs;
+}
+
+static void
+proxy_link_spin(int32_t sd)
+{
+    proxy_uring_t *uring;
+    uint64_t start, now;
+    ssize_t len;
+    uint32_t budget;
+    char byte;
+
+    if (spin_max == 0) {
+        return;
+    }
+
+    /* The peer can't answer while our own answer is still queued. */
+    uring = proxy_link_uring();
+    if ((uring != NULL) && proxy_uring_pending(uring)) {
+        return;
+    }
+
+    budget = spin_budget;
+    if ((budget == 0) || (budget > spin_max)) {
+        budget = spin_max;
+    }
+
+    start = proxy_link_spin_now();
+    do {
+        len = recv(sd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if ((len >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+            /* Data or an error is ready. Errors are handled by the blocking
+             * read that follows. */
+            if (budget < spin_max / 2) {
+                budget *= 2;
+            } else {
+                budget = spin_max;
+            }
+            spin_budget = budget;
+
+            return;
+        }
+        now = proxy_link_spin_now();
+    } while (now - start < budget);
+
+    budget /= 2;
+    if (budget < PROXY_LINK_SPIN_MIN) {
+        budget = PROXY_LINK_SPIN_MIN;
+    }
+    spin_budget = budget;
+}
+
 static int32_t
 iov_length(struct iovec *iov, int32_t count)
 {
@@ -93,9 +236,59 @@ proxy_link_close(proxy_link_t *link)
     close(link->sd);
 }
 
+static int32_t
+proxy_link_bind(int32_t sd, struct sockaddr_un *addr)
+{
+    struct stat st;
+    int32_t tmp, err;
+
+    if (bind(sd, (struct sockaddr *)addr, sizeof(*addr)) >= 0) {
+        return 0;
+    }
+    if (errno != EADDRINUSE) {
+        return proxy_log(LOG_ERR, errno, "Failed to bind Unix socket");
+    }
+
+    /* The socket file already exists. If nobody is listening on it, it's a
+     * leftover from a previous execution and it can be safely removed. */
+    tmp = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (tmp < 0) {
+        return proxy_log(LOG_ERR, errno, "Failed to create a Unix socket");
+    }
+    err = 0;
+    if (connect(tmp, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        err = errno;
+    }
+    close(tmp);
+
+    if (err != ECONNREFUSED) {
+        return proxy_log(LOG_ERR, EADDRINUSE, "Unix socket is already in use");
+    }
+
+    /* Never remove anything that is not a socket, like a regular file given
+     * by mistake as the path. */
+    if (lstat(addr->sun_path, &st) < 0) {
+        return proxy_log(LOG_ERR, errno, "Failed to check a stale socket");
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        return proxy_log(LOG_ERR, EADDRINUSE,
+                         "Socket path exists and is not a socket");
+    }
+
+    if (unlink(addr->sun_path) < 0) {
+        return proxy_log(LOG_ERR, errno, "Failed to remove a stale socket");
+    }
+
+    if (bind(sd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        return proxy_log(LOG_ERR, errno, "Failed to bind Unix socket");
+    }
+
+    return 0;
+}
+
 int32_t
-proxy_link_server(proxy_link_t *link, const char *path, proxy_link_main_t main,
-                  proxy_link_stop_t stop)
+proxy_link_server(proxy_link_t *link, const char *path, int32_t backlog,
+                  proxy_link_main_t main, proxy_link_stop_t stop)
 {
     struct sockaddr_un addr;
     socklen_t len;
@@ -109,12 +302,12 @@ proxy_link_server(proxy_link_t *link, const char *path, proxy_link_main_t main,
     }
     link->sd = err;
 
-    if (bind(link->sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        err = proxy_log(LOG_ERR, errno, "Failed to bind Unix socket");
+    err = proxy_link_bind(link->sd, &addr);
+    if (err < 0) {
         goto done;
     }
 
-    if (listen(link->sd, SOMAXCONN) < 0) {
+    if (listen(link->sd, backlog) < 0) {
         err = proxy_log(LOG_ERR, errno, "Failed to listen from Unix socket");
         goto done;
     }
@@ -219,8 +412,18 @@ proxy_link_debug_vector(int32_t sd, const char *text, struct iovec *iov,
 int32_t
 proxy_link_read(proxy_link_t *link, int32_t sd, void *buffer, int32_t size)
 {
+    proxy_uring_t *uring;
+    struct iovec iov;
     ssize_t len;
 
+    uring = proxy_link_uring();
+    if ((uring != NULL) && proxy_uring_pending(uring)) {
+        iov.iov_base = buffer;
+        iov.iov_len = size;
+
+        return proxy_uring_flush(uring, sd, &iov, 1);
+    }
+
     do {
         len = read(sd, buffer, size);
 //        proxy_link_debug_buffer(sd, "proxy_link_read", buffer, len);
@@ -271,9 +474,24 @@ proxy_link_write(proxy_link_t *link, int32_t sd, void *buffer, int32_t size)
 int32_t
 proxy_link_send(int32_t sd, struct iovec *iov, int32_t count)
 {
+    proxy_uring_t *uring;
     ssize_t len;
     int32_t total;
 
+    uring = proxy_link_uring();
+    if (uring != NULL) {
+        /* The data is sent along with the next receive, unless it's too big.
+         * In that case, anything queued is sent first to keep the order. */
+        total = proxy_uring_send(uring, sd, iov, count);
+        if (total != -ENOBUFS) {
+            return total;
+        }
+        total = proxy_uring_flush(uring, -1, NULL, 0);
+        if (total < 0) {
+            return total;
+        }
+    }
+
     total = 0;
     while (count > 0) {
 //        proxy_link_debug_vector(sd, "proxy_link_send", iov, count, iov_length(iov, count));
@@ -304,17 +522,28 @@ proxy_link_send(int32_t sd, struct iovec *iov, int32_t count)
 int32_t
 proxy_link_recv(int32_t sd, struct iovec *iov, int32_t count)
 {
+    proxy_uring_t *uring;
     ssize_t len;
     int32_t total;
 
+    uring = proxy_link_uring();
+
     total = 0;
     while (count > 0) {
 //        printf("proxy_link_recv: %d (%d)\n", count, iov_length(iov, count));
-        len = readv(sd, iov, count);
-//        proxy_link_debug_vector(sd, "proxy_link_recv", iov, count, len);
-        if (len < 0) {
-            return proxy_log(LOG_ERR, errno, "Failed to receive data");
+        if ((uring != NULL) && proxy_uring_pending(uring)) {
+            /* Send the queued answer and receive in a single system call. */
+            len = proxy_uring_flush(uring, sd, iov, count);
+            if (len < 0) {
+                return len;
+            }
+        } else {
+            len = readv(sd, iov, count);
+            if (len < 0) {
+                return proxy_log(LOG_ERR, errno, "Failed to receive data");
+            }
         }
+//        proxy_link_debug_vector(sd, "proxy_link_recv", iov, count, len);
         if (len == 0) {
             return proxy_log(LOG_ERR, ENODATA, "Partial read");
         }
@@ -335,8 +564,70 @@ proxy_link_recv(int32_t sd, struct iovec *iov, int32_t count)
     return total;
 }
 
+/* Buffered framing
+ *
+ * When a read-ahead buffer is given, messages are received through it. Each
+ * read takes as much data as is available, so a small message (or several
+ * pipelined ones) is received with a single system call, and the rest of the
+ * message is then taken from the buffer. Data that doesn't fit in the buffer
+ * is received directly into its destination. */
+static int32_t
+proxy_link_fill(int32_t sd, proxy_buffer_t *buffer, struct iovec *iov,
+                int32_t count)
+{
+    void *data;
+    int32_t size, len, total, err;
+
+    if (buffer == NULL) {
+        return proxy_link_recv(sd, iov, count);
+    }
+
+    size = iov_length(iov, count);
+    if (size <= buffer->size) {
+        err = proxy_buffer_read(buffer, &data, size);
+        if (err < 0) {
+            return err;
+        }
+        if (err == 0) {
+            return proxy_log(LOG_ERR, ENODATA, "Partial read");
+        }
+        while (count > 0) {
+            memcpy(iov->iov_base, data, iov->iov_len);
+            data += iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        return size;
+    }
+
+    total = 0;
+    while (count > 0) {
+        len = proxy_buffer_take(buffer, iov->iov_base, iov->iov_len);
+        total += len;
+        if (len < iov->iov_len) {
+            iov->iov_base += len;
+            iov->iov_len -= len;
+            break;
+        }
+        iov++;
+        count--;
+    }
+
+    if (count > 0) {
+        err = proxy_link_recv(sd, iov, count);
+        if (err < 0) {
+            return err;
+        }
+        total += err;
+    }
+
+    return total;
+}
+
 int32_t
-proxy_link_req_send(int32_t sd, int32_t op, struct iovec *iov, int32_t count)
+proxy_link_req_send(int32_t sd, int32_t op, uint32_t flags, uint32_t timeout,
+                    struct iovec *iov, int32_t count)
 {
     proxy_link_req_t *req;
 
@@ -344,21 +635,39 @@ proxy_link_req_send(int32_t sd, int32_t op, struct iovec *iov, int32_t count)
 
     req->header_len = iov[0].iov_len;
     req->op = op;
+    req->flags = flags;
+    req->timeout = timeout;
     req->data_len = iov_length(iov + 1, count - 1);
 
     return proxy_link_send(sd, iov, count);
 }
 
+/* 'sizes' contains the expected header size of each of the 'ops' known
+ * operations. A request of a known operation whose header doesn't have the
+ * expected size is rejected before reading the rest of it.
+ *
+ * Data that doesn't fit in the second iovec is not received. Its iov_base is
+ * set to NULL, and the caller must receive the data with proxy_link_req_data()
+ * before the next request. */
 int32_t
-proxy_link_req_recv(int32_t sd, struct iovec *iov, int32_t count)
+proxy_link_req_recv(int32_t sd, proxy_buffer_t *ahead, struct iovec *iov,
+                    int32_t count, const uint16_t *sizes, uint32_t ops)
 {
     proxy_link_req_t *req;
+    struct iovec *data;
     void *buffer;
     int32_t err, len, total;
 
+    data = &iov[1];
+    buffer = NULL;
+
+    if ((ahead == NULL) || (ahead->available == 0)) {
+        proxy_link_spin(sd);
+    }
+
     len = iov->iov_len;
     iov->iov_len = sizeof(proxy_link_req_t);
-    err = proxy_link_recv(sd, iov, 1);
+    err = proxy_link_fill(sd, ahead, iov, 1);
     if (err < 0) {
         return err;
     }
@@ -366,16 +675,26 @@ proxy_link_req_recv(int32_t sd, struct iovec *iov, int32_t count)
 
     req = iov->iov_base;
 
+    if ((req->header_len < sizeof(proxy_link_req_t)) ||
+        ((req->op < ops) && (sizes[req->op] != 0) &&
+         (req->header_len != sizes[req->op]))) {
+        return proxy_log(LOG_ERR, EPROTO, "Invalid request header size");
+    }
+
+    /* Data sizes are handled as signed 32-bit values. */
+    if (req->data_len > INT32_MAX) {
+        return proxy_log(LOG_ERR, EPROTO, "Invalid request data size");
+    }
+
     if (req->data_len > 0) {
         if (count == 1) {
             return proxy_log(LOG_ERR, ENOBUFS, "Request data is too long");
         }
         if (iov[1].iov_len < req->data_len) {
-            buffer = proxy_malloc(req->data_len);
-            if (buffer == NULL) {
-                return -ENOMEM;
-            }
-            iov[1].iov_base = buffer;
+            iov[1].iov_base = NULL;
+            count = 1;
+        } else {
+            buffer = iov[1].iov_base;
         }
         iov[1].iov_len = req->data_len;
     } else {
@@ -396,7 +715,15 @@ proxy_link_req_recv(int32_t sd, struct iovec *iov, int32_t count)
         }
     }
 
-    err = proxy_link_recv(sd, iov, count);
+    err = proxy_link_fill(sd, ahead, iov, count);
+
+    /* proxy_link_fill() may have advanced the iovec. The caller needs the
+     * original buffer to use it. */
+    if (req->data_len > 0) {
+        data->iov_base = buffer;
+        data->iov_len = req->data_len;
+    }
+
     if (err < 0) {
         return err;
     }
@@ -404,79 +731,179 @@ proxy_link_req_recv(int32_t sd, struct iovec *iov, int32_t count)
     return total + err;
 }
 
+/* Receive the next 'size' bytes of the data of a request that
+ * proxy_link_req_recv() didn't receive. */
 int32_t
-proxy_link_ans_send(int32_t sd, int32_t result, struct iovec *iov,
-                    int32_t count)
+proxy_link_req_data(int32_t sd, proxy_buffer_t *ahead, void *data,
+                    int32_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = data;
+    iov.iov_len = size;
+
+    return proxy_link_fill(sd, ahead, &iov, 1);
+}
+
+int32_t
+proxy_link_ans_send(int32_t sd, int32_t result, uint32_t flags,
+                    struct iovec *iov, int32_t count)
 {
     proxy_link_ans_t *ans;
 
     ans = iov->iov_base;
 
     ans->header_len = iov->iov_len;
-    ans->flags = 0;
+    ans->flags = flags;
     ans->result = result;
     ans->data_len = iov_length(iov + 1, count - 1);
 
     return proxy_link_send(sd, iov, count);
 }
 
+/* If the answer data doesn't fit in the second iovec and its iov_base is NULL,
+ * a buffer of the required size is allocated and stored in it. The caller is
+ * responsible for releasing it.
+ *
+ * An answer split into several parts is returned as if it had been sent in a
+ * single message. Its data must fit in the buffer given by the caller. */
 int32_t
-proxy_link_ans_recv(int32_t sd, struct iovec *iov, int32_t count)
+proxy_link_ans_recv(int32_t sd, proxy_buffer_t *ahead, struct iovec *iov,
+                    int32_t count)
 {
+    uint8_t extra[256];
     proxy_link_ans_t *ans;
-    int32_t err, len, total;
+    struct iovec *data, part, parts[3];
+    void *buffer, *ptr;
+    uint32_t offset;
+    int32_t err, len, total, idx;
+
+    data = &iov[1];
+    idx = 0;
+    buffer = NULL;
+    ptr = (count > 1) ? data->iov_base : NULL;
+    offset = 0;
+    total = 0;
 
-    len = iov->iov_len;
-    iov->iov_len = sizeof(proxy_link_ans_t);
-    err = proxy_link_recv(sd, iov, 1);
-    if (err < 0) {
-        return err;
+    if ((ahead == NULL) || (ahead->available == 0)) {
+        proxy_link_spin(sd);
     }
-    total = err;
 
+    len = iov->iov_len;
     ans = iov->iov_base;
 
+    /* All the parts except the last one only have the common header and a
+     * piece of the data. */
+    while (true) {
+        iov->iov_len = sizeof(proxy_link_ans_t);
+        err = proxy_link_fill(sd, ahead, iov, 1);
+        if (err < 0) {
+            return err;
+        }
+        total += err;
+
+        if ((ans->flags & PROXY_LINK_MORE) == 0) {
+            break;
+        }
+
+        if (ans->header_len != sizeof(proxy_link_ans_t)) {
+            return proxy_log(LOG_ERR, EPROTO, "Invalid answer header size");
+        }
+        if ((ptr == NULL) || (data->iov_len - offset < ans->data_len)) {
+            return proxy_log(LOG_ERR, ENOBUFS, "Answer data is too long");
+        }
+
+        part.iov_base = ptr + offset;
+        part.iov_len = ans->data_len;
+        err = proxy_link_fill(sd, ahead, &part, 1);
+        if (err < 0) {
+            return err;
+        }
+        total += err;
+        offset += ans->data_len;
+    }
+
+    if (ans->header_len < sizeof(proxy_link_ans_t)) {
+        return proxy_log(LOG_ERR, EPROTO, "Invalid answer header size");
+    }
+
     if (ans->data_len > 0) {
-        if ((count == 1) || (iov[1].iov_len < ans->data_len)) {
+        if (count == 1) {
             return proxy_log(LOG_ERR, ENOBUFS, "Answer data is too long");
         }
-        iov[1].iov_len = ans->data_len;
+        if (data->iov_len - offset < ans->data_len) {
+            if (ptr != NULL) {
+                return proxy_log(LOG_ERR, ENOBUFS, "Answer data is too long");
+            }
+            buffer = proxy_malloc(ans->data_len);
+            if (buffer == NULL) {
+                return -ENOMEM;
+            }
+            ptr = buffer;
+        }
+        data->iov_base = ptr + offset;
+        data->iov_len = ans->data_len;
     } else {
         count = 1;
     }
 
-    if (ans->header_len > sizeof(proxy_link_ans_t)) {
-        if (len < ans->header_len) {
-            return proxy_log(LOG_ERR, ENOBUFS, "Answer is too long");
+    /* Fields appended to the answer by a newer daemon are discarded. */
+    if (ans->header_len > len) {
+        if (ans->header_len - len > sizeof(extra)) {
+            err = proxy_log(LOG_ERR, ENOBUFS, "Answer is too long");
+            goto failed;
         }
-        iov->iov_base += sizeof(proxy_link_ans_t);
-        iov->iov_len = ans->header_len - sizeof(proxy_link_ans_t);
-    } else {
-        iov++;
-        count--;
-        if (count == 0) {
-            return total;
+        parts[idx].iov_base = (void *)ans + sizeof(proxy_link_ans_t);
+        parts[idx++].iov_len = len - sizeof(proxy_link_ans_t);
+        parts[idx].iov_base = extra;
+        parts[idx++].iov_len = ans->header_len - len;
+    } else if (ans->header_len > sizeof(proxy_link_ans_t)) {
+        parts[idx].iov_base = (void *)ans + sizeof(proxy_link_ans_t);
+        parts[idx++].iov_len = ans->header_len - sizeof(proxy_link_ans_t);
+    }
+    if (count > 1) {
+        parts[idx++] = *data;
+    }
+
+    if (idx > 0) {
+        err = proxy_link_fill(sd, ahead, parts, idx);
+        if (err < 0) {
+            goto failed;
         }
+        total += err;
     }
 
-    err = proxy_link_recv(sd, iov, count);
-    if (err < 0) {
-        return err;
+    /* proxy_link_fill() may have advanced the iovec. The caller sees the data
+     * of all the parts together. */
+    ans->data_len += offset;
+    if (ans->data_len > 0) {
+        data->iov_base = ptr;
+        data->iov_len = ans->data_len;
     }
 
-    return total + err;
+    return total;
+
+failed:
+    if (buffer != NULL) {
+        data->iov_base = NULL;
+        data->iov_len = 0;
+        proxy_free(buffer);
+    }
+
+    return err;
 }
 
 int32_t
-proxy_link_request(int32_t sd, int32_t op, struct iovec *req_iov,
-                   int32_t req_count, struct iovec *ans_iov, int32_t ans_count)
+proxy_link_request(int32_t sd, proxy_buffer_t *ahead, int32_t op,
+                   struct iovec *req_iov, int32_t req_count,
+                   struct iovec *ans_iov, int32_t ans_count)
 {
     int32_t err;
 
-    err = proxy_link_req_send(sd, op, req_iov, req_count);
+    err = proxy_link_req_send(sd, op, 0, 0, req_iov, req_count);
     if (err < 0) {
         return err;
     }
 
-    return proxy_link_ans_recv(sd, ans_iov, ans_count);
+    return proxy_link_ans_recv(sd, ahead, ans_iov, ans_count);
 }
@@ -12,9 +12,30 @@ struct _proxy_link {
     int32_t sd;
 };
 
+/* Size of the read-ahead buffer used to receive messages. */
+#define PROXY_LINK_BUFFER 16384
+
+/* The sender of the request doesn't wait for an answer. */
+#define PROXY_LINK_ONEWAY 0x0001
+
+/* A previous one-way request failed. Its error code is stored in the upper
+ * byte of the flags (EIO if it doesn't fit). */
+#define PROXY_LINK_DEFERRED 0x0001
+#define PROXY_LINK_DEFERRED_SHIFT 8
+
+/* The answer continues in the next message. Only the last part has the
+ * complete header and the result. */
+#define PROXY_LINK_MORE 0x0002
+
+/* Requests can set a timeout, in milliseconds, for the request to start being
+ * executed once received by the daemon (0 means no timeout). It only applies
+ * to requests that can wait in the daemon before starting, which are the ones
+ * subject to scheduling. */
 typedef struct _proxy_link_req {
     uint16_t header_len;
     uint16_t op;
+    uint16_t flags;
+    uint16_t timeout;
     uint32_t data_len;
 } proxy_link_req_t;
 
@@ -26,6 +47,12 @@ typedef struct _proxy_link_ans {
 } proxy_link_ans_t;
 
 
+void
+proxy_link_spin_set(uint32_t usecs);
+
+int32_t
+proxy_link_uring_enable(void);
+
 int32_t
 proxy_link_client(proxy_link_t *link, const char *path, proxy_link_stop_t stop);
 
@@ -33,8 +60,8 @@ void
 proxy_link_close(proxy_link_t *link);
 
 int32_t
-proxy_link_server(proxy_link_t *link, const char *path, proxy_link_main_t main,
-                  proxy_link_stop_t stop);
+proxy_link_server(proxy_link_t *link, const char *path, int32_t backlog,
+                  proxy_link_main_t main, proxy_link_stop_t stop);
 
 int32_t
 proxy_link_read(proxy_link_t *link, int32_t sd, void *buffer, int32_t size);
@@ -49,20 +76,28 @@ int32_t
 proxy_link_recv(int32_t sd, struct iovec *iov, int32_t count);
 
 int32_t
-proxy_link_req_send(int32_t sd, int32_t op, struct iovec *iov, int32_t count);
+proxy_link_req_send(int32_t sd, int32_t op, uint32_t flags, uint32_t timeout,
+                    struct iovec *iov, int32_t count);
 
 int32_t
-proxy_link_req_recv(int32_t sd, struct iovec *iov, int32_t count);
+proxy_link_req_recv(int32_t sd, proxy_buffer_t *ahead, struct iovec *iov,
+                    int32_t count, const uint16_t *sizes, uint32_t ops);
 
 int32_t
-proxy_link_ans_send(int32_t sd, int32_t result, struct iovec *iov,
-                    int32_t count);
+proxy_link_req_data(int32_t sd, proxy_buffer_t *ahead, void *data,
+                    int32_t size);
 
 int32_t
-proxy_link_ans_recv(int32_t sd, struct iovec *iov, int32_t count);
+proxy_link_ans_send(int32_t sd, int32_t result, uint32_t flags,
+                    struct iovec *iov, int32_t count);
+
+int32_t
+proxy_link_ans_recv(int32_t sd, proxy_buffer_t *ahead, struct iovec *iov,
+                    int32_t count);
 
 int32_t
-proxy_link_request(int32_t sd, int32_t op, struct iovec *req_iov,
-                   int32_t req_count, struct iovec *ans_iov, int32_t ans_count);
+proxy_link_request(int32_t sd, proxy_buffer_t *ahead, int32_t op,
+                   struct iovec *req_iov, int32_t req_count,
+                   struct iovec *ans_iov, int32_t ans_count);
 
 #endif
@@ -22,6 +22,12 @@
          &_ptr->_field != _list; \
          _ptr = list_next_entry(_ptr, _field))
 
+#define list_for_each_entry_safe(_ptr, _tmp, _list, _field) \
+    for (_ptr = list_first_entry(_list, __typeof(*_ptr), _field), \
+         _tmp = list_next_entry(_ptr, _field); \
+         &_ptr->_field != _list; \
+         _ptr = _tmp, _tmp = list_next_entry(_tmp, _field))
+
 static inline void
 list_init(list_t *list)
 {
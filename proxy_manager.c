@@ -173,6 +173,11 @@ proxy_manager_terminate(proxy_manager_t *manager)
 
     proxy_mutex_lock(&manager->mutex);
 
+    /* The main function may have returned because of an error, without a
+     * shutdown request. Make sure the manager thread also terminates. */
+    manager->stop = true;
+    proxy_condition_signal(&manager->condition);
+
     list_for_each_entry(worker, &manager->workers, list) {
         worker->stop = true;
         proxy_thread_kill(worker->tid, SIGCONT);
@@ -57,10 +57,14 @@ typedef struct _proxy_iter {
 typedef struct _proxy_instance_pool {
     pthread_mutex_t mutex;
     list_t hash[256];
+    cpu_set_t *numa;
+    int32_t numa_nodes;
+    int32_t shards;
 } proxy_mount_pool_t;
 
 static proxy_mount_pool_t instance_pool = {
     .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .shards = 1,
 };
 
 /* Ceph client instance sharing
@@ -81,6 +85,13 @@ static proxy_mount_pool_t instance_pool = {
  * they have different values, the proxy won't try to handle these cases. It
  * will consider the configuration as a black box, and only 100% equal
  * configurations will share the Ceph client instance.
+ *
+ * A single Ceph client instance serializes most of the operations through an
+ * internal lock, which can become a bottleneck when many clients use the same
+ * configuration. To avoid it, the proxy can be configured to create up to N
+ * instances (shards) per configuration. New mounts are attached to the shard
+ * with the lowest number of users once all the shards have been created. This
+ * trades memory (each shard has its own cache) for parallelism.
  */
 
 /* Ceph configuration file management
@@ -103,6 +114,82 @@ static proxy_mount_pool_t instance_pool = {
  * the Ceph client instance will be shared.
  */
 
+/* NUMA placement
+ *
+ * Each Ceph client instance has its own cache, which can be quite big. When
+ * NUMA placement is enabled, each instance is assigned to a NUMA node based on
+ * its configuration hash. Shards of the same configuration are spread among
+ * consecutive nodes. The thread that mounts the instance is pinned to the
+ * CPUs of that node before calling `ceph_mount()`, so all the internal threads
+ * created by libcephfs inherit the same affinity, and the cache memory they
+ * allocate is placed on the local node by the default first-touch policy.
+ *
+ * The daemon threads serving clients that mount an already existing instance
+ * are also pinned to the same node. If a single client uses instances assigned
+ * to different nodes, its thread will stay on the node of the last mount.
+ */
+
+/* Set the maximum number of client instances that can be created for the same
+ * configuration. It must be called before any instance is mounted. */
+int32_t
+proxy_mount_shards(int32_t shards)
+{
+    if (shards < 1) {
+        return proxy_log(LOG_ERR, EINVAL, "Invalid number of shards");
+    }
+
+    instance_pool.shards = shards;
+
+    return 0;
+}
+
+/* Enable NUMA placement of client instances. It must be called before any
+ * instance is mounted. */
+int32_t
+proxy_mount_numa(void)
+{
+    cpu_set_t nodes, *cpus;
+    int32_t i, count, err;
+
+    CPU_ZERO(&nodes);
+    err = proxy_numa_nodes(&nodes);
+    if (err < 0) {
+        return err;
+    }
+
+    count = CPU_COUNT(&nodes);
+    if (count < 2) {
+        proxy_log(LOG_INFO, 0, "Only one NUMA node available. NUMA placement "
+                               "is not needed");
+        return 0;
+    }
+
+    cpus = proxy_malloc(sizeof(cpu_set_t) * count);
+    if (cpus == NULL) {
+        return -ENOMEM;
+    }
+
+    count = 0;
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &nodes)) {
+            CPU_ZERO(&cpus[count]);
+            err = proxy_cpus_node(&cpus[count], i);
+            if (err < 0) {
+                proxy_free(cpus);
+                return err;
+            }
+            count++;
+        }
+    }
+
+    instance_pool.numa = cpus;
+    instance_pool.numa_nodes = count;
+
+    proxy_log(LOG_INFO, 0, "NUMA placement enabled on %d nodes", count);
+
+    return 0;
+}
+
 int32_t
 proxy_inode_ref(proxy_mount_t *mount, uint64_t inode)
 {
@@ -726,6 +813,8 @@ proxy_instance_destroy(proxy_instance_t *instance)
         proxy_instance_change_del(instance);
     }
 
+    proxy_sched_destroy(&instance->sched);
+
     proxy_free(instance);
 }
 
@@ -742,9 +831,16 @@ proxy_instance_create(proxy_instance_t **pinstance, const char *id)
         return -ENOMEM;
     }
 
+    err = proxy_sched_init(&instance->sched);
+    if (err < 0) {
+        proxy_free(instance);
+        return err;
+    }
+
     list_init(&instance->siblings);
     list_init(&instance->changes);
     instance->cmount = NULL;
+    instance->node = -1;
     instance->inited = false;
     instance->mounted = false;
 
@@ -920,13 +1016,22 @@ proxy_instance_hash(void **ptr, void *data, int32_t idx)
     return change->size;
 }
 
+/* Pin the current thread to the NUMA node of the instance, if any. */
+static void
+proxy_instance_place(proxy_instance_t *instance)
+{
+    if (instance->node >= 0) {
+        proxy_thread_affinity(&instance_pool.numa[instance->node]);
+    }
+}
+
 static int32_t
 proxy_instance_mount(proxy_instance_t **pinstance)
 {
-    proxy_instance_t *instance, *existing;
+    proxy_instance_t *instance, *existing, *tmp;
     proxy_iter_t iter;
     list_t *list;
-    int32_t err;
+    int32_t shards, err;
 
     instance = *pinstance;
 
@@ -950,21 +1055,40 @@ proxy_instance_mount(proxy_instance_t **pinstance)
 
     if (list->next == NULL) {
         list_init(list);
-    } else {
-        list_for_each_entry(existing, list, list) {
-            if (memcmp(existing->hash, instance->hash, 32) == 0) {
-                list_add(&instance->list, &existing->siblings);
-                goto found;
+    }
+
+    /* Find the least loaded instance with the same configuration. */
+    existing = NULL;
+    shards = 0;
+    list_for_each_entry(tmp, list, list) {
+        if (memcmp(tmp->hash, instance->hash, 32) == 0) {
+            if ((existing == NULL) || (tmp->users < existing->users)) {
+                existing = tmp;
             }
+            shards++;
         }
     }
 
+    if ((existing != NULL) && (shards >= instance_pool.shards)) {
+        list_add(&instance->list, &existing->siblings);
+        existing->users++;
+        proxy_instance_place(existing);
+        goto found;
+    }
+
+    if (instance_pool.numa_nodes > 0) {
+        instance->node = (instance->hash[1] + shards) %
+                         instance_pool.numa_nodes;
+    }
+    proxy_instance_place(instance);
+
     err = ceph_mount(instance->cmount, "/");
     if (err >= 0) {
         err = ceph_ll_lookup_root(instance->cmount, &instance->root);
         if (err >= 0) {
             instance->inited = true;
             instance->mounted = true;
+            instance->users = 1;
             list_add(&instance->list, list);
         } else {
             ceph_unmount(instance->cmount);
@@ -1013,6 +1137,7 @@ proxy_instance_unmount(proxy_instance_t **pinstance)
     } else {
         sibling = list_first_entry(&instance->siblings, proxy_instance_t, list);
         list_del_init(&sibling->list);
+        instance->users--;
     }
 
     proxy_mutex_unlock(&instance_pool.mutex);
@@ -1114,14 +1239,14 @@ proxy_mount_mount(proxy_mount_t *mount, const char *root)
     err = proxy_path_resolve(mount, root, &mount->root, &stx,
                              CEPH_STATX_ALL_STATS, 0, mount->perms, NULL);
     if (err < 0) {
-        proxy_instance_unmount(&mount->instance);
-        return err;
+        goto failed;
     }
 
     mount->cwd_path = proxy_strdup("/");
     if (mount->cwd_path == NULL) {
-        proxy_instance_unmount(&mount->instance);
-        return -ENOMEM;
+        ceph_ll_put(cmount, mount->root);
+        err = -ENOMEM;
+        goto failed;
     }
     mount->cwd_path_len = 1;
 
@@ -1133,6 +1258,14 @@ proxy_mount_mount(proxy_mount_t *mount, const char *root)
     mount->cwd_ino = stx.stx_ino;
 
     return 0;
+
+failed:
+    mount->root = NULL;
+    mount->cwd = NULL;
+
+    proxy_instance_unmount(&mount->instance);
+
+    return err;
 }
 
 int32_t
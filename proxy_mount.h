@@ -4,6 +4,7 @@
 
 #include "proxy.h"
 #include "proxy_list.h"
+#include "proxy_sched.h"
 
 #include <cephfs/libcephfs.h>
 
@@ -14,11 +15,15 @@ typedef struct _proxy_instance {
     list_t changes;
     struct ceph_mount_info *cmount;
     struct Inode *root;
+    proxy_sched_t sched;
+    int32_t node;
+    uint32_t users;
     bool inited;
     bool mounted;
 } proxy_instance_t;
 
 typedef struct _proxy_mount {
+    list_t list;
     proxy_instance_t *instance;
     UserPerm *perms;
     struct Inode *root;
@@ -35,6 +40,12 @@ proxy_cmount(proxy_mount_t *mount)
     return mount->instance->cmount;
 }
 
+int32_t
+proxy_mount_numa(void);
+
+int32_t
+proxy_mount_shards(int32_t shards);
+
 int32_t
 proxy_inode_ref(proxy_mount_t *mount, uint64_t inode);
 
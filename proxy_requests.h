@@ -46,62 +46,170 @@
     CEPH_DATA(_name, _req, _req_count); \
     CEPH_DATA(_name, _ans, _ans_count)
 
-#define CEPH_CALL(_sd, _op, _req, _ans) \
-    proxy_link_request((_sd), _op, _req##_iov, _req##_count, _ans##_iov, \
-                       _ans##_count)
+#define CEPH_CALL(_sd, _ahead, _op, _req, _ans) \
+    proxy_link_request((_sd), (_ahead), _op, _req##_iov, _req##_count, \
+                       _ans##_iov, _ans##_count)
 
 #define CEPH_RET(_sd, _res, _ans) \
-    proxy_link_ans_send((_sd), (_res), _ans##_iov, _ans##_count)
+    proxy_link_ans_send((_sd), (_res), 0, _ans##_iov, _ans##_count)
+
+/* Compact statx encoding
+ *
+ * Instead of sending a full struct ceph_statx, only the fields present in
+ * stx_mask are sent, preceded by the mask itself and the fields that are
+ * always filled (stx_blksize and stx_dev). The fields are stored in the same
+ * order used in the table below, without padding. */
+
+#define PROXY_STATX_SIZE sizeof(struct ceph_statx)
+
+#define PROXY_STATX_FIELD(_mask, _field) \
+    { _mask, offset_of(struct ceph_statx, _field), \
+      sizeof(((struct ceph_statx *)0)->_field) }
+
+typedef struct _proxy_statx_field {
+    uint32_t mask;
+    uint16_t offset;
+    uint16_t size;
+} proxy_statx_field_t;
+
+static inline const proxy_statx_field_t *
+proxy_statx_fields(void)
+{
+    static const proxy_statx_field_t fields[] = {
+        PROXY_STATX_FIELD(0, stx_mask),
+        PROXY_STATX_FIELD(0, stx_blksize),
+        PROXY_STATX_FIELD(0, stx_dev),
+        PROXY_STATX_FIELD(CEPH_STATX_MODE, stx_mode),
+        PROXY_STATX_FIELD(CEPH_STATX_NLINK, stx_nlink),
+        PROXY_STATX_FIELD(CEPH_STATX_UID, stx_uid),
+        PROXY_STATX_FIELD(CEPH_STATX_GID, stx_gid),
+        PROXY_STATX_FIELD(CEPH_STATX_RDEV, stx_rdev),
+        PROXY_STATX_FIELD(CEPH_STATX_ATIME, stx_atime),
+        PROXY_STATX_FIELD(CEPH_STATX_MTIME, stx_mtime),
+        PROXY_STATX_FIELD(CEPH_STATX_CTIME, stx_ctime),
+        PROXY_STATX_FIELD(CEPH_STATX_INO, stx_ino),
+        PROXY_STATX_FIELD(CEPH_STATX_SIZE, stx_size),
+        PROXY_STATX_FIELD(CEPH_STATX_BLOCKS, stx_blocks),
+        PROXY_STATX_FIELD(CEPH_STATX_BTIME, stx_btime),
+        PROXY_STATX_FIELD(CEPH_STATX_VERSION, stx_version),
+        { 0, 0, 0 }
+    };
+
+    return fields;
+}
+
+static inline int32_t
+proxy_statx_encode(void *buffer, const struct ceph_statx *stx)
+{
+    const proxy_statx_field_t *field;
+    int32_t size;
+
+    size = 0;
+    for (field = proxy_statx_fields(); field->size != 0; field++) {
+        if ((field->mask & stx->stx_mask) == field->mask) {
+            memcpy(buffer + size, (const void *)stx + field->offset,
+                   field->size);
+            size += field->size;
+        }
+    }
+
+    return size;
+}
+
+static inline int32_t
+proxy_statx_decode(struct ceph_statx *stx, const void *buffer, int32_t size)
+{
+    const proxy_statx_field_t *field;
+    int32_t pos;
+
+    memset(stx, 0, sizeof(struct ceph_statx));
+
+    pos = 0;
+    for (field = proxy_statx_fields(); field->size != 0; field++) {
+        if ((field->mask & stx->stx_mask) == field->mask) {
+            if (pos + field->size > size) {
+                return -EPROTO;
+            }
+            memcpy((void *)stx + field->offset, buffer + pos, field->size);
+            pos += field->size;
+        }
+    }
+
+    return 0;
+}
+
+#define CEPH_STATX_ADD(_data, _buffer, _stx) \
+    CEPH_BUFF_ADD(_data, _buffer, proxy_statx_encode(_buffer, _stx))
+
+/* Schema of the binary protocol
+ *
+ * Each entry defines an operation code, the name of the CEPH_TYPE() that
+ * describes its request and answer, and the name of the member of proxy_req_t
+ * (and the handler in libcephfsd) that serves it. The enum of operations, the
+ * proxy_req_t union, the table of request sizes and the table of handlers are
+ * all generated from this list. Operation codes are part of the protocol, so
+ * new operations must always be added at the end. */
+#define LIBCEPHFSD_OPS(_op) \
+    _op(VERSION, ceph_version, version) \
+    _op(USERPERM_NEW, ceph_userperm_new, userperm_new) \
+    _op(USERPERM_DESTROY, ceph_userperm_destroy, userperm_destroy) \
+    _op(CREATE, ceph_create, create) \
+    _op(RELEASE, ceph_release, release) \
+    _op(CONF_READ_FILE, ceph_conf_read_file, conf_read_file) \
+    _op(CONF_GET, ceph_conf_get, conf_get) \
+    _op(CONF_SET, ceph_conf_set, conf_set) \
+    _op(INIT, ceph_init, init) \
+    _op(SELECT_FILESYSTEM, ceph_select_filesystem, select_filesystem) \
+    _op(MOUNT, ceph_mount, mount) \
+    _op(UNMOUNT, ceph_unmount, unmount) \
+    _op(LL_STATFS, ceph_ll_statfs, ll_statfs) \
+    _op(LL_LOOKUP, ceph_ll_lookup, ll_lookup) \
+    _op(LL_LOOKUP_INODE, ceph_ll_lookup_inode, ll_lookup_inode) \
+    _op(LL_LOOKUP_ROOT, ceph_ll_lookup_root, ll_lookup_root) \
+    _op(LL_PUT, ceph_ll_put, ll_put) \
+    _op(LL_WALK, ceph_ll_walk, ll_walk) \
+    _op(CHDIR, ceph_chdir, chdir) \
+    _op(GETCWD, ceph_getcwd, getcwd) \
+    _op(READDIR, ceph_readdir, readdir) \
+    _op(REWINDDIR, ceph_rewinddir, rewinddir) \
+    _op(LL_OPEN, ceph_ll_open, ll_open) \
+    _op(LL_CREATE, ceph_ll_create, ll_create) \
+    _op(LL_MKNOD, ceph_ll_mknod, ll_mknod) \
+    _op(LL_CLOSE, ceph_ll_close, ll_close) \
+    _op(LL_RENAME, ceph_ll_rename, ll_rename) \
+    _op(LL_LSEEK, ceph_ll_lseek, ll_lseek) \
+    _op(LL_READ, ceph_ll_read, ll_read) \
+    _op(LL_WRITE, ceph_ll_write, ll_write) \
+    _op(LL_LINK, ceph_ll_link, ll_link) \
+    _op(LL_UNLINK, ceph_ll_unlink, ll_unlink) \
+    _op(LL_GETATTR, ceph_ll_getattr, ll_getattr) \
+    _op(LL_SETATTR, ceph_ll_setattr, ll_setattr) \
+    _op(LL_FALLOCATE, ceph_ll_fallocate, ll_fallocate) \
+    _op(LL_FSYNC, ceph_ll_fsync, ll_fsync) \
+    _op(LL_LISTXATTR, ceph_ll_listxattr, ll_listxattr) \
+    _op(LL_GETXATTR, ceph_ll_getxattr, ll_getxattr) \
+    _op(LL_SETXATTR, ceph_ll_setxattr, ll_setxattr) \
+    _op(LL_REMOVEXATTR, ceph_ll_removexattr, ll_removexattr) \
+    _op(LL_READLINK, ceph_ll_readlink, ll_readlink) \
+    _op(LL_SYMLINK, ceph_ll_symlink, ll_symlink) \
+    _op(LL_OPENDIR, ceph_ll_opendir, ll_opendir) \
+    _op(LL_MKDIR, ceph_ll_mkdir, ll_mkdir) \
+    _op(LL_RMDIR, ceph_ll_rmdir, ll_rmdir) \
+    _op(LL_RELEASEDIR, ceph_ll_releasedir, ll_releasedir) \
+    _op(SESSION, session, session) \
+    _op(LL_GETXATTRS, ceph_ll_getxattrs, ll_getxattrs) \
+    _op(LL_OPENAT, ceph_ll_openat, ll_openat) \
+    _op(LL_CLOSE_PUT, ceph_ll_close_put, ll_close_put) \
+    _op(LL_PUTS, ceph_ll_puts, ll_puts) \
+    _op(LL_COPY_RANGE, ceph_ll_copy_range, ll_copy_range) \
+    _op(CANCEL, cancel, cancel)
+
+#define LIBCEPHFSD_OP_ENUM(_op, _type, _member) LIBCEPHFSD_OP_##_op,
 
 enum {
     LIBCEPHFSD_OP_NULL = 0,
 
-    LIBCEPHFSD_OP_VERSION,
-    LIBCEPHFSD_OP_USERPERM_NEW,
-    LIBCEPHFSD_OP_USERPERM_DESTROY,
-    LIBCEPHFSD_OP_CREATE,
-    LIBCEPHFSD_OP_RELEASE,
-    LIBCEPHFSD_OP_CONF_READ_FILE,
-    LIBCEPHFSD_OP_CONF_GET,
-    LIBCEPHFSD_OP_CONF_SET,
-    LIBCEPHFSD_OP_INIT,
-    LIBCEPHFSD_OP_SELECT_FILESYSTEM,
-    LIBCEPHFSD_OP_MOUNT,
-    LIBCEPHFSD_OP_UNMOUNT,
-    LIBCEPHFSD_OP_LL_STATFS,
-    LIBCEPHFSD_OP_LL_LOOKUP,
-    LIBCEPHFSD_OP_LL_LOOKUP_INODE,
-    LIBCEPHFSD_OP_LL_LOOKUP_ROOT,
-    LIBCEPHFSD_OP_LL_PUT,
-    LIBCEPHFSD_OP_LL_WALK,
-    LIBCEPHFSD_OP_CHDIR,
-    LIBCEPHFSD_OP_GETCWD,
-    LIBCEPHFSD_OP_READDIR,
-    LIBCEPHFSD_OP_REWINDDIR,
-    LIBCEPHFSD_OP_LL_OPEN,
-    LIBCEPHFSD_OP_LL_CREATE,
-    LIBCEPHFSD_OP_LL_MKNOD,
-    LIBCEPHFSD_OP_LL_CLOSE,
-    LIBCEPHFSD_OP_LL_RENAME,
-    LIBCEPHFSD_OP_LL_LSEEK,
-    LIBCEPHFSD_OP_LL_READ,
-    LIBCEPHFSD_OP_LL_WRITE,
-    LIBCEPHFSD_OP_LL_LINK,
-    LIBCEPHFSD_OP_LL_UNLINK,
-    LIBCEPHFSD_OP_LL_GETATTR,
-    LIBCEPHFSD_OP_LL_SETATTR,
-    LIBCEPHFSD_OP_LL_FALLOCATE,
-    LIBCEPHFSD_OP_LL_FSYNC,
-    LIBCEPHFSD_OP_LL_LISTXATTR,
-    LIBCEPHFSD_OP_LL_GETXATTR,
-    LIBCEPHFSD_OP_LL_SETXATTR,
-    LIBCEPHFSD_OP_LL_REMOVEXATTR,
-    LIBCEPHFSD_OP_LL_READLINK,
-    LIBCEPHFSD_OP_LL_SYMLINK,
-    LIBCEPHFSD_OP_LL_OPENDIR,
-    LIBCEPHFSD_OP_LL_MKDIR,
-    LIBCEPHFSD_OP_LL_RMDIR,
-    LIBCEPHFSD_OP_LL_RELEASEDIR,
+    LIBCEPHFSD_OPS(LIBCEPHFSD_OP_ENUM)
 
     LIBCEPHFSD_OP_TOTAL_OPS
 };
@@ -109,12 +217,12 @@ enum {
 #define CEPH_TYPE_REQ(_name, _fields...) \
     struct _proxy_##_name##_req; \
     typedef struct _proxy_##_name##_req proxy_##_name##_req_t; \
-    struct _proxy_##_name##_req { _fields }
+    struct __attribute__((packed)) _proxy_##_name##_req { _fields }
 
 #define CEPH_TYPE_ANS(_name, _fields...) \
     struct _proxy_##_name##_ans; \
     typedef struct _proxy_##_name##_ans proxy_##_name##_ans_t; \
-    struct _proxy_##_name##_ans { _fields }
+    struct __attribute__((packed)) _proxy_##_name##_ans { _fields }
 
 #define FIELDS(_fields...) _fields
 #define REQ(_fields...) FIELDS(proxy_link_req_t header; _fields)
@@ -126,8 +234,29 @@ enum {
     CEPH_TYPE_REQ(_name, _req); \
     CEPH_TYPE_ANS(_name, _ans)
 
+/* A negative 'major' in the answer means that the connection has been refused,
+ * and contains the error code. */
 CEPH_TYPE(hello, FIELDS(uint32_t id;), FIELDS(int16_t major; int16_t minor;));
 
+/* Common prefix of all the requests that refer to a mount. */
+CEPH_TYPE_REQ(cmount, REQ_CMOUNT());
+
+/* 'instance' identifies the run of the daemon. Handles not bound to a session
+ * (UserPerms) remain valid as long as it doesn't change. */
+CEPH_TYPE(session,
+    REQ(uint64_t token;),
+    ANS(
+        uint64_t token;
+        uint64_t instance;
+    )
+);
+
+/* Cancels the request number 'seq' of the connection attached to the session
+ * identified by 'token', if it's still waiting to start. Requests are numbered
+ * from 1 in the order they are sent through each connection, including the
+ * one that negotiates the session. */
+CEPH_TYPE(cancel, REQ(uint64_t token; uint64_t seq;), ANS());
+
 CEPH_TYPE(ceph_version,
     REQ(),
     ANS(
@@ -200,7 +329,7 @@ CEPH_TYPE(ceph_ll_lookup,
 
 CEPH_TYPE(ceph_ll_lookup_inode,
     REQ_CMOUNT(
-        struct inodeno_t ino;
+        uint64_t ino;
     ),
     ANS(
         uint64_t inode;
@@ -211,6 +340,16 @@ CEPH_TYPE(ceph_ll_lookup_root, REQ_CMOUNT(), ANS(uint64_t inode;));
 
 CEPH_TYPE(ceph_ll_put, REQ_CMOUNT(uint64_t inode;), ANS());
 
+/* Data of LIBCEPHFSD_OP_LL_PUTS is an array of 'count' entries. Each one
+ * releases 'count' references of an inode. */
+typedef struct _proxy_put_entry {
+    uint64_t inode;
+    uint32_t count;
+    uint32_t reserved;
+} proxy_put_entry_t;
+
+CEPH_TYPE(ceph_ll_puts, REQ_CMOUNT(uint32_t count;), ANS());
+
 CEPH_TYPE(ceph_ll_walk,
     REQ_CMOUNT(
         uint64_t userperm;
@@ -227,7 +366,7 @@ CEPH_TYPE(ceph_chdir, REQ_CMOUNT(uint16_t path;), ANS());
 
 CEPH_TYPE(ceph_getcwd, REQ_CMOUNT(), ANS(uint16_t path;));
 
-CEPH_TYPE(ceph_readdir, REQ_CMOUNT(uint64_t dir;), ANS(bool eod;));
+CEPH_TYPE(ceph_readdir, REQ_CMOUNT(uint64_t dir;), ANS(uint8_t eod;));
 
 CEPH_TYPE(ceph_rewinddir, REQ_CMOUNT(uint64_t dir;), ANS());
 
@@ -246,7 +385,7 @@ CEPH_TYPE(ceph_ll_create,
     REQ_CMOUNT(
         uint64_t userperm;
         uint64_t parent;
-        mode_t mode;
+        uint32_t mode;
         int32_t oflags;
         uint32_t want;
         uint32_t flags;
@@ -262,8 +401,8 @@ CEPH_TYPE(ceph_ll_mknod,
     REQ_CMOUNT(
         uint64_t userperm;
         uint64_t parent;
-        mode_t mode;
-        dev_t rdev;
+        uint32_t mode;
+        uint64_t rdev;
         uint32_t want;
         uint32_t flags;
         uint16_t name;
@@ -275,6 +414,32 @@ CEPH_TYPE(ceph_ll_mknod,
 
 CEPH_TYPE(ceph_ll_close, REQ_CMOUNT(uint64_t fh;), ANS());
 
+/* Compound of ceph_ll_lookup() + ceph_ll_open(). The answer contains the
+ * statx of the inode after opening it. */
+CEPH_TYPE(ceph_ll_openat,
+    REQ_CMOUNT(
+        uint64_t userperm;
+        uint64_t parent;
+        int32_t oflags;
+        uint32_t want;
+        uint32_t flags;
+        uint16_t name;
+    ),
+    ANS(
+        uint64_t inode;
+        uint64_t fh;
+    )
+);
+
+/* Compound of ceph_ll_close() + ceph_ll_put(). */
+CEPH_TYPE(ceph_ll_close_put,
+    REQ_CMOUNT(
+        uint64_t fh;
+        uint64_t inode;
+    ),
+    ANS()
+);
+
 CEPH_TYPE(ceph_ll_rename,
     REQ_CMOUNT(
         uint64_t userperm;
@@ -289,11 +454,11 @@ CEPH_TYPE(ceph_ll_rename,
 CEPH_TYPE(ceph_ll_lseek,
     REQ_CMOUNT(
         uint64_t fh;
-        off_t offset;
+        int64_t offset;
         int32_t whence;
     ),
     ANS(
-        off_t offset;
+        int64_t offset;
     )
 );
 
@@ -315,6 +480,18 @@ CEPH_TYPE(ceph_ll_write,
     ANS()
 );
 
+/* Copy of data between two open files done inside the daemon. */
+CEPH_TYPE(ceph_ll_copy_range,
+    REQ_CMOUNT(
+        uint64_t src;
+        int64_t src_offset;
+        uint64_t dst;
+        int64_t dst_offset;
+        uint64_t len;
+    ),
+    ANS()
+);
+
 CEPH_TYPE(ceph_ll_link,
     REQ_CMOUNT(
         uint64_t userperm;
@@ -371,14 +548,22 @@ CEPH_TYPE(ceph_ll_fsync,
     ANS()
 );
 
+/* Maximum size of an xattr value or list that libcephfsd transfers. */
+#define PROXY_XATTR_MAX (16 * 1024 * 1024)
+
+/* Size probes (size == 0) of LIBCEPHFSD_OP_LL_LISTXATTR and
+ * LIBCEPHFSD_OP_LL_GETXATTR also return the data if it's not bigger than
+ * 'fetch' bytes, so that the call that follows the probe doesn't need to be
+ * sent to the daemon. */
 CEPH_TYPE(ceph_ll_listxattr,
     REQ_CMOUNT(
         uint64_t userperm;
         uint64_t inode;
-        size_t size;
+        uint64_t size;
+        uint32_t fetch;
     ),
     ANS(
-        size_t size;
+        uint64_t size;
     )
 );
 
@@ -386,17 +571,44 @@ CEPH_TYPE(ceph_ll_getxattr,
     REQ_CMOUNT(
         uint64_t userperm;
         uint64_t inode;
-        size_t size;
+        uint64_t size;
+        uint32_t fetch;
         uint16_t name;
     ),
     ANS()
 );
 
+/* Size of the buffer where libcephfsd builds the answer data of
+ * LIBCEPHFSD_OP_LL_GETXATTRS. Bigger answers fail with ERANGE. */
+#define PROXY_ANSWER_BUFFER 65536
+
+/* Answer data of LIBCEPHFSD_OP_LL_GETXATTRS is a sequence of entries, each one
+ * followed by the name (including the terminating null character) and the
+ * value. If size is negative, it contains the error returned for that xattr and
+ * there's no value. Entries are not aligned. */
+typedef struct _proxy_xattr_entry {
+    uint16_t name_len;
+    uint16_t reserved;
+    int32_t size;
+} proxy_xattr_entry_t;
+
+/* If no names are passed, all the xattrs of the inode are returned. */
+CEPH_TYPE(ceph_ll_getxattrs,
+    REQ_CMOUNT(
+        uint64_t userperm;
+        uint64_t inode;
+        uint32_t names;
+    ),
+    ANS(
+        uint32_t count;
+    )
+);
+
 CEPH_TYPE(ceph_ll_setxattr,
     REQ_CMOUNT(
         uint64_t userperm;
         uint64_t inode;
-        size_t size;
+        uint64_t size;
         int32_t flags;
         uint16_t name;
     ),
@@ -416,7 +628,7 @@ CEPH_TYPE(ceph_ll_readlink,
     REQ_CMOUNT(
         uint64_t userperm;
         uint64_t inode;
-        size_t size;
+        uint64_t size;
     ),
     ANS()
 );
@@ -449,7 +661,7 @@ CEPH_TYPE(ceph_ll_mkdir,
     REQ_CMOUNT(
         uint64_t userperm;
         uint64_t parent;
-        mode_t mode;
+        uint32_t mode;
         uint32_t want;
         uint32_t flags;
         uint16_t name;
@@ -470,55 +682,29 @@ CEPH_TYPE(ceph_ll_rmdir,
 
 CEPH_TYPE(ceph_ll_releasedir, REQ_CMOUNT(uint64_t dir;), ANS());
 
+#define LIBCEPHFSD_OP_MEMBER(_op, _type, _member) \
+    proxy_##_type##_req_t _member;
+
 typedef union _proxy_req {
     proxy_link_req_t header;
 
-    proxy_ceph_version_req_t version;
-    proxy_ceph_userperm_new_req_t userperm_new;
-    proxy_ceph_userperm_destroy_req_t userperm_destroy;
-    proxy_ceph_create_req_t create;
-    proxy_ceph_release_req_t release;
-    proxy_ceph_conf_read_file_req_t conf_read_file;
-    proxy_ceph_conf_get_req_t conf_get;
-    proxy_ceph_conf_set_req_t conf_set;
-    proxy_ceph_init_req_t init;
-    proxy_ceph_select_filesystem_req_t select_filesystem;
-    proxy_ceph_mount_req_t mount;
-    proxy_ceph_unmount_req_t unmount;
-    proxy_ceph_ll_statfs_req_t ll_statfs;
-    proxy_ceph_ll_lookup_req_t ll_lookup;
-    proxy_ceph_ll_lookup_inode_req_t ll_lookup_inode;
-    proxy_ceph_ll_lookup_root_req_t ll_lookup_root;
-    proxy_ceph_ll_put_req_t ll_put;
-    proxy_ceph_ll_walk_req_t ll_walk;
-    proxy_ceph_chdir_req_t chdir;
-    proxy_ceph_getcwd_req_t getcwd;
-    proxy_ceph_readdir_req_t readdir;
-    proxy_ceph_rewinddir_req_t rewinddir;
-    proxy_ceph_ll_open_req_t ll_open;
-    proxy_ceph_ll_create_req_t ll_create;
-    proxy_ceph_ll_mknod_req_t ll_mknod;
-    proxy_ceph_ll_close_req_t ll_close;
-    proxy_ceph_ll_rename_req_t ll_rename;
-    proxy_ceph_ll_lseek_req_t ll_lseek;
-    proxy_ceph_ll_read_req_t ll_read;
-    proxy_ceph_ll_write_req_t ll_write;
-    proxy_ceph_ll_link_req_t ll_link;
-    proxy_ceph_ll_unlink_req_t ll_unlink;
-    proxy_ceph_ll_getattr_req_t ll_getattr;
-    proxy_ceph_ll_setattr_req_t ll_setattr;
-    proxy_ceph_ll_fallocate_req_t ll_fallocate;
-    proxy_ceph_ll_fsync_req_t ll_fsync;
-    proxy_ceph_ll_listxattr_req_t ll_listxattr;
-    proxy_ceph_ll_getxattr_req_t ll_getxattr;
-    proxy_ceph_ll_setxattr_req_t ll_setxattr;
-    proxy_ceph_ll_removexattr_req_t ll_removexattr;
-    proxy_ceph_ll_readlink_req_t ll_readlink;
-    proxy_ceph_ll_symlink_req_t ll_symlink;
-    proxy_ceph_ll_opendir_req_t ll_opendir;
-    proxy_ceph_ll_mkdir_req_t ll_mkdir;
-    proxy_ceph_ll_rmdir_req_t ll_rmdir;
-    proxy_ceph_ll_releasedir_req_t ll_releasedir;
+    LIBCEPHFSD_OPS(LIBCEPHFSD_OP_MEMBER)
 } proxy_req_t;
 
+#define LIBCEPHFSD_OP_SIZE(_op, _type, _member) \
+    [LIBCEPHFSD_OP_##_op] = sizeof(proxy_##_type##_req_t),
+
+/* Size of the request header of each operation. Since the wire types are
+ * packed and only use fixed-width fields, the sizes are the same for all
+ * clients. A size of 0 means that the operation doesn't exist. */
+static inline const uint16_t *
+proxy_req_sizes(void)
+{
+    static const uint16_t sizes[LIBCEPHFSD_OP_TOTAL_OPS] = {
+        LIBCEPHFSD_OPS(LIBCEPHFSD_OP_SIZE)
+    };
+
+    return sizes;
+}
+
 #endif
@@ -0,0 +1,792 @@
+
+#include "proxy_sched.h"
+#include "proxy_helpers.h"
+#include "proxy_log.h"
+
+#include <time.h>
+#include <sys/socket.h>
+
+/* Fair scheduling of requests
+ *
+ * Many client connections can share the same Ceph client instance. To prevent
+ * a single connection from monopolizing it, the number of requests of each
+ * class that can run concurrently on an instance can be limited. When all the
+ * slots are busy, the serving threads wait in a queue ordered by start-time
+ * fair queuing: each connection keeps the virtual finish time of its last
+ * request, and a new request starts at that time (or at the current virtual
+ * time of the instance, if it's later). The finish time advances by the cost
+ * of the request divided by the weight of the user running the connection, so
+ * users with a bigger weight get a bigger share of the instance.
+ *
+ * Independently of the slots, each user can have a token bucket per class that
+ * limits the rate of its requests across all its connections and instances.
+ * A request that exceeds the rate waits until enough tokens are available.
+ *
+ * When the cluster slows down, requests pile up in the queues. To fail fast
+ * instead of accumulating blocked threads, the number of requests waiting in
+ * each queue can be limited (new requests fail with EBUSY), as well as the
+ * time a request can wait for its turn (it fails with EAGAIN).
+ *
+ * Requests can also carry their own deadline. A request that can't start
+ * before it fails with ETIMEDOUT, and a request that is cancelled from another
+ * connection while waiting fails with ECANCELED. In both cases the request is
+ * never passed to libcephfs. Once started, requests always run to completion.
+ *
+ * Users are identified by the uid of the process connected to the daemon.
+ * Processes running as root, like smbd, usually act on behalf of many users,
+ * so their requests are charged to the uid of the credentials (UserPerm) they
+ * carry instead. Requests without credentials (reads, writes, ...) are charged
+ * to the last user seen on the connection. User entries are never removed, so
+ * connections can keep a pointer to them.
+ *
+ * Requests that stream data through the socket release their slot while they
+ * wait for the client, and take it back with priority over the queued requests
+ * to continue, so a slow client doesn't keep others from using the instance.
+ */
+
+#define NSEC 1000000000ULL
+
+/* The sequence number of the current request of a flow and its cancellation
+ * share the same word, so that a request can be started without taking the
+ * mutex of the flow. */
+#define PROXY_FLOW_CANCELLED (1ULL << 63)
+
+typedef struct _proxy_sched_bucket {
+    uint32_t rate;
+    uint32_t burst;
+    int64_t tokens;
+    uint64_t time;
+} proxy_sched_bucket_t;
+
+struct _proxy_sched_user {
+    list_t list;
+    proxy_sched_bucket_t buckets[PROXY_SCHED_CLASSES];
+    uint32_t uid;
+    uint32_t weight;
+};
+
+typedef struct _proxy_sched_waiter {
+    list_t list;
+    pthread_cond_t condition;
+    uint64_t start;
+    bool ready;
+} proxy_sched_waiter_t;
+
+static const char *sched_classes[PROXY_SCHED_CLASSES] = {
+    [PROXY_SCHED_META] = "meta",
+    [PROXY_SCHED_DATA] = "data"
+};
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list_t sched_users = LIST_INIT(&sched_users);
+
+/* A value of 0 means that there's no limit. */
+static uint32_t sched_slots[PROXY_SCHED_CLASSES];
+static uint32_t sched_queue_max;
+static uint32_t sched_queue_timeout;
+
+/* Number of token buckets with a rate limit. */
+static uint32_t sched_limits;
+
+static uint64_t
+proxy_sched_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * NSEC + now.tv_nsec;
+}
+
+static void
+proxy_sched_timespec(uint64_t time, struct timespec *ts)
+{
+    ts->tv_sec = time / NSEC;
+    ts->tv_nsec = time % NSEC;
+}
+
+/* Initialize a condition variable that uses the monotonic clock for timed
+ * waits. */
+static int32_t
+proxy_sched_condition_init(pthread_cond_t *condition)
+{
+    pthread_condattr_t attr;
+    int32_t err;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    err = pthread_cond_init(condition, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (err != 0) {
+        return proxy_log(LOG_ERR, err,
+                         "Failed to initialize a condition variable");
+    }
+
+    return 0;
+}
+
+static uint64_t
+proxy_sched_cost(uint64_t size)
+{
+    return 1 + size / PROXY_SCHED_UNIT;
+}
+
+int32_t
+proxy_sched_class(const char *name)
+{
+    int32_t class;
+
+    for (class = PROXY_SCHED_META; class < PROXY_SCHED_CLASSES; class++) {
+        if (strcmp(sched_classes[class], name) == 0) {
+            return class;
+        }
+    }
+
+    return proxy_log(LOG_ERR, EINVAL, "Invalid request class");
+}
+
+const char *
+proxy_sched_class_name(int32_t class)
+{
+    return sched_classes[class];
+}
+
+/* Set the maximum number of requests of a class that can run concurrently on
+ * each Ceph client instance. It can be changed at any time. */
+int32_t
+proxy_sched_slots_set(int32_t class, uint32_t slots)
+{
+    __atomic_store_n(&sched_slots[class], slots, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+uint32_t
+proxy_sched_slots_get(int32_t class)
+{
+    return __atomic_load_n(&sched_slots[class], __ATOMIC_RELAXED);
+}
+
+/* Check if slots or rate limits are configured. If not, requests don't need to
+ * be charged to any user nor queued. */
+bool
+proxy_sched_active(void)
+{
+    int32_t class;
+
+    for (class = 0; class < PROXY_SCHED_CLASSES; class++) {
+        if (proxy_sched_slots_get(class) > 0) {
+            return true;
+        }
+    }
+
+    return __atomic_load_n(&sched_limits, __ATOMIC_RELAXED) > 0;
+}
+
+/* Set the maximum number of requests waiting in each queue, and the maximum
+ * time in milliseconds a request can wait (0 means no limit). */
+int32_t
+proxy_sched_queue_set(uint32_t max, uint32_t timeout)
+{
+    __atomic_store_n(&sched_queue_max, max, __ATOMIC_RELAXED);
+    __atomic_store_n(&sched_queue_timeout, timeout, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void
+proxy_sched_queue_get(uint32_t *max, uint32_t *timeout)
+{
+    *max = __atomic_load_n(&sched_queue_max, __ATOMIC_RELAXED);
+    *timeout = __atomic_load_n(&sched_queue_timeout, __ATOMIC_RELAXED);
+}
+
+/* Must be called with sched_mutex held. */
+static proxy_sched_user_t *
+proxy_sched_user(uint32_t uid)
+{
+    proxy_sched_user_t *user;
+
+    list_for_each_entry(user, &sched_users, list) {
+        if (user->uid == uid) {
+            return user;
+        }
+    }
+
+    user = proxy_malloc(sizeof(proxy_sched_user_t));
+    if (user == NULL) {
+        return NULL;
+    }
+
+    memset(user->buckets, 0, sizeof(user->buckets));
+    user->uid = uid;
+    user->weight = 1;
+    list_add_tail(&user->list, &sched_users);
+
+    return user;
+}
+
+int32_t
+proxy_sched_weight(uint32_t uid, uint32_t weight)
+{
+    proxy_sched_user_t *user;
+
+    if ((weight == 0) || (weight > PROXY_SCHED_WEIGHT_MAX)) {
+        return proxy_log(LOG_ERR, EINVAL, "Invalid weight");
+    }
+
+    proxy_mutex_lock(&sched_mutex);
+
+    user = proxy_sched_user(uid);
+    if (user != NULL) {
+        __atomic_store_n(&user->weight, weight, __ATOMIC_RELAXED);
+    }
+
+    proxy_mutex_unlock(&sched_mutex);
+
+    return (user != NULL) ? 0 : -ENOMEM;
+}
+
+/* Limit the requests of a class of a user to 'rate' units per second, with
+ * bursts of up to 'burst' units. A rate of 0 removes the limit. */
+int32_t
+proxy_sched_limit(uint32_t uid, int32_t class, uint32_t rate, uint32_t burst)
+{
+    proxy_sched_user_t *user;
+    proxy_sched_bucket_t *bucket;
+
+    if ((rate > PROXY_SCHED_RATE_MAX) || (burst > PROXY_SCHED_RATE_MAX)) {
+        return proxy_log(LOG_ERR, EINVAL, "Invalid limit");
+    }
+    if (burst == 0) {
+        burst = rate;
+    }
+
+    proxy_mutex_lock(&sched_mutex);
+
+    user = proxy_sched_user(uid);
+    if (user != NULL) {
+        bucket = &user->buckets[class];
+        if ((bucket->rate == 0) != (rate == 0)) {
+            __atomic_store_n(&sched_limits,
+                             sched_limits + ((rate > 0) ? 1 : -1),
+                             __ATOMIC_RELAXED);
+        }
+        bucket->burst = burst;
+        bucket->tokens = burst * NSEC;
+        bucket->time = proxy_sched_now();
+        __atomic_store_n(&bucket->rate, rate, __ATOMIC_RELAXED);
+    }
+
+    proxy_mutex_unlock(&sched_mutex);
+
+    return (user != NULL) ? 0 : -ENOMEM;
+}
+
+/* Get the configuration of the user at position 'index'. Returns -ENOENT
+ * once there are no more users. */
+int32_t
+proxy_sched_user_get(uint32_t index, proxy_sched_info_t *info)
+{
+    proxy_sched_user_t *user;
+    int32_t class, err;
+
+    err = -ENOENT;
+
+    proxy_mutex_lock(&sched_mutex);
+
+    list_for_each_entry(user, &sched_users, list) {
+        if (index-- == 0) {
+            info->uid = user->uid;
+            info->weight = user->weight;
+            for (class = 0; class < PROXY_SCHED_CLASSES; class++) {
+                info->rate[class] = user->buckets[class].rate;
+                info->burst[class] = user->buckets[class].burst;
+            }
+            err = 0;
+            break;
+        }
+    }
+
+    proxy_mutex_unlock(&sched_mutex);
+
+    return err;
+}
+
+int32_t
+proxy_sched_init(proxy_sched_t *sched)
+{
+    int32_t class;
+
+    for (class = 0; class < PROXY_SCHED_CLASSES; class++) {
+        list_init(&sched->waiting[class]);
+        sched->vtime[class] = 0;
+        sched->active[class] = 0;
+        sched->queued[class] = 0;
+    }
+
+    return proxy_mutex_init(&sched->mutex);
+}
+
+void
+proxy_sched_destroy(proxy_sched_t *sched)
+{
+    pthread_mutex_destroy(&sched->mutex);
+}
+
+/* Initialize the scheduling state of the connection 'sd'. */
+int32_t
+proxy_flow_init(proxy_flow_t *flow, int32_t sd)
+{
+    struct ucred cred;
+    socklen_t len;
+    int32_t err;
+
+    len = sizeof(cred);
+    if (getsockopt(sd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        return proxy_log(LOG_ERR, errno, "Failed to get the peer credentials");
+    }
+
+    proxy_mutex_lock(&sched_mutex);
+    flow->user = proxy_sched_user(cred.uid);
+    proxy_mutex_unlock(&sched_mutex);
+
+    if (flow->user == NULL) {
+        return -ENOMEM;
+    }
+
+    err = proxy_mutex_init(&flow->mutex);
+    if (err < 0) {
+        return err;
+    }
+
+    err = proxy_sched_condition_init(&flow->condition);
+    if (err < 0) {
+        pthread_mutex_destroy(&flow->mutex);
+        return err;
+    }
+
+    memset(flow->finish, 0, sizeof(flow->finish));
+    flow->sched = NULL;
+    flow->waiting = NULL;
+    flow->seq = 0;
+    flow->deadline = 0;
+    flow->shared = cred.uid == 0;
+
+    return 0;
+}
+
+void
+proxy_flow_destroy(proxy_flow_t *flow)
+{
+    pthread_cond_destroy(&flow->condition);
+    pthread_mutex_destroy(&flow->mutex);
+}
+
+/* Charge the next requests of a shared connection to the user 'uid'. Other
+ * connections are always charged to the user of the connected process. */
+int32_t
+proxy_flow_user(proxy_flow_t *flow, uint32_t uid)
+{
+    proxy_sched_user_t *user;
+
+    if (!flow->shared || (flow->user->uid == uid)) {
+        return 0;
+    }
+
+    proxy_mutex_lock(&sched_mutex);
+    user = proxy_sched_user(uid);
+    proxy_mutex_unlock(&sched_mutex);
+
+    if (user == NULL) {
+        return -ENOMEM;
+    }
+
+    flow->user = user;
+
+    return 0;
+}
+
+/* Prepare the flow for the request with sequence number 'seq', which must
+ * start within 'timeout' milliseconds (0 means no deadline). */
+void
+proxy_flow_start(proxy_flow_t *flow, uint64_t seq, uint32_t timeout)
+{
+    flow->deadline = 0;
+    if (timeout > 0) {
+        flow->deadline = proxy_sched_now() + timeout * 1000000ULL;
+    }
+
+    __atomic_store_n(&flow->seq, seq & ~PROXY_FLOW_CANCELLED,
+                     __ATOMIC_RELEASE);
+}
+
+/* Cancel the request with sequence number 'seq' if it's the current request
+ * of the flow. If it's waiting for tokens or for a slot, it's woken up to fail.
+ * A request that is already running is not affected. Called from the thread
+ * of another connection. Returns -ENOENT if the request is not current. */
+int32_t
+proxy_flow_cancel(proxy_flow_t *flow, uint64_t seq)
+{
+    uint64_t current;
+
+    seq &= ~PROXY_FLOW_CANCELLED;
+    current = seq;
+
+    proxy_mutex_lock(&flow->mutex);
+
+    if (!__atomic_compare_exchange_n(&flow->seq, &current,
+                                     seq | PROXY_FLOW_CANCELLED, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        proxy_mutex_unlock(&flow->mutex);
+        return -ENOENT;
+    }
+
+    proxy_condition_signal(&flow->condition);
+
+    /* The scheduler can't be destroyed while the flow points to it, because
+     * the request is still in proxy_sched_enter(). */
+    if (flow->sched != NULL) {
+        proxy_mutex_lock(&flow->sched->mutex);
+        if (flow->waiting != NULL) {
+            proxy_condition_signal(flow->waiting);
+        }
+        proxy_mutex_unlock(&flow->sched->mutex);
+    }
+
+    proxy_mutex_unlock(&flow->mutex);
+
+    return 0;
+}
+
+static bool
+proxy_flow_cancelled(proxy_flow_t *flow)
+{
+    return (__atomic_load_n(&flow->seq, __ATOMIC_ACQUIRE) &
+            PROXY_FLOW_CANCELLED) != 0;
+}
+
+/* Check if the current request can still be started. */
+int32_t
+proxy_flow_check(proxy_flow_t *flow)
+{
+    if (proxy_flow_cancelled(flow)) {
+        return -ECANCELED;
+    }
+
+    if ((flow->deadline > 0) && (proxy_sched_now() > flow->deadline)) {
+        return -ETIMEDOUT;
+    }
+
+    return 0;
+}
+
+/* Wait until 'time', unless the current request is cancelled. */
+static int32_t
+proxy_flow_sleep(proxy_flow_t *flow, uint64_t time)
+{
+    struct timespec ts;
+    int32_t err;
+
+    proxy_sched_timespec(time, &ts);
+
+    err = 0;
+
+    proxy_mutex_lock(&flow->mutex);
+
+    while (!proxy_flow_cancelled(flow) && (err != ETIMEDOUT)) {
+        err = pthread_cond_timedwait(&flow->condition, &flow->mutex, &ts);
+        if ((err != 0) && (err != ETIMEDOUT)) {
+            proxy_abort(err, "Condition variable cannot be waited");
+        }
+    }
+
+    err = proxy_flow_cancelled(flow) ? -ECANCELED : 0;
+
+    proxy_mutex_unlock(&flow->mutex);
+
+    return err;
+}
+
+/* Wait until the token bucket of the user has enough tokens for a request.
+ * The tokens are taken in advance, so concurrent requests of the same user
+ * wait for consecutive periods. Returns -ETIMEDOUT or -EAGAIN, without
+ * waiting, if the request would miss its deadline or wait longer than the
+ * queue timeout, and -ECANCELED if it's cancelled while waiting. */
+int32_t
+proxy_flow_throttle(proxy_flow_t *flow, int32_t class, uint64_t size)
+{
+    proxy_sched_bucket_t *bucket;
+    uint64_t now, wait, elapsed, cost, timeout;
+    int64_t max;
+    int32_t err;
+
+    bucket = &flow->user->buckets[class];
+    if (__atomic_load_n(&bucket->rate, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+
+    timeout = __atomic_load_n(&sched_queue_timeout, __ATOMIC_RELAXED);
+    cost = proxy_sched_cost(size) * NSEC;
+    now = proxy_sched_now();
+    wait = 0;
+    err = 0;
+
+    proxy_mutex_lock(&sched_mutex);
+
+    if (bucket->rate > 0) {
+        max = bucket->burst * NSEC;
+        elapsed = now - bucket->time;
+        if (elapsed >= (uint64_t)(max - bucket->tokens) / bucket->rate) {
+            bucket->tokens = max;
+        } else {
+            bucket->tokens += elapsed * bucket->rate;
+        }
+        bucket->time = now;
+
+        bucket->tokens -= cost;
+        if (bucket->tokens < 0) {
+            wait = -bucket->tokens / bucket->rate;
+            if ((flow->deadline > 0) && (now + wait > flow->deadline)) {
+                err = -ETIMEDOUT;
+            } else if ((timeout > 0) && (wait > timeout * 1000000ULL)) {
+                err = -EAGAIN;
+            }
+            if (err < 0) {
+                bucket->tokens += cost;
+                wait = 0;
+            }
+        }
+    }
+
+    proxy_mutex_unlock(&sched_mutex);
+
+    if (wait > 0) {
+        err = proxy_flow_sleep(flow, now + wait);
+        if (err < 0) {
+            /* A cancelled request returns its tokens, since it won't run. */
+            proxy_mutex_lock(&sched_mutex);
+            max = bucket->burst * NSEC;
+            bucket->tokens += cost;
+            if (bucket->tokens > max) {
+                bucket->tokens = max;
+            }
+            proxy_mutex_unlock(&sched_mutex);
+        }
+    }
+
+    return err;
+}
+
+/* Grant free slots to the waiting requests with the earliest start times.
+ * Must be called with the mutex of the scheduler held. */
+static void
+proxy_sched_dispatch(proxy_sched_t *sched, int32_t class)
+{
+    proxy_sched_waiter_t *waiter;
+    uint32_t slots;
+
+    slots = proxy_sched_slots_get(class);
+    while (!list_empty(&sched->waiting[class]) &&
+           ((slots == 0) || (sched->active[class] < slots))) {
+        waiter = list_first_entry(&sched->waiting[class],
+                                  proxy_sched_waiter_t, list);
+        list_del(&waiter->list);
+        sched->queued[class]--;
+
+        sched->active[class]++;
+        if (waiter->start > sched->vtime[class]) {
+            sched->vtime[class] = waiter->start;
+        }
+
+        waiter->ready = true;
+        proxy_condition_signal(&waiter->condition);
+    }
+}
+
+/* Wait in the queue until the request gets a slot, the queue timeout or the
+ * deadline of the request expires, or the request is cancelled. Must be called
+ * with the mutex of the scheduler held. */
+static int32_t
+proxy_sched_wait(proxy_sched_t *sched, proxy_flow_t *flow, int32_t class,
+                 uint64_t start)
+{
+    proxy_sched_waiter_t waiter, *item;
+    struct timespec ts;
+    uint64_t limit;
+    int32_t err;
+
+    limit = __atomic_load_n(&sched_queue_timeout, __ATOMIC_RELAXED);
+    if (limit > 0) {
+        limit = proxy_sched_now() + limit * 1000000ULL;
+    }
+    if ((flow->deadline > 0) && ((limit == 0) || (flow->deadline < limit))) {
+        limit = flow->deadline;
+    }
+    proxy_sched_timespec(limit, &ts);
+
+    err = proxy_sched_condition_init(&waiter.condition);
+    if (err < 0) {
+        return err;
+    }
+
+    waiter.start = start;
+    waiter.ready = false;
+
+    /* Requests with the same start time are served in arrival order. */
+    list_for_each_entry(item, &sched->waiting[class], list) {
+        if (item->start > start) {
+            break;
+        }
+    }
+    list_add_tail(&waiter.list, &item->list);
+    sched->queued[class]++;
+
+    flow->waiting = &waiter.condition;
+
+    while (!waiter.ready && (err == 0)) {
+        if (proxy_flow_cancelled(flow)) {
+            err = -ECANCELED;
+        } else if (limit == 0) {
+            proxy_condition_wait(&waiter.condition, &sched->mutex);
+        } else {
+            err = pthread_cond_timedwait(&waiter.condition, &sched->mutex,
+                                         &ts);
+            if (err == ETIMEDOUT) {
+                err = (limit == flow->deadline) ? -ETIMEDOUT : -EAGAIN;
+            } else if (err != 0) {
+                proxy_abort(err, "Condition variable cannot be waited");
+            }
+        }
+    }
+
+    flow->waiting = NULL;
+
+    /* A slot granted at the same time the wait failed is still taken. */
+    if (waiter.ready) {
+        err = 0;
+    } else {
+        list_del(&waiter.list);
+        sched->queued[class]--;
+    }
+
+    pthread_cond_destroy(&waiter.condition);
+
+    return err;
+}
+
+/* Wait for a free slot of the given class in the instance. Returns 1 once the
+ * request can run, and proxy_sched_leave() must be called when it completes.
+ * Returns 0 if slots are not limited, -EBUSY if the queue is full, -EAGAIN if
+ * the request waited too long, -ETIMEDOUT if its deadline expired, or
+ * -ECANCELED if it was cancelled. */
+int32_t
+proxy_sched_enter(proxy_sched_t *sched, proxy_flow_t *flow, int32_t class,
+                  uint64_t size)
+{
+    uint64_t start, finish, weight;
+    uint32_t slots, max;
+    int32_t err;
+
+    slots = proxy_sched_slots_get(class);
+    if (slots == 0) {
+        return 0;
+    }
+
+    weight = __atomic_load_n(&flow->user->weight, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&sched_queue_max, __ATOMIC_RELAXED);
+
+    proxy_mutex_lock(&flow->mutex);
+    flow->sched = sched;
+    proxy_mutex_unlock(&flow->mutex);
+
+    proxy_mutex_lock(&sched->mutex);
+
+    start = flow->finish[class];
+    if (start < sched->vtime[class]) {
+        start = sched->vtime[class];
+    }
+    finish = start + proxy_sched_cost(size) * PROXY_SCHED_WEIGHT_MAX / weight;
+
+    err = 1;
+    if ((sched->active[class] < slots) &&
+        list_empty(&sched->waiting[class])) {
+        sched->active[class]++;
+        if (start > sched->vtime[class]) {
+            sched->vtime[class] = start;
+        }
+    } else if ((max > 0) && (sched->queued[class] >= max)) {
+        err = -EBUSY;
+    } else {
+        err = proxy_sched_wait(sched, flow, class, start);
+        if (err == 0) {
+            err = 1;
+        }
+    }
+
+    /* Rejected requests are not charged to the connection. */
+    if (err > 0) {
+        flow->finish[class] = finish;
+    }
+
+    proxy_mutex_unlock(&sched->mutex);
+
+    proxy_mutex_lock(&flow->mutex);
+    flow->sched = NULL;
+    proxy_mutex_unlock(&flow->mutex);
+
+    return err;
+}
+
+/* Take back a slot released with proxy_sched_leave() by a request that is
+ * still running. The request has already been admitted, so it goes before all
+ * the queued requests, and it can't fail because of timeouts or cancellation.
+ */
+int32_t
+proxy_sched_resume(proxy_sched_t *sched, int32_t class)
+{
+    proxy_sched_waiter_t waiter;
+    uint32_t slots;
+    int32_t err;
+
+    slots = proxy_sched_slots_get(class);
+
+    proxy_mutex_lock(&sched->mutex);
+
+    if ((slots == 0) || (sched->active[class] < slots)) {
+        sched->active[class]++;
+        proxy_mutex_unlock(&sched->mutex);
+
+        return 0;
+    }
+
+    err = proxy_condition_init(&waiter.condition);
+    if (err >= 0) {
+        waiter.start = sched->vtime[class];
+        waiter.ready = false;
+        list_add(&waiter.list, &sched->waiting[class]);
+        sched->queued[class]++;
+
+        while (!waiter.ready) {
+            proxy_condition_wait(&waiter.condition, &sched->mutex);
+        }
+
+        pthread_cond_destroy(&waiter.condition);
+    }
+
+    proxy_mutex_unlock(&sched->mutex);
+
+    return err;
+}
+
+void
+proxy_sched_leave(proxy_sched_t *sched, int32_t class)
+{
+    proxy_mutex_lock(&sched->mutex);
+
+    sched->active[class]--;
+    proxy_sched_dispatch(sched, class);
+
+    proxy_mutex_unlock(&sched->mutex);
+}
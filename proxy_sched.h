@@ -0,0 +1,132 @@
+
+#ifndef __LIBCEPHFSD_PROXY_SCHED_H__
+#define __LIBCEPHFSD_PROXY_SCHED_H__
+
+#include "proxy.h"
+#include "proxy_list.h"
+
+#include <pthread.h>
+
+/* Each request costs one unit, plus one unit for every PROXY_SCHED_UNIT bytes
+ * of data it transfers. */
+#define PROXY_SCHED_UNIT 65536
+
+/* Maximum weight of a user, and maximum rate and burst of a limit. */
+#define PROXY_SCHED_WEIGHT_MAX 1000
+#define PROXY_SCHED_RATE_MAX 1000000
+
+/* Requests are scheduled separately for each class, so big data transfers
+ * don't delay metadata requests of other users. */
+enum {
+    PROXY_SCHED_NONE = 0,
+    PROXY_SCHED_META,
+    PROXY_SCHED_DATA,
+    PROXY_SCHED_CLASSES
+};
+
+struct _proxy_sched_user;
+typedef struct _proxy_sched_user proxy_sched_user_t;
+
+/* Admission of requests into a Ceph client instance. */
+typedef struct _proxy_sched {
+    pthread_mutex_t mutex;
+    list_t waiting[PROXY_SCHED_CLASSES];
+    uint64_t vtime[PROXY_SCHED_CLASSES];
+    uint32_t active[PROXY_SCHED_CLASSES];
+    uint32_t queued[PROXY_SCHED_CLASSES];
+} proxy_sched_t;
+
+/* Scheduling state of a client connection. The sequence number of the current
+ * request is updated atomically, and its highest bit marks it as cancelled.
+ * The mutex serializes cancellations and protects the pointers to the
+ * scheduler and the condition where it's waiting, so that it can be woken up
+ * from another thread. Connections from root serve many users (like smbd),
+ * so their requests are charged to the user of their credentials ('shared'). */
+typedef struct _proxy_flow {
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    proxy_sched_user_t *user;
+    proxy_sched_t *sched;
+    pthread_cond_t *waiting;
+    uint64_t seq;
+    uint64_t deadline;
+    uint64_t finish[PROXY_SCHED_CLASSES];
+    bool shared;
+} proxy_flow_t;
+
+/* Configuration of a user, as returned by proxy_sched_user_get(). */
+typedef struct _proxy_sched_info {
+    uint32_t uid;
+    uint32_t weight;
+    uint32_t rate[PROXY_SCHED_CLASSES];
+    uint32_t burst[PROXY_SCHED_CLASSES];
+} proxy_sched_info_t;
+
+int32_t
+proxy_sched_class(const char *name);
+
+const char *
+proxy_sched_class_name(int32_t class);
+
+int32_t
+proxy_sched_slots_set(int32_t class, uint32_t slots);
+
+uint32_t
+proxy_sched_slots_get(int32_t class);
+
+bool
+proxy_sched_active(void);
+
+int32_t
+proxy_sched_queue_set(uint32_t max, uint32_t timeout);
+
+void
+proxy_sched_queue_get(uint32_t *max, uint32_t *timeout);
+
+int32_t
+proxy_sched_weight(uint32_t uid, uint32_t weight);
+
+int32_t
+proxy_sched_limit(uint32_t uid, int32_t class, uint32_t rate, uint32_t burst);
+
+int32_t
+proxy_sched_user_get(uint32_t index, proxy_sched_info_t *info);
+
+int32_t
+proxy_sched_init(proxy_sched_t *sched);
+
+void
+proxy_sched_destroy(proxy_sched_t *sched);
+
+int32_t
+proxy_flow_init(proxy_flow_t *flow, int32_t sd);
+
+void
+proxy_flow_destroy(proxy_flow_t *flow);
+
+void
+proxy_flow_start(proxy_flow_t *flow, uint64_t seq, uint32_t timeout);
+
+int32_t
+proxy_flow_user(proxy_flow_t *flow, uint32_t uid);
+
+int32_t
+proxy_flow_cancel(proxy_flow_t *flow, uint64_t seq);
+
+int32_t
+proxy_flow_check(proxy_flow_t *flow);
+
+int32_t
+proxy_flow_throttle(proxy_flow_t *flow, int32_t class, uint64_t size);
+
+int32_t
+proxy_sched_enter(proxy_sched_t *sched, proxy_flow_t *flow, int32_t class,
+                  uint64_t size);
+
+int32_t
+proxy_sched_resume(proxy_sched_t *sched, int32_t class);
+
+void
+proxy_sched_leave(proxy_sched_t *sched, int32_t class);
+
+#endif
@@ -0,0 +1,169 @@
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "proxy_trace.h"
+#include "proxy_helpers.h"
+#include "proxy_log.h"
+
+/* Binary request tracing
+ *
+ * The trace is stored in a preallocated file that is mapped in memory. Each
+ * serving thread reserves space for its records by atomically incrementing the
+ * 'used' field of the header, so no locks are needed. The size of a record is
+ * written last, so that a reader can detect records that were not completely
+ * written (for example if the daemon crashed). Once the file is full, new
+ * records are discarded.
+ */
+
+uint64_t
+proxy_trace_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int32_t
+proxy_trace_open(proxy_trace_t *trace, const char *path, uint64_t size,
+                 uint32_t max_data)
+{
+    proxy_trace_header_t *header;
+    int32_t fd, err;
+
+    if (size < sizeof(proxy_trace_header_t) + sizeof(proxy_trace_record_t)) {
+        return proxy_log(LOG_ERR, EINVAL, "Trace file size is too small");
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return proxy_log(LOG_ERR, errno, "Unable to create the trace file");
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        err = proxy_log(LOG_ERR, errno, "Unable to allocate the trace file");
+        goto failed;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        err = proxy_log(LOG_ERR, errno, "Unable to map the trace file");
+        goto failed;
+    }
+
+    header->magic = PROXY_TRACE_MAGIC;
+    header->version = PROXY_TRACE_VERSION;
+    header->major = LIBCEPHFSD_MAJOR;
+    header->minor = LIBCEPHFSD_MINOR;
+    header->reserved = 0;
+    header->max_data = max_data;
+    header->size = size;
+    header->used = sizeof(proxy_trace_header_t);
+
+    trace->header = header;
+    trace->start = proxy_trace_now();
+    trace->clients = 0;
+    trace->fd = fd;
+    trace->full = false;
+
+    return 0;
+
+failed:
+    close(fd);
+    unlink(path);
+
+    return err;
+}
+
+void
+proxy_trace_close(proxy_trace_t *trace)
+{
+    proxy_trace_header_t *header;
+    uint64_t size;
+
+    header = trace->header;
+
+    size = header->size;
+    if (header->used < size) {
+        size = header->used;
+    }
+    header->used = size;
+
+    munmap(header, header->size);
+
+    /* Release the space not used by the trace. */
+    if (ftruncate(trace->fd, size) < 0) {
+        proxy_log(LOG_WARN, errno, "Unable to truncate the trace file");
+    }
+
+    close(trace->fd);
+}
+
+/* Get a unique identifier for a new client connection. */
+uint32_t
+proxy_trace_client(proxy_trace_t *trace)
+{
+    return __atomic_add_fetch(&trace->clients, 1, __ATOMIC_RELAXED);
+}
+
+void
+proxy_trace_add(proxy_trace_t *trace, uint32_t client, uint64_t time,
+                proxy_link_req_t *req, const void *data,
+                proxy_link_ans_t *ans)
+{
+    proxy_trace_header_t *header;
+    proxy_trace_record_t *record;
+    uint64_t offset, now;
+    uint32_t size, stored;
+    void *ptr;
+
+    now = proxy_trace_now();
+
+    header = trace->header;
+
+    /* The data of big writes is received by segments, so it's not available
+     * here. */
+    stored = (data != NULL) ? req->data_len : 0;
+    if (stored > header->max_data) {
+        stored = header->max_data;
+    }
+
+    size = sizeof(proxy_trace_record_t) + req->header_len + ans->header_len +
+           stored;
+    size = (size + 7) & ~7;
+
+    offset = __atomic_fetch_add(&header->used, size, __ATOMIC_RELAXED);
+    if (offset + size > header->size) {
+        if (!trace->full) {
+            trace->full = true;
+            proxy_log(LOG_WARN, ENOSPC, "Trace file is full");
+        }
+        return;
+    }
+
+    record = (proxy_trace_record_t *)((uintptr_t)header + offset);
+
+    record->client = client;
+    record->time = time - trace->start;
+    record->latency = now - time;
+    record->req_len = req->header_len;
+    record->ans_len = ans->header_len;
+    record->data_len = req->data_len;
+    record->data_stored = stored;
+    record->reserved = 0;
+
+    memcpy(proxy_trace_req(record), req, req->header_len);
+    memcpy(proxy_trace_ans(record), ans, ans->header_len);
+
+    ptr = proxy_trace_data(record);
+    if (stored > 0) {
+        memcpy(ptr, data, stored);
+    }
+
+    __atomic_store_n(&record->size, size, __ATOMIC_RELEASE);
+}
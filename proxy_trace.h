@@ -0,0 +1,119 @@
+
+#ifndef __LIBCEPHFSD_PROXY_TRACE_H__
+#define __LIBCEPHFSD_PROXY_TRACE_H__
+
+#include "proxy.h"
+#include "proxy_link.h"
+
+#define PROXY_TRACE_MAGIC 0x63727470 // 'ptrc'
+#define PROXY_TRACE_VERSION 1
+
+/* Default size of the trace file and maximum amount of request data stored
+ * for each request. */
+#define PROXY_TRACE_SIZE (256ULL * 1024 * 1024)
+#define PROXY_TRACE_DATA 4096
+
+/* A trace file starts with this header, followed by a sequence of records.
+ * Records are stored in the order in which requests complete. A record with a
+ * size of 0 marks the end of the trace. */
+typedef struct _proxy_trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t major;
+    uint16_t minor;
+    uint16_t reserved;
+    uint32_t max_data;
+    uint64_t size;
+    uint64_t used;
+} proxy_trace_header_t;
+
+/* Each record is followed by the request header (req_len bytes), the answer
+ * header (ans_len bytes) and the first data_stored bytes of the request data.
+ * Records are padded to a multiple of 8 bytes. Times are in nanoseconds. */
+typedef struct _proxy_trace_record {
+    uint32_t size;
+    uint32_t client;
+    uint64_t time;
+    uint64_t latency;
+    uint16_t req_len;
+    uint16_t ans_len;
+    uint32_t data_len;
+    uint32_t data_stored;
+    uint32_t reserved;
+} proxy_trace_record_t;
+
+typedef struct _proxy_trace {
+    proxy_trace_header_t *header;
+    uint64_t start;
+    uint32_t clients;
+    int32_t fd;
+    bool full;
+} proxy_trace_t;
+
+static inline proxy_trace_record_t *
+proxy_trace_next(proxy_trace_header_t *header, proxy_trace_record_t *record)
+{
+    uint64_t offset, size;
+
+    size = header->used;
+    if (size > header->size) {
+        size = header->size;
+    }
+
+    if (record == NULL) {
+        offset = sizeof(proxy_trace_header_t);
+    } else {
+        offset = (uintptr_t)record - (uintptr_t)header + record->size;
+    }
+
+    if (offset + sizeof(proxy_trace_record_t) > size) {
+        return NULL;
+    }
+
+    record = (proxy_trace_record_t *)((uintptr_t)header + offset);
+    if ((record->size < sizeof(proxy_trace_record_t)) ||
+        (offset + record->size > size)) {
+        return NULL;
+    }
+
+    return record;
+}
+
+static inline void *
+proxy_trace_req(proxy_trace_record_t *record)
+{
+    return (void *)(record + 1);
+}
+
+static inline void *
+proxy_trace_ans(proxy_trace_record_t *record)
+{
+    return (void *)((uintptr_t)(record + 1) + record->req_len);
+}
+
+static inline void *
+proxy_trace_data(proxy_trace_record_t *record)
+{
+    return (void *)((uintptr_t)(record + 1) + record->req_len +
+                    record->ans_len);
+}
+
+uint64_t
+proxy_trace_now(void);
+
+int32_t
+proxy_trace_open(proxy_trace_t *trace, const char *path, uint64_t size,
+                 uint32_t max_data);
+
+void
+proxy_trace_close(proxy_trace_t *trace);
+
+uint32_t
+proxy_trace_client(proxy_trace_t *trace);
+
+void
+proxy_trace_add(proxy_trace_t *trace, uint32_t client, uint64_t time,
+                proxy_link_req_t *req, const void *data,
+                proxy_link_ans_t *ans);
+
+#endif
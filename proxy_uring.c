@@ -0,0 +1,295 @@
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "proxy_uring.h"
+#include "proxy_helpers.h"
+#include "proxy_log.h"
+
+/* io_uring based socket I/O
+ *
+ * Answers are not sent immediately. Their data is copied into the buffer of
+ * the ring of the serving thread, and the send is submitted together with the
+ * read of the next request, so that both operations only need a single
+ * system call. Since the answer is always followed by the read of the next
+ * request, it's never delayed.
+ *
+ * The ring is used directly through the system calls, without liburing. */
+
+enum {
+    PROXY_URING_SEND = 1,
+    PROXY_URING_RECV
+};
+
+static int32_t
+proxy_uring_setup(uint32_t entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int32_t
+proxy_uring_enter(int32_t fd, uint32_t submit, uint32_t wait)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait,
+                   IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+int32_t
+proxy_uring_create(proxy_uring_t **puring)
+{
+    struct io_uring_params params;
+    proxy_uring_t *uring;
+    int32_t err;
+
+    uring = proxy_malloc(sizeof(proxy_uring_t));
+    if (uring == NULL) {
+        return -ENOMEM;
+    }
+
+    memset(&params, 0, sizeof(params));
+    uring->fd = proxy_uring_setup(PROXY_URING_ENTRIES, &params);
+    if (uring->fd < 0) {
+        err = proxy_log(LOG_ERR, errno, "Failed to create an io_uring");
+        goto failed;
+    }
+
+    uring->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        if (uring->cq_size > uring->sq_size) {
+            uring->sq_size = uring->cq_size;
+        }
+        uring->cq_size = 0;
+    }
+
+    uring->sq_ptr = mmap(NULL, uring->sq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring->fd,
+                         IORING_OFF_SQ_RING);
+    if (uring->sq_ptr == MAP_FAILED) {
+        err = proxy_log(LOG_ERR, errno, "Failed to map the io_uring SQ");
+        goto failed_close;
+    }
+
+    uring->cq_ptr = uring->sq_ptr;
+    if (uring->cq_size > 0) {
+        uring->cq_ptr = mmap(NULL, uring->cq_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, uring->fd,
+                             IORING_OFF_CQ_RING);
+        if (uring->cq_ptr == MAP_FAILED) {
+            err = proxy_log(LOG_ERR, errno, "Failed to map the io_uring CQ");
+            goto failed_sq;
+        }
+    }
+
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        err = proxy_log(LOG_ERR, errno, "Failed to map the io_uring SQEs");
+        goto failed_cq;
+    }
+
+    uring->sq_head = uring->sq_ptr + params.sq_off.head;
+    uring->sq_tail = uring->sq_ptr + params.sq_off.tail;
+    uring->sq_mask = uring->sq_ptr + params.sq_off.ring_mask;
+    uring->sq_array = uring->sq_ptr + params.sq_off.array;
+
+    uring->cq_head = uring->cq_ptr + params.cq_off.head;
+    uring->cq_tail = uring->cq_ptr + params.cq_off.tail;
+    uring->cq_mask = uring->cq_ptr + params.cq_off.ring_mask;
+    uring->cqes = uring->cq_ptr + params.cq_off.cqes;
+
+    uring->sd = -1;
+    uring->used = 0;
+
+    *puring = uring;
+
+    return 0;
+
+failed_cq:
+    if (uring->cq_size > 0) {
+        munmap(uring->cq_ptr, uring->cq_size);
+    }
+
+failed_sq:
+    munmap(uring->sq_ptr, uring->sq_size);
+
+failed_close:
+    close(uring->fd);
+
+failed:
+    proxy_free(uring);
+
+    return err;
+}
+
+void
+proxy_uring_destroy(proxy_uring_t *uring)
+{
+    munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_size > 0) {
+        munmap(uring->cq_ptr, uring->cq_size);
+    }
+    munmap(uring->sq_ptr, uring->sq_size);
+    close(uring->fd);
+
+    proxy_free(uring);
+}
+
+static void
+proxy_uring_prepare(proxy_uring_t *uring, uint8_t opcode, int32_t sd,
+                    void *addr, uint32_t len, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t tail, idx;
+
+    /* We are the only producer, and there are never more than two entries
+     * in flight, so the ring can't be full. */
+    tail = *uring->sq_tail;
+    idx = tail & *uring->sq_mask;
+
+    sqe = &uring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = sd;
+    sqe->addr = ptr_value(addr);
+    sqe->len = len;
+    sqe->user_data = data;
+    if (opcode == IORING_OP_SEND) {
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    uring->sq_array[idx] = idx;
+
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Sends the part of the queued data that the kernel didn't accept. */
+static int32_t
+proxy_uring_send_rest(proxy_uring_t *uring, uint32_t sent)
+{
+    ssize_t len;
+
+    while (sent < uring->used) {
+        len = send(uring->sd, uring->buffer + sent, uring->used - sent,
+                   MSG_NOSIGNAL);
+        if (len < 0) {
+            return -errno;
+        }
+        sent += len;
+    }
+
+    return 0;
+}
+
+/* Queue the data to be sent with the next submission. Returns -ENOBUFS if it
+ * doesn't fit in the buffer. */
+int32_t
+proxy_uring_send(proxy_uring_t *uring, int32_t sd, struct iovec *iov,
+                 int32_t count)
+{
+    int32_t i, total, err;
+
+    if ((uring->used > 0) && (uring->sd != sd)) {
+        err = proxy_uring_flush(uring, -1, NULL, 0);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    total = 0;
+    for (i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total > PROXY_URING_BUFFER - uring->used) {
+        return -ENOBUFS;
+    }
+
+    for (i = 0; i < count; i++) {
+        memcpy(uring->buffer + uring->used, iov[i].iov_base, iov[i].iov_len);
+        uring->used += iov[i].iov_len;
+    }
+    uring->sd = sd;
+
+    return total;
+}
+
+/* Submit the queued data and, if 'count' is not 0, a read into 'iov', and wait
+ * for both of them. Returns the result of the read. */
+int32_t
+proxy_uring_flush(proxy_uring_t *uring, int32_t sd, struct iovec *iov,
+                  int32_t count)
+{
+    struct io_uring_cqe *cqe;
+    uint32_t head, tail, waiting, submit;
+    int32_t err, res;
+    bool submitted;
+
+    waiting = 0;
+    if (uring->used > 0) {
+        proxy_uring_prepare(uring, IORING_OP_SEND, uring->sd, uring->buffer,
+                            uring->used, PROXY_URING_SEND);
+        waiting++;
+    }
+    if (count > 0) {
+        proxy_uring_prepare(uring, IORING_OP_READV, sd, iov, count,
+                            PROXY_URING_RECV);
+        waiting++;
+    }
+
+    err = 0;
+    res = 0;
+    submitted = false;
+    while (waiting > 0) {
+        submit = *uring->sq_tail -
+                 __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+        if (proxy_uring_enter(uring->fd, submit, 1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (submitted) {
+                /* The kernel could still write into the buffers of the
+                 * operations in flight once we return. */
+                proxy_abort(errno, "io_uring failed with pending operations");
+            }
+            *uring->sq_tail = *uring->sq_head;
+            uring->used = 0;
+
+            return proxy_log(LOG_ERR, errno, "Failed to enter the io_uring");
+        }
+        submitted = true;
+
+        head = *uring->cq_head;
+        tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            cqe = &uring->cqes[head & *uring->cq_mask];
+            if (cqe->user_data == PROXY_URING_SEND) {
+                if (cqe->res < 0) {
+                    err = cqe->res;
+                } else {
+                    /* The answer must be complete before the peer sends the
+                     * next request, so this can't wait for the read. */
+                    err = proxy_uring_send_rest(uring, cqe->res);
+                }
+                uring->used = 0;
+            } else {
+                res = cqe->res;
+            }
+            head++;
+            waiting--;
+        }
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (err < 0) {
+        return proxy_log(LOG_ERR, -err, "Failed to send data");
+    }
+    if (res < 0) {
+        return proxy_log(LOG_ERR, -res, "Failed to receive data");
+    }
+
+    return res;
+}
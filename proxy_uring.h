@@ -0,0 +1,60 @@
+
+#ifndef __LIBCEPHFSD_PROXY_URING_H__
+#define __LIBCEPHFSD_PROXY_URING_H__
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "proxy.h"
+
+/* Number of entries of each ring and size of the buffer where the data of
+ * queued sends is kept. */
+#define PROXY_URING_ENTRIES 8
+#define PROXY_URING_BUFFER 65536
+
+typedef struct _proxy_uring {
+    int32_t fd;
+
+    void *sq_ptr;
+    size_t sq_size;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    void *cq_ptr;
+    size_t cq_size;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Data of the sends queued since the last submission. */
+    int32_t sd;
+    uint32_t used;
+    uint8_t buffer[PROXY_URING_BUFFER];
+} proxy_uring_t;
+
+int32_t
+proxy_uring_create(proxy_uring_t **puring);
+
+void
+proxy_uring_destroy(proxy_uring_t *uring);
+
+int32_t
+proxy_uring_send(proxy_uring_t *uring, int32_t sd, struct iovec *iov,
+                 int32_t count);
+
+int32_t
+proxy_uring_flush(proxy_uring_t *uring, int32_t sd, struct iovec *iov,
+                  int32_t count);
+
+static inline bool
+proxy_uring_pending(proxy_uring_t *uring)
+{
+    return uring->used > 0;
+}
+
+#endif
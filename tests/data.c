@@ -0,0 +1,334 @@
+
+#include "test_common.h"
+
+#include <stdlib.h>
+
+#define DATA_SIZE (512 * 1024)
+#define CHUNK_SIZE 4096
+#define WRITE_SIZE 128
+
+static char data[DATA_SIZE];
+static char back[DATA_SIZE];
+
+static int32_t
+verify(int32_t err, const char *what, const char *expected, int32_t size)
+{
+    if (err < 0) {
+        return err;
+    }
+
+    if (err != size) {
+        printf("%s: unexpected size %d (expected %d)\n", what, err, size);
+        return -EIO;
+    }
+    if (memcmp(back, expected, size) != 0) {
+        printf("%s: data mismatch\n", what);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int32_t
+expect(int32_t err, int32_t expected)
+{
+    if (err == expected) {
+        return 0;
+    }
+
+    printf("Unexpected result %d (expected %d)\n", err, expected);
+
+    return -EIO;
+}
+
+static int32_t
+file_create(struct ceph_mount_info *cmount, struct Inode *dir,
+            const char *name, struct Inode **file, struct Fh **fh,
+            UserPerm *perms)
+{
+    struct ceph_statx stx;
+    int32_t err;
+
+    err = 0;
+    CHECK(err, ceph_ll_create, cmount, dir, name, 0644,
+                               O_CREAT | O_TRUNC | O_RDWR, file, fh, &stx, 0,
+                               0, perms);
+
+    return err;
+}
+
+static int32_t
+file_remove(struct ceph_mount_info *cmount, struct Inode *dir,
+            const char *name, struct Inode *file, struct Fh *fh,
+            UserPerm *perms)
+{
+    int32_t err;
+
+    err = 0;
+    CHECK(err, ceph_ll_close, cmount, fh);
+    ceph_ll_put(cmount, file);
+    CHECK(err, ceph_ll_unlink, cmount, dir, name, perms);
+
+    return err;
+}
+
+/* Write 'size' bytes of the test data at 'offset' with small writes. */
+static int32_t
+write_chunks(struct ceph_mount_info *cmount, struct Fh *fh, int32_t offset,
+             int32_t size)
+{
+    int32_t err;
+
+    for (err = 0; (err >= 0) && (size > 0); size -= CHUNK_SIZE) {
+        err = expect(ceph_ll_write(cmount, fh, offset, CHUNK_SIZE,
+                                   data + offset),
+                     CHUNK_SIZE);
+        offset += CHUNK_SIZE;
+    }
+
+    return err;
+}
+
+/* Small writes are buffered, but reads from another handle, attribute
+ * requests and fsync must see them. */
+static int32_t
+test_write_behind(struct ceph_mount_info *cmount, struct Inode *dir,
+                  UserPerm *perms)
+{
+    struct ceph_statx stx;
+    struct Inode *file;
+    struct Fh *fh, *other;
+    int32_t err, offset, res;
+
+    err = file_create(cmount, dir, "write_behind", &file, &fh, perms);
+    if (err < 0) {
+        return err;
+    }
+
+    for (offset = 0; (err >= 0) && (offset < CHUNK_SIZE);
+         offset += WRITE_SIZE) {
+        res = ceph_ll_write(cmount, fh, offset, WRITE_SIZE, data + offset);
+        err = expect(res, WRITE_SIZE);
+    }
+
+    CHECK(err, ceph_ll_open, cmount, file, O_RDONLY, &other, perms);
+    CHECK(err, ceph_ll_read, cmount, other, 0, CHUNK_SIZE, back);
+    err = verify(err, "read from another handle", data, CHUNK_SIZE);
+    CHECK(err, ceph_ll_close, cmount, other);
+
+    CHECK(err, ceph_ll_write, cmount, fh, CHUNK_SIZE, 10, "0123456789");
+    CHECK(err, ceph_ll_getattr, cmount, file, &stx, CEPH_STATX_SIZE, 0, perms);
+    if ((err >= 0) && (stx.stx_size != CHUNK_SIZE + 10)) {
+        printf("Unexpected size %lu\n", stx.stx_size);
+        err = -EIO;
+    }
+    CHECK(err, ceph_ll_fsync, cmount, fh, 0);
+
+    res = file_remove(cmount, dir, "write_behind", file, fh, perms);
+
+    return err < 0 ? err : res;
+}
+
+/* Sequential reads enable the read-ahead. Writes through the same mount must
+ * be visible to the reads that follow, even if the data was prefetched. */
+static int32_t
+test_read_ahead(struct ceph_mount_info *cmount, struct Inode *dir,
+                UserPerm *perms)
+{
+    struct Inode *file;
+    struct Fh *fh;
+    int32_t err, offset, res;
+
+    err = file_create(cmount, dir, "read_ahead", &file, &fh, perms);
+    if (err < 0) {
+        return err;
+    }
+
+    err = write_chunks(cmount, fh, 0, DATA_SIZE / 4);
+    for (offset = 0; (err >= 0) && (offset < DATA_SIZE / 8);
+         offset += CHUNK_SIZE) {
+        res = ceph_ll_read(cmount, fh, offset, CHUNK_SIZE, back);
+        err = verify(res, "sequential read", data + offset, CHUNK_SIZE);
+    }
+
+    memset(data + DATA_SIZE / 8, 'x', CHUNK_SIZE);
+    CHECK(err, ceph_ll_write, cmount, fh, DATA_SIZE / 8, CHUNK_SIZE,
+                              data + DATA_SIZE / 8);
+    err = expect(err, CHUNK_SIZE);
+    CHECK(err, ceph_ll_read, cmount, fh, DATA_SIZE / 8, CHUNK_SIZE, back);
+    err = verify(err, "read after write", data + DATA_SIZE / 8, CHUNK_SIZE);
+
+    res = file_remove(cmount, dir, "read_ahead", file, fh, perms);
+
+    return err < 0 ? err : res;
+}
+
+/* Reads bigger than the buffers of the daemon are done in segments. */
+static int32_t
+test_large_read(struct ceph_mount_info *cmount, struct Inode *dir,
+                UserPerm *perms)
+{
+    struct Inode *file;
+    struct Fh *fh;
+    int32_t err, res;
+
+    err = file_create(cmount, dir, "large_read", &file, &fh, perms);
+    if (err < 0) {
+        return err;
+    }
+
+    err = write_chunks(cmount, fh, 0, DATA_SIZE);
+    memset(back, 0, sizeof(back));
+    CHECK(err, ceph_ll_read, cmount, fh, 0, DATA_SIZE, back);
+    err = verify(err, "large read", data, DATA_SIZE);
+
+    res = file_remove(cmount, dir, "large_read", file, fh, perms);
+
+    return err < 0 ? err : res;
+}
+
+/* Writes bigger than the buffers of the daemon are received in segments. */
+static int32_t
+test_large_write(struct ceph_mount_info *cmount, struct Inode *dir,
+                 UserPerm *perms)
+{
+    struct Inode *file;
+    struct Fh *fh;
+    int32_t err, offset, res;
+
+    err = file_create(cmount, dir, "large_write", &file, &fh, perms);
+    if (err < 0) {
+        return err;
+    }
+
+    CHECK(err, ceph_ll_write, cmount, fh, 0, DATA_SIZE, data);
+    err = expect(err, DATA_SIZE);
+    for (offset = 0; (err >= 0) && (offset < DATA_SIZE);
+         offset += CHUNK_SIZE) {
+        res = ceph_ll_read(cmount, fh, offset, CHUNK_SIZE, back);
+        err = verify(res, "read of a large write", data + offset,
+                     CHUNK_SIZE);
+    }
+
+    res = file_remove(cmount, dir, "large_write", file, fh, perms);
+
+    return err < 0 ? err : res;
+}
+
+/* Copies are done by the daemon and may be shorter than requested. */
+static int32_t
+test_copy_range(struct ceph_mount_info *cmount, struct Inode *dir,
+                UserPerm *perms)
+{
+    struct Inode *src, *dst;
+    struct Fh *src_fh, *dst_fh;
+    int32_t err, offset, res;
+
+    err = file_create(cmount, dir, "copy_src", &src, &src_fh, perms);
+    if (err < 0) {
+        return err;
+    }
+    err = file_create(cmount, dir, "copy_dst", &dst, &dst_fh, perms);
+    if (err < 0) {
+        file_remove(cmount, dir, "copy_src", src, src_fh, perms);
+        return err;
+    }
+
+    err = write_chunks(cmount, src_fh, 0, DATA_SIZE);
+
+    offset = 0;
+    while ((err >= 0) && (offset < DATA_SIZE)) {
+        CHECK(err, ceph_ll_copy_range, cmount, src_fh, offset, dst_fh, offset,
+                                       DATA_SIZE - offset);
+        if (err == 0) {
+            printf("Copy stopped at %d\n", offset);
+            err = -EIO;
+        }
+        if (err > 0) {
+            offset += err;
+        }
+    }
+    CHECK(err, ceph_ll_read, cmount, dst_fh, 0, DATA_SIZE, back);
+    err = verify(err, "copy", data, DATA_SIZE);
+
+    /* Overlapping ranges of the same handle are rejected. */
+    if (err >= 0) {
+        err = expect(ceph_ll_copy_range(cmount, dst_fh, 0, dst_fh, 100, 1000),
+                     -EINVAL);
+    }
+
+    res = file_remove(cmount, dir, "copy_dst", dst, dst_fh, perms);
+    if (err >= 0) {
+        err = res;
+    }
+    res = file_remove(cmount, dir, "copy_src", src, src_fh, perms);
+
+    return err < 0 ? err : res;
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+    struct ceph_statx stx;
+    struct ceph_mount_info *cmount;
+    UserPerm *perms;
+    struct Inode *root, *dir;
+    int32_t i, err;
+
+    if (argc < 3) {
+        printf("Usage: %s <id> <config file> [<fs>]\n", argv[0]);
+        return 1;
+    }
+
+    /* Sizes in KiB. They must be set before the first request. */
+    setenv("LIBCEPHFSD_READ_AHEAD", "64", 1);
+    setenv("LIBCEPHFSD_WRITE_BEHIND", "64", 1);
+
+    test_init();
+
+    for (i = 0; i < DATA_SIZE; i++) {
+        data[i] = random();
+    }
+
+    err = 0;
+    CHECK(err, ceph_create, &cmount, argv[1]);
+    CHECK(err, ceph_conf_read_file, cmount, argv[2]);
+    CHECK(err, ceph_init, cmount);
+    if (argc > 3) {
+        CHECK(err, ceph_select_filesystem, cmount, argv[3]);
+    }
+    CHECK(err, ceph_mount, cmount, NULL);
+    perms = CHECK_PTR(err, ceph_userperm_new, 0, 0, 0, NULL);
+    CHECK(err, ceph_ll_lookup_root, cmount, &root);
+    CHECK(err, ceph_ll_mkdir, cmount, root, "data.1", 0755, &dir, &stx, 0, 0,
+                              perms);
+    if (err < 0) {
+        return 1;
+    }
+
+    if (err >= 0) {
+        err = test_write_behind(cmount, dir, perms);
+    }
+    if (err >= 0) {
+        err = test_read_ahead(cmount, dir, perms);
+    }
+    if (err >= 0) {
+        err = test_large_read(cmount, dir, perms);
+    }
+    if (err >= 0) {
+        err = test_large_write(cmount, dir, perms);
+    }
+    if (err >= 0) {
+        err = test_copy_range(cmount, dir, perms);
+    }
+
+    ceph_ll_put(cmount, dir);
+    CHECK(err, ceph_ll_rmdir, cmount, root, "data.1", perms);
+    ceph_userperm_destroy(perms);
+    CHECK(err, ceph_unmount, cmount);
+    CHECK(err, ceph_release, cmount);
+
+    test_done();
+
+    return err < 0 ? 1 : 0;
+}
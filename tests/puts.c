@@ -0,0 +1,123 @@
+
+#include "test_common.h"
+
+#include <stdlib.h>
+
+/* Inode releases are queued in batches of 64 and not sent while disconnected.
+ * Releasing more than two batches with the daemon stopped fills the queue
+ * after a failed send, so the following releases must wait for a connection
+ * instead of overflowing it. */
+#define FILES (2 * 64 + 2)
+
+static int32_t
+test_puts(struct ceph_mount_info *cmount, struct Inode *dir, UserPerm *perms,
+          const char *stop, const char *start)
+{
+    struct Inode *files[FILES];
+    struct ceph_statx stx;
+    struct Fh *fh;
+    char name[32];
+    int32_t i, count, failed, err;
+
+    err = 0;
+    for (count = 0; (err >= 0) && (count < FILES); count++) {
+        sprintf(name, "file.%d", count);
+        CHECK(err, ceph_ll_create, cmount, dir, name, 0644,
+                                   O_CREAT | O_RDWR, &files[count], &fh, &stx,
+                                   0, 0, perms);
+        if (err < 0) {
+            break;
+        }
+        CHECK(err, ceph_ll_close, cmount, fh);
+    }
+
+    printf("Stopping libcephfsd: %s\n", stop);
+    if ((err >= 0) && (system(stop) != 0)) {
+        printf("Stop command failed\n");
+        err = -EIO;
+    }
+
+    /* Releases can't be sent, but they must not fail while they can be
+     * queued. */
+    failed = 0;
+    for (i = 0; i < count; i++) {
+        if (ceph_ll_put(cmount, files[i]) < 0) {
+            failed++;
+        }
+    }
+    printf("%d of %d releases failed\n", failed, count);
+
+    printf("Starting libcephfsd: %s\n", start);
+    if (system(start) != 0) {
+        printf("Start command failed\n");
+        return -EIO;
+    }
+
+    if ((err >= 0) && ((failed == 0) || (failed > count - 64))) {
+        err = -EIO;
+    }
+
+    return err;
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+    struct ceph_mount_info *cmount;
+    struct ceph_statx stx;
+    struct Inode *root, *dir;
+    UserPerm *perms;
+    char name[32];
+    int32_t i, err;
+
+    if (argc < 5) {
+        printf("Usage: %s <id> <config file> <stop command> <start command>\n",
+               argv[0]);
+        return 1;
+    }
+
+    test_init();
+
+    err = 0;
+    CHECK(err, ceph_create, &cmount, argv[1]);
+    CHECK(err, ceph_conf_read_file, cmount, argv[2]);
+    CHECK(err, ceph_init, cmount);
+    CHECK(err, ceph_mount, cmount, NULL);
+    perms = CHECK_PTR(err, ceph_userperm_new, 0, 0, 0, NULL);
+    CHECK(err, ceph_ll_lookup_root, cmount, &root);
+    CHECK(err, ceph_ll_mkdir, cmount, root, "puts.1", 0755, &dir, &stx, 0, 0,
+                              perms);
+
+    if (err >= 0) {
+        err = test_puts(cmount, dir, perms, argv[3], argv[4]);
+    }
+
+    /* The handles of the previous session may not be valid anymore, and the
+     * files may not exist if the daemon runs on a test cluster. */
+    if (perms != NULL) {
+        ceph_userperm_destroy(perms);
+    }
+    perms = ceph_userperm_new(0, 0, 0, NULL);
+    if ((perms != NULL) && (ceph_ll_lookup_root(cmount, &root) >= 0)) {
+        if (ceph_ll_lookup(cmount, root, "puts.1", &dir, &stx, 0, 0,
+                           perms) >= 0) {
+            for (i = 0; i < FILES; i++) {
+                sprintf(name, "file.%d", i);
+                ceph_ll_unlink(cmount, dir, name, perms);
+            }
+            ceph_ll_put(cmount, dir);
+            ceph_ll_rmdir(cmount, root, "puts.1", perms);
+        }
+        ceph_ll_put(cmount, root);
+    }
+    if (perms != NULL) {
+        ceph_userperm_destroy(perms);
+    }
+
+    CHECK(err, ceph_unmount, cmount);
+    CHECK(err, ceph_release, cmount);
+
+    test_done();
+
+    return err < 0 ? 1 : 0;
+}
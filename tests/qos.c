@@ -0,0 +1,304 @@
+
+#include "test_common.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* The test changes the QoS configuration of the daemon through its text
+ * interface, and restores it at the end. Rates are per second and timeouts in
+ * milliseconds. */
+
+typedef struct _waiter {
+    struct ceph_mount_info *cmount;
+    struct Inode *inode;
+    UserPerm *perms;
+    int32_t result;
+} waiter_t;
+
+static char reply[4096];
+
+/* Send a command to the text interface of the daemon. Successful qos commands
+ * always answer with the resulting configuration, which is kept in 'reply'. */
+static int32_t
+control(const char *fmt, ...)
+{
+    struct sockaddr_un addr;
+    char buffer[256];
+    const char *path;
+    va_list args;
+    int32_t sd, len, size, err;
+
+    path = getenv(PROXY_SOCKET_ENV);
+    if ((path == NULL) || (*path == 0)) {
+        path = PROXY_SOCKET;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sd < 0) {
+        return -errno;
+    }
+
+    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        err = -errno;
+        goto done;
+    }
+
+    va_start(args, fmt);
+    len = snprintf(buffer, sizeof(buffer), "text");
+    len += vsnprintf(buffer + len, sizeof(buffer) - len - 1, fmt, args);
+    va_end(args);
+    buffer[len++] = '\n';
+
+    printf(">>>> %.*s", len - 4, buffer + 4);
+    if ((write(sd, buffer, len) != len) || (shutdown(sd, SHUT_WR) < 0)) {
+        err = -EIO;
+        goto done;
+    }
+
+    /* The daemon closes the connection once all commands are processed. */
+    size = 0;
+    while ((size < sizeof(reply) - 1) &&
+           ((len = read(sd, reply + size, sizeof(reply) - 1 - size)) > 0)) {
+        size += len;
+    }
+    reply[size] = 0;
+    printf("%s", reply);
+
+    err = (strstr(reply, "queue max ") != NULL) ? 0 : -EINVAL;
+
+done:
+    close(sd);
+
+    return err;
+}
+
+static int32_t
+expect(int32_t err, int32_t expected)
+{
+    if (err == expected) {
+        return 0;
+    }
+
+    printf("Unexpected result %d (expected %d)\n", err, expected);
+
+    return -EIO;
+}
+
+/* Run a getattr and return how long it took, in milliseconds. */
+static int32_t
+timed_getattr(struct ceph_mount_info *cmount, struct Inode *inode,
+              UserPerm *perms, uint64_t *elapsed)
+{
+    struct ceph_statx stx;
+    struct timespec start, end;
+    int32_t err;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    err = ceph_ll_getattr(cmount, inode, &stx, CEPH_STATX_INO, 0, perms);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *elapsed = (end.tv_sec - start.tv_sec) * 1000 +
+               (end.tv_nsec - start.tv_nsec) / 1000000;
+    printf("#### ceph_ll_getattr() -> %d (%lu ms)\n", err, *elapsed);
+
+    return err;
+}
+
+/* With a rate of one request per second, a second request waits for the next
+ * token. When the connection is shared (the test runs as root), requests of
+ * other users are not affected. */
+static int32_t
+test_limit(struct ceph_mount_info *cmount, struct Inode *root,
+           UserPerm *perms, uint32_t uid)
+{
+    UserPerm *other;
+    uint64_t elapsed;
+    int32_t err;
+
+    err = 0;
+    CHECK(err, control, "qos limit %u meta 1 1", uid);
+    CHECK(err, timed_getattr, cmount, root, perms, &elapsed);
+    CHECK(err, timed_getattr, cmount, root, perms, &elapsed);
+    if ((err >= 0) && (elapsed < 500)) {
+        printf("The request was not throttled\n");
+        err = -EIO;
+    }
+
+    if ((err >= 0) && (getuid() == 0)) {
+        other = CHECK_PTR(err, ceph_userperm_new, uid + 1, uid + 1, 0, NULL);
+        CHECK(err, timed_getattr, cmount, root, other, &elapsed);
+        if ((err >= 0) && (elapsed >= 500)) {
+            printf("The request of another user was throttled\n");
+            err = -EIO;
+        }
+        if (other != NULL) {
+            ceph_userperm_destroy(other);
+        }
+    }
+
+    CHECK(err, control, "qos limit %u meta 0 0", uid);
+
+    return err;
+}
+
+static void *
+waiter_main(void *arg)
+{
+    struct ceph_statx stx;
+    waiter_t *waiter;
+
+    waiter = arg;
+    waiter->result = ceph_ll_getattr(waiter->cmount, waiter->inode, &stx,
+                                     CEPH_STATX_INO, 0, waiter->perms);
+
+    return NULL;
+}
+
+/* With a rate of one request per second, a second request can't start before
+ * the queue timeout, so it's rejected immediately. */
+static int32_t
+test_rejection(struct ceph_mount_info *cmount, struct Inode *root,
+               UserPerm *perms, uint32_t uid, uint32_t max)
+{
+    uint64_t elapsed;
+    int32_t err;
+
+    err = 0;
+    CHECK(err, control, "qos queue %u 100", max);
+    CHECK(err, control, "qos limit %u meta 1 1", uid);
+    CHECK(err, timed_getattr, cmount, root, perms, &elapsed);
+    if (err >= 0) {
+        err = expect(timed_getattr(cmount, root, perms, &elapsed), -EAGAIN);
+    }
+    if ((err >= 0) && (elapsed >= 100)) {
+        printf("The request was not rejected immediately\n");
+        err = -EIO;
+    }
+
+    CHECK(err, control, "qos limit %u meta 0 0", uid);
+    CHECK(err, control, "qos queue %u 0", max);
+
+    return err;
+}
+
+/* A request waiting for its rate limit can be cancelled from another thread,
+ * and the following requests are not affected. Nothing can be cancelled when
+ * no call is waiting. */
+static int32_t
+test_cancel(struct ceph_mount_info *cmount, struct Inode *root,
+            UserPerm *perms, uint32_t uid)
+{
+    struct ceph_statx stx;
+    waiter_t waiter;
+    pthread_t tid;
+    int32_t err;
+
+    err = expect(ceph_cancel(cmount), -ENOENT);
+    CHECK(err, control, "qos limit %u meta 1 1", uid);
+    CHECK(err, ceph_ll_getattr, cmount, root, &stx, CEPH_STATX_INO, 0, perms);
+    if (err < 0) {
+        return err;
+    }
+
+    waiter.cmount = cmount;
+    waiter.inode = root;
+    waiter.perms = perms;
+    err = pthread_create(&tid, NULL, waiter_main, &waiter);
+    if (err != 0) {
+        return -err;
+    }
+
+    usleep(200000);
+    CHECK(err, ceph_cancel, cmount);
+    pthread_join(tid, NULL);
+
+    if (err >= 0) {
+        err = expect(waiter.result, -ECANCELED);
+    }
+
+    CHECK(err, control, "qos limit %u meta 0 0", uid);
+    CHECK(err, ceph_ll_getattr, cmount, root, &stx, CEPH_STATX_INO, 0, perms);
+
+    return err;
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+    struct ceph_mount_info *cmount;
+    struct Inode *root;
+    UserPerm *perms;
+    char *text;
+    uint32_t uid, max, timeout;
+    int32_t err;
+
+    if (argc < 3) {
+        printf("Usage: %s <id> <config file> [<fs>]\n", argv[0]);
+        return 1;
+    }
+
+    test_init();
+
+    /* Requests sent by root are charged to the uid of their UserPerm. Other
+     * users are always charged for their own requests. */
+    uid = getuid();
+    if (uid == 0) {
+        uid = 65000;
+    }
+
+    err = 0;
+    CHECK(err, control, "qos");
+    if (err < 0) {
+        return 1;
+    }
+    text = strstr(reply, "queue max ");
+    if (sscanf(text, "queue max %u timeout %u", &max, &timeout) != 2) {
+        printf("Unable to parse the queue configuration\n");
+        return 1;
+    }
+
+    CHECK(err, ceph_create, &cmount, argv[1]);
+    CHECK(err, ceph_conf_read_file, cmount, argv[2]);
+    CHECK(err, ceph_init, cmount);
+    if (argc > 3) {
+        CHECK(err, ceph_select_filesystem, cmount, argv[3]);
+    }
+    CHECK(err, ceph_mount, cmount, NULL);
+    perms = CHECK_PTR(err, ceph_userperm_new, uid, uid, 0, NULL);
+    CHECK(err, ceph_ll_lookup_root, cmount, &root);
+
+    /* Throttled requests must not be rejected for waiting too long. */
+    CHECK(err, control, "qos queue %u 0", max);
+
+    if (err >= 0) {
+        err = test_limit(cmount, root, perms, uid);
+    }
+    if (err >= 0) {
+        err = test_rejection(cmount, root, perms, uid, max);
+    }
+    if (err >= 0) {
+        err = test_cancel(cmount, root, perms, uid);
+    }
+
+    control("qos limit %u meta 0 0", uid);
+    control("qos queue %u %u", max, timeout);
+
+    if (perms != NULL) {
+        ceph_userperm_destroy(perms);
+    }
+    CHECK(err, ceph_unmount, cmount);
+    CHECK(err, ceph_release, cmount);
+
+    test_done();
+
+    return err < 0 ? 1 : 0;
+}
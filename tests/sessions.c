@@ -0,0 +1,134 @@
+
+#include "test_common.h"
+
+#include <stdlib.h>
+
+static int32_t
+mount_create(struct ceph_mount_info **cmount, const char *id,
+             const char *config)
+{
+    int32_t err;
+
+    err = 0;
+    CHECK(err, ceph_create, cmount, id);
+    CHECK(err, ceph_conf_read_file, *cmount, config);
+    CHECK(err, ceph_init, *cmount);
+    CHECK(err, ceph_mount, *cmount, NULL);
+
+    return err;
+}
+
+static int32_t
+mount_destroy(struct ceph_mount_info *cmount)
+{
+    int32_t err;
+
+    err = 0;
+    CHECK(err, ceph_unmount, cmount);
+    CHECK(err, ceph_release, cmount);
+
+    return err;
+}
+
+/* Handles are bound to the session of the connection that created them, so
+ * they can't be used from another mount. */
+static int32_t
+test_isolation(struct ceph_mount_info *cmount1,
+               struct ceph_mount_info *cmount2, UserPerm *perms)
+{
+    struct ceph_statx stx;
+    struct Inode *root;
+    int32_t err;
+
+    err = 0;
+    CHECK(err, ceph_ll_lookup_root, cmount1, &root);
+    CHECK(err, ceph_ll_getattr, cmount1, root, &stx, CEPH_STATX_INO, 0, perms);
+    if (err >= 0) {
+        err = ceph_ll_getattr(cmount2, root, &stx, CEPH_STATX_INO, 0, perms);
+        printf("Handle of another session -> %d\n", err);
+        err = (err == -ESTALE) ? 0 : -EIO;
+    }
+    ceph_ll_put(cmount1, root);
+
+    return err;
+}
+
+/* After a restart of the daemon, the mount is rebuilt on a new session. The
+ * first request detects the restart, and fails if its handles belonged to the
+ * previous session. Everything obtained afterwards must work. */
+static int32_t
+test_restart(struct ceph_mount_info *cmount, UserPerm *perms,
+             const char *command)
+{
+    struct ceph_statx stx;
+    struct Inode *root;
+    int32_t err;
+
+    err = 0;
+    CHECK(err, ceph_ll_lookup_root, cmount, &root);
+    if (err < 0) {
+        return err;
+    }
+
+    printf("Restarting libcephfsd: %s\n", command);
+    if (system(command) != 0) {
+        printf("Restart command failed\n");
+        return -EIO;
+    }
+
+    err = ceph_ll_getattr(cmount, root, &stx, CEPH_STATX_INO, 0, perms);
+    printf("First request after the restart -> %d\n", err);
+
+    err = 0;
+    CHECK(err, ceph_ll_lookup_root, cmount, &root);
+    perms = CHECK_PTR(err, ceph_userperm_new, 0, 0, 0, NULL);
+    CHECK(err, ceph_ll_getattr, cmount, root, &stx, CEPH_STATX_INO, 0, perms);
+    if (perms != NULL) {
+        ceph_userperm_destroy(perms);
+    }
+    if (err >= 0) {
+        ceph_ll_put(cmount, root);
+    }
+
+    return err;
+}
+
+int32_t
+main(int32_t argc, char *argv[])
+{
+    struct ceph_mount_info *cmount1, *cmount2;
+    UserPerm *perms;
+    int32_t err;
+
+    if (argc < 3) {
+        printf("Usage: %s <id> <config file> [<restart command>]\n", argv[0]);
+        return 1;
+    }
+
+    test_init();
+
+    err = mount_create(&cmount1, argv[1], argv[2]);
+    if (err >= 0) {
+        err = mount_create(&cmount2, argv[1], argv[2]);
+    }
+    perms = CHECK_PTR(err, ceph_userperm_new, 0, 0, 0, NULL);
+
+    if (err >= 0) {
+        err = test_isolation(cmount1, cmount2, perms);
+    }
+    CHECK(err, mount_destroy, cmount2);
+
+    if ((err >= 0) && (argc > 3)) {
+        err = test_restart(cmount1, perms, argv[3]);
+    }
+
+    if (perms != NULL) {
+        ceph_userperm_destroy(perms);
+    }
+
+    CHECK(err, mount_destroy, cmount1);
+
+    test_done();
+
+    return err < 0 ? 1 : 0;
+}
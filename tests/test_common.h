@@ -10,6 +10,9 @@
 
 #include <cephfs/libcephfs.h>
 
+/* Extensions provided by libcephfs_proxy. */
+#include "libcephfsd.h"
+
 #define CHECK(_err, _func, _args...) \
     do { \
         if (_err >= 0) { \